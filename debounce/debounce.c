@@ -4,6 +4,7 @@
  *
  * @brief Pattern-based de-bouncing functions
  *
+ * @see http://www.mikrocontroller.net/articles/Entprellung#Timer-Verfahren_.28nach_Peter_Dannegger.29
  * @see http://hackaday.com/2015/12/10/embed-with-elliot-debounce-your-noisy-buttons-part-ii/
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
@@ -21,11 +22,12 @@
 
 #include "debounce.h"
 
-/*
- * If you change this mask, the pattern masks in the below functions must
- * be changed as well!
- */
-#define DEBOUNCE_MASK 0b11000111
+// the history is stored inverted, so a press is a rise in the history
+#define DEBOUNCE_MASK     DEBOUNCE_PATTERN_MASK ( DEBOUNCE_STABLE, DEBOUNCE_CHANGED )
+#define DEBOUNCE_PRESSED_PATTERN \
+    DEBOUNCE_PATTERN_RISE ( DEBOUNCE_STABLE, DEBOUNCE_CHANGED )
+#define DEBOUNCE_RELEASED_PATTERN \
+    DEBOUNCE_PATTERN_FALL ( DEBOUNCE_STABLE, DEBOUNCE_CHANGED )
 
 void debounce_init_button ( uint8_t *history )
 {
@@ -44,7 +46,7 @@ void debounce_update_button ( uint8_t *history,
 bool debounce_is_button_pressed ( uint8_t *history )
 {
     bool pressed = false;
-    if ( ( *history & DEBOUNCE_MASK ) == 0b00000111 ) {
+    if ( ( *history & DEBOUNCE_MASK ) == DEBOUNCE_PRESSED_PATTERN ) {
         pressed = true;
         *history = 0b11111111;
     }
@@ -54,7 +56,7 @@ bool debounce_is_button_pressed ( uint8_t *history )
 bool debounce_is_button_released ( uint8_t *history )
 {
     bool released = false;
-    if ( ( *history & DEBOUNCE_MASK ) == 0b11000000 ) {
+    if ( ( *history & DEBOUNCE_MASK ) == DEBOUNCE_RELEASED_PATTERN ) {
         released = true;
         *history = 0b00000000;
     }
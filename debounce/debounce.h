@@ -9,7 +9,18 @@
  *       logical 0 if the button is up.
  *       The history, however, is stored inverted.
  *
+ * The port functions de-bounce all 8 pins of a port at once with
+ * vertical counters: each pin has a 2-bit counter, the bits of all
+ * counters are kept in two bytes and counted with a few logic
+ * operations. A pin changes its state after it has read the other
+ * level for 4 updates in a row. Same positive logic as above.
+ *
+ * The port and input functions are defined here as always inline, so
+ * that an update from an ISR compiles to a few instructions without a
+ * call, with the pin and the configuration folded in as constants.
+ *
  * @see http://hackaday.com/2015/12/10/embed-with-elliot-debounce-your-noisy-buttons-part-ii/
+ * @see http://www.mikrocontroller.net/articles/Entprellung#Timer-Verfahren_.28nach_Peter_Dannegger.29
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -29,6 +40,36 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/// Fast path functions, also inlined without optimization
+#define DEBOUNCE_INLINE static inline __attribute__ ( ( always_inline ) )
+
+/*
+ * Pattern configuration
+ *
+ * A pattern requires the older samples of the history to show the old
+ * level for DEBOUNCE_STABLE updates and the newest samples to show the
+ * new level for DEBOUNCE_CHANGED updates; the samples in between are
+ * ignored. The sum must not exceed 8.
+ *
+ * The defaults may be overridden with -D for the button functions.
+ */
+#ifndef DEBOUNCE_STABLE
+#define DEBOUNCE_STABLE  2
+#endif
+#ifndef DEBOUNCE_CHANGED
+#define DEBOUNCE_CHANGED 3
+#endif
+
+/// History bits checked by a pattern
+#define DEBOUNCE_PATTERN_MASK(stable, changed) \
+    ( (uint8_t) ( ~( 0b11111111 >> ( stable ) ) | ( ( 1 << ( changed ) ) - 1 ) ) )
+/// Masked history after the newest samples have become 1
+#define DEBOUNCE_PATTERN_RISE(stable, changed) \
+    ( (uint8_t) ( ( 1 << ( changed ) ) - 1 ) )
+/// Masked history after the newest samples have become 0
+#define DEBOUNCE_PATTERN_FALL(stable, changed) \
+    ( (uint8_t) ~( 0b11111111 >> ( stable ) ) )
+
 /**
  * \brief Initialize the button to "button up".
  */
@@ -81,3 +122,294 @@ bool debounce_is_button_down ( uint8_t *history );
  * \return 1 if the button is up, otherwise 0
  */
 bool debounce_is_button_up ( uint8_t *history );
+
+/**
+ * \brief De-bounce state of all pins of a port.
+ */
+struct debounce_port {
+    uint8_t state;      // de-bounced state, 1 for down
+    uint8_t cnt0;       // low bits of the vertical counters
+    uint8_t cnt1;       // high bits of the vertical counters
+    uint8_t pressed;    // press events not yet taken
+    uint8_t released;   // release events not yet taken
+};
+
+/**
+ * \brief Initialize the port state from the current input.
+ * \param port    Pointer to the port state.
+ * \param pinport Current input of the port, e.g. PINA
+ */
+DEBOUNCE_INLINE
+void debounce_init_port ( struct debounce_port *port, uint8_t pinport )
+{
+    port->state = pinport;
+    port->cnt0 = 0b11111111;
+    port->cnt1 = 0b11111111;
+    port->pressed = 0;
+    port->released = 0;
+}
+
+/**
+ * \brief Update all pins of the port.
+ * \param port    Pointer to the port state.
+ * \param pinport Input of the port, e.g. PINA
+ *
+ * Note: Remember to provide the input macro for the port,
+ *       i.e. PINA instead of PORTA!
+ */
+DEBOUNCE_INLINE
+void debounce_update_port ( struct debounce_port *port, uint8_t pinport )
+{
+    // pins that differ from the de-bounced state
+    uint8_t changed = port->state ^ pinport;
+
+    // count down the pins that differ, reset the others to 3
+    port->cnt0 = ~( port->cnt0 & changed );
+    port->cnt1 = port->cnt0 ^ ( port->cnt1 & changed );
+
+    // pins whose counter has rolled over take the new state
+    changed &= port->cnt0 & port->cnt1;
+    port->state ^= changed;
+
+    port->pressed |= port->state & changed;
+    port->released |= ~port->state & changed;
+}
+
+/**
+ * \brief Take the press events of the pins.
+ * \param port Pointer to the port state.
+ * \param mask Pins to check, e.g. (1 << PA2)
+ * \return the pins of mask that have been pressed since the last call
+ *
+ * Events are kept until they are taken, so none is missed between
+ * two calls.
+ */
+DEBOUNCE_INLINE
+uint8_t debounce_port_pressed ( struct debounce_port *port, uint8_t mask )
+{
+    mask &= port->pressed;
+    port->pressed ^= mask;
+    return mask;
+}
+
+/**
+ * \brief Take the release events of the pins.
+ * \param port Pointer to the port state.
+ * \param mask Pins to check, e.g. (1 << PA2)
+ * \return the pins of mask that have been released since the last call
+ */
+DEBOUNCE_INLINE
+uint8_t debounce_port_released ( struct debounce_port *port, uint8_t mask )
+{
+    mask &= port->released;
+    port->released ^= mask;
+    return mask;
+}
+
+/**
+ * \brief Tell which pins are hold down.
+ * \param port Pointer to the port state.
+ * \param mask Pins to check, e.g. (1 << PA2)
+ * \return the pins of mask that are down
+ */
+DEBOUNCE_INLINE
+uint8_t debounce_port_down ( const struct debounce_port *port, uint8_t mask )
+{
+    return port->state & mask;
+}
+
+/**
+ * \brief Tell which pins are up.
+ * \param port Pointer to the port state.
+ * \param mask Pins to check, e.g. (1 << PA2)
+ * \return the pins of mask that are up
+ */
+DEBOUNCE_INLINE
+uint8_t debounce_port_up ( const struct debounce_port *port, uint8_t mask )
+{
+    return ~port->state & mask;
+}
+
+/*
+ * Configurable inputs
+ *
+ * Each input is de-bounced with a configuration that is set up at
+ * compile time, so every firmware can trade latency against noise
+ * immunity per input:
+ *
+ *   static const struct debounce_config cfg_btn  = DEBOUNCE_PATTERN(2, 3);
+ *   static const struct debounce_config cfg_door = DEBOUNCE_INTEGRATOR(16);
+ *
+ * The pattern algorithm reacts after the changed samples, if the signal
+ * has been stable for the stable samples before. The integrator counts
+ * up for every high and down for every low sample and changes its state
+ * when the count reaches the limit or 0, so a noisy signal is delayed,
+ * but not lost.
+ *
+ * Unlike the button functions, the state follows the pin level, i.e. 1
+ * (down) for a high pin.
+ */
+
+/// The de-bouncing algorithms
+enum debounce_algorithm {
+    DEBOUNCE_ALGO_PATTERN,
+    DEBOUNCE_ALGO_INTEGRATOR
+};
+
+/**
+ * \brief De-bounce configuration of an input.
+ */
+struct debounce_config {
+    uint8_t algorithm;  // enum debounce_algorithm
+    uint8_t mask;       // pattern: history bits to check
+    uint8_t rise;       // pattern: rising edge; integrator: count limit
+    uint8_t fall;       // pattern: falling edge
+};
+
+/// Pattern configuration, see DEBOUNCE_STABLE and DEBOUNCE_CHANGED
+#define DEBOUNCE_PATTERN(stable, changed) \
+    { DEBOUNCE_ALGO_PATTERN, \
+      DEBOUNCE_PATTERN_MASK ( stable, changed ), \
+      DEBOUNCE_PATTERN_RISE ( stable, changed ), \
+      DEBOUNCE_PATTERN_FALL ( stable, changed ) }
+
+/// Integrator configuration, samples must be 1 to 255
+#define DEBOUNCE_INTEGRATOR(samples) \
+    { DEBOUNCE_ALGO_INTEGRATOR, 0, ( samples ), 0 }
+
+/// Flags in the input state
+#define DEBOUNCE_DOWN     0b00000001
+#define DEBOUNCE_PRESSED  0b00000010
+#define DEBOUNCE_RELEASED 0b00000100
+
+/**
+ * \brief De-bounce state of an input.
+ */
+struct debounce_input {
+    uint8_t history;    // pattern: samples, newest in bit 0; integrator: count
+    uint8_t state;      // DEBOUNCE_DOWN and the events not yet taken
+};
+
+/**
+ * \brief Initialize the input state from the current level.
+ * \param input   Pointer to the input state.
+ * \param cfg     Configuration of the input.
+ * \param pinport Current input of the port, e.g. PINA
+ * \param pinpin  Pin of the input, e.g. PA2
+ */
+DEBOUNCE_INLINE
+void debounce_init_input ( struct debounce_input *input,
+                           const struct debounce_config *cfg,
+                           uint8_t pinport, uint8_t pinpin )
+{
+    const bool level = ( pinport & ( 1 << pinpin ) ) != 0;
+
+    if ( cfg->algorithm == DEBOUNCE_ALGO_INTEGRATOR )
+        input->history = level ? cfg->rise : 0;
+    else
+        input->history = level ? 0b11111111 : 0b00000000;
+
+    input->state = level ? DEBOUNCE_DOWN : 0;
+}
+
+/*
+ * Change the state of an input and record the event.
+ */
+DEBOUNCE_INLINE
+void debounce_set_input ( struct debounce_input *input, bool level )
+{
+    if ( level == ( ( input->state & DEBOUNCE_DOWN ) != 0 ) )
+        return;
+
+    if ( level )
+        input->state |= DEBOUNCE_DOWN | DEBOUNCE_PRESSED;
+    else
+        input->state = ( input->state & ~DEBOUNCE_DOWN ) | DEBOUNCE_RELEASED;
+}
+
+/**
+ * \brief Update the input with a new sample.
+ * \param input   Pointer to the input state.
+ * \param cfg     Configuration of the input.
+ * \param pinport Input of the port, e.g. PINA
+ * \param pinpin  Pin of the input, e.g. PA2
+ */
+DEBOUNCE_INLINE
+void debounce_update_input ( struct debounce_input *input,
+                             const struct debounce_config *cfg,
+                             uint8_t pinport, uint8_t pinpin )
+{
+    const bool level = ( pinport & ( 1 << pinpin ) ) != 0;
+
+    if ( cfg->algorithm == DEBOUNCE_ALGO_INTEGRATOR ) {
+        if ( level && ( input->history < cfg->rise ) )
+            input->history++;
+        if ( !level && input->history )
+            input->history--;
+
+        if ( input->history == cfg->rise )
+            debounce_set_input ( input, true );
+        if ( input->history == 0 )
+            debounce_set_input ( input, false );
+    } else {
+        input->history = ( input->history << 1 ) | level;
+
+        const uint8_t masked = input->history & cfg->mask;
+        /*
+         * A transition with more bouncing than the pattern allows does
+         * not match, the completely stable history catches it later.
+         */
+        if ( ( masked == cfg->rise ) || ( input->history == 0b11111111 ) )
+            debounce_set_input ( input, true );
+        if ( ( masked == cfg->fall ) || ( input->history == 0b00000000 ) )
+            debounce_set_input ( input, false );
+    }
+}
+
+/**
+ * \brief Take the press event of the input.
+ * \param input Pointer to the input state.
+ * \return 1 if the input has been pressed since the last call
+ */
+DEBOUNCE_INLINE
+bool debounce_input_pressed ( struct debounce_input *input )
+{
+    const bool pressed = ( input->state & DEBOUNCE_PRESSED ) != 0;
+    input->state &= ~DEBOUNCE_PRESSED;
+    return pressed;
+}
+
+/**
+ * \brief Take the release event of the input.
+ * \param input Pointer to the input state.
+ * \return 1 if the input has been released since the last call
+ */
+DEBOUNCE_INLINE
+bool debounce_input_released ( struct debounce_input *input )
+{
+    const bool released = ( input->state & DEBOUNCE_RELEASED ) != 0;
+    input->state &= ~DEBOUNCE_RELEASED;
+    return released;
+}
+
+/**
+ * \brief Tell if the input is down, i.e. high.
+ * \param input Pointer to the input state.
+ * \return 1 if the input is down, otherwise 0
+ */
+DEBOUNCE_INLINE
+bool debounce_input_down ( const struct debounce_input *input )
+{
+    return ( input->state & DEBOUNCE_DOWN ) != 0;
+}
+
+/**
+ * \brief Tell if the input is up, i.e. low.
+ * \param input Pointer to the input state.
+ * \return 1 if the input is up, otherwise 0
+ */
+DEBOUNCE_INLINE
+bool debounce_input_up ( const struct debounce_input *input )
+{
+    return ( input->state & DEBOUNCE_DOWN ) == 0;
+}
@@ -112,6 +112,98 @@ volatile uint8_t _block_switch_status = 0;
 #define BSS_SET_STATUS(st)   (_block_switch_status |= st)
 #define BSS_CLEAR_STATUS(st) (_block_switch_status &= ~st)
 
+/*
+ * Switch Event FIFO
+ * =================
+ *
+ * Every change of the debounced switch array status is queued with the
+ * tick counter, so the master sees each transition at the time it
+ * happened, also a switch flicked up and back between two polls. When
+ * the FIFO is full, the oldest event is dropped; the master sees the gap
+ * in the sequence numbers.
+ *
+ * CMD_EVENTS leaves the events in the FIFO until the master acknowledges
+ * them with the next CMD_EVENTS, so no event is lost if a garbled reply
+ * is requested again.
+ *
+ * The FIFO is filled in the timer interrupt and drained in the USI
+ * interrupt.
+ */
+
+// must be a power of two
+#define SWITCH_FIFO_SIZE 8
+
+struct switch_event {
+  uint8_t sw;       // switch array status after the change
+  uint16_t tick;
+};
+
+volatile struct switch_event _switch_fifo[SWITCH_FIFO_SIZE];
+volatile uint8_t _switch_fifo_head = 0;
+volatile uint8_t _switch_fifo_count = 0;
+// sequence number of the last queued event
+volatile uint8_t _switch_seq = 0;
+
+/*
+ * Tick counter, one tick per four timer overflows, i.e. 1.024ms at 8 MHz
+ */
+volatile uint16_t _tick = 0;
+volatile uint8_t _tick_prescaler = 0;
+
+/*
+ * Queue a switch array change; only called from the timer interrupt.
+ */
+void pushSwitchEvent(const uint8_t sw) {
+  if (_switch_fifo_count == SWITCH_FIFO_SIZE) {
+    // drop the oldest event
+    _switch_fifo_head = (_switch_fifo_head + 1) & (SWITCH_FIFO_SIZE - 1);
+    _switch_fifo_count--;
+  }
+
+  volatile struct switch_event *ev =
+    &_switch_fifo[(_switch_fifo_head + _switch_fifo_count) & (SWITCH_FIFO_SIZE - 1)];
+  ev->sw = sw;
+  ev->tick = _tick;
+  _switch_fifo_count++;
+  _switch_seq++;
+}
+
+/*
+ * Get a switch event without removing it; call with interrupts
+ * disabled.
+ * returns 0 if there are not that many events
+ */
+uint8_t peekSwitchEvent(const uint8_t idx, struct switch_event *ev) {
+  if (idx >= _switch_fifo_count)
+    return 0;
+
+  const uint8_t pos = (_switch_fifo_head + idx) & (SWITCH_FIFO_SIZE - 1);
+  ev->sw = _switch_fifo[pos].sw;
+  ev->tick = _switch_fifo[pos].tick;
+
+  return 1;
+}
+
+/*
+ * Remove the acknowledged switch events; call with interrupts disabled.
+ *
+ * The master acknowledges the last event it has handled with the low
+ * bits of its sequence number. Only the events of one reply are looked
+ * at, so a repeated acknowledgement does not match any event.
+ */
+void ackSwitchEvents(const uint8_t seq, const uint8_t mask, const uint8_t max) {
+  // sequence number of the oldest event
+  const uint8_t first = _switch_seq - _switch_fifo_count + 1;
+
+  uint8_t n;
+  for (n = 0; (n < max) && (n < _switch_fifo_count); n++)
+    if (((first + n) & mask) == (seq & mask)) {
+      _switch_fifo_head = (_switch_fifo_head + n + 1) & (SWITCH_FIFO_SIZE - 1);
+      _switch_fifo_count -= n + 1;
+      return;
+    }
+}
+
 /*
  * Beep Pattern, 16 Bit cycling MSB to LSB
  */
@@ -282,6 +374,28 @@ inline uint8_t i3c_state() {
  * command (CCCC)
  * 
  * data (DDDD)
+ *
+ * CMD_STATUS replies with 4 bytes, each followed by its inversion:
+ *
+ *   status (1, 0 on error), switch array status, block switch status,
+ *   output status byte
+ *
+ * If data bit 0 is set, the I3C interrupt is acknowledged after the
+ * snapshot has been taken (like CMD_I3C with data 0).
+ *
+ * CMD_EVENTS removes the acknowledged events from the switch event FIFO
+ * and replies with up to EVENTS_MAX of the remaining ones in 15 bytes,
+ * each followed by its inversion:
+ *
+ *   status (1), sequence number of the first event, number of events
+ *   in the reply, number of queued events including these, current tick
+ *   low and high byte, then for each event the switch array status and
+ *   the tick low and high byte (unused events are 0)
+ *
+ * If data bit 3 is set, the events up to the one whose sequence number
+ * ends with data bits 2-1 are acknowledged, see ackSwitchEvents. If data
+ * bit 0 is set and the FIFO has been drained, the switch array interrupt
+ * is acknowledged.
  */
 #define CMD_RESET       0x00
 #define CMD_BEEP        0x01
@@ -289,6 +403,16 @@ inline uint8_t i3c_state() {
 #define CMD_GET_SWITCH  0x03
 #define CMD_I3C         0x04
 #define CMD_MANUAL_SW   0x05
+#define CMD_STATUS      0x06
+#define CMD_EVENTS      0x07
+
+#define STATUS_LENGTH   4
+
+#define EVENTS_MAX      3
+#define EVENTS_LENGTH   (6 + 3*EVENTS_MAX)
+// data of CMD_EVENTS
+#define EVENTS_ACK      0x08
+#define EVENTS_ACK_SEQ  0x06
 
 static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t input_buffer_length, 
@@ -339,6 +463,65 @@ static void twi_callback(uint8_t buffer_size,
 	else if (data == 2)
 	  BSS_SET_STATUS(BSS_BlockSwitch);
       }; break;
+      case (CMD_STATUS): {
+	const uint8_t status[STATUS_LENGTH] = {
+	  1,
+	  _switch_array_status,
+	  _block_switch_status,
+	  _output_status_byte
+	};
+
+	uint8_t i;
+	for (i = 0; i < STATUS_LENGTH; i++) {
+	  output_buffer[2*i]   = status[i];
+	  output_buffer[2*i+1] = ~(status[i]);
+	}
+	*output_buffer_length = 2*STATUS_LENGTH;
+
+	if (data & 0x01) {
+	  OSB_CLEAR_STATUS( OSB_I3C_Bl );
+	  OSB_CLEAR_STATUS( OSB_I3C_Sw );
+	}
+      }; return;
+      case (CMD_EVENTS): {
+	uint8_t reply[EVENTS_LENGTH];
+	struct switch_event ev;
+	uint8_t i, n;
+
+	for (i = 0; i < EVENTS_LENGTH; i++)
+	  reply[i] = 0;
+
+	// the timer interrupt must not queue events meanwhile
+	const uint8_t _sreg = SREG;
+	cli();
+
+	if (data & EVENTS_ACK)
+	  ackSwitchEvents(data >> 1, EVENTS_ACK_SEQ >> 1, EVENTS_MAX);
+
+	// the sequence number of the first event in the reply
+	reply[1] = _switch_seq - _switch_fifo_count + 1;
+	for (n = 0; (n < EVENTS_MAX) && peekSwitchEvent(n, &ev); n++) {
+	  reply[6+3*n]   = ev.sw;
+	  reply[6+3*n+1] = ev.tick & 0xff;
+	  reply[6+3*n+2] = ev.tick >> 8;
+	}
+	reply[0] = 1;
+	reply[2] = n;
+	reply[3] = _switch_fifo_count;
+	reply[4] = _tick & 0xff;
+	reply[5] = _tick >> 8;
+
+	if ((data & 0x01) && !_switch_fifo_count)
+	  OSB_CLEAR_STATUS( OSB_I3C_Sw );
+
+	SREG = _sreg;
+
+	for (i = 0; i < EVENTS_LENGTH; i++) {
+	  output_buffer[2*i]   = reply[i];
+	  output_buffer[2*i+1] = ~(reply[i]);
+	}
+	*output_buffer_length = 2*EVENTS_LENGTH;
+      }; return;
       case (CMD_GET_SWITCH): {
 	 output = 0;
 	 const uint8_t sw = _switch_array_status;
@@ -603,6 +786,10 @@ void dechatterSwitches() {
     if (switch_counter == 0) {
       switch_counter = DECHATTER_COUNTER;
       switch_state = input;
+
+      // queue the change and notify the master
+      pushSwitchEvent(input);
+      OSB_SET_STATUS(OSB_I3C_Sw);
     }
   } else
     switch_counter = DECHATTER_COUNTER;
@@ -658,6 +845,10 @@ ISR (TIM0_OVF_vect)
   // store state and disable interrupts
   const uint8_t _sreg = SREG;
   cli();
+
+  // time base for the switch events
+  if (!(++_tick_prescaler & 0x03))
+    _tick++;
   
   dechatterKey();
   dechatterSwitches();
@@ -0,0 +1,141 @@
+/**
+ * @file blogdump.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Decode the binary log ring of a daemon
+ *
+ * Prints all records still in the ring, oldest first, with wall clock
+ * time and syslog level. Records which have not been forwarded to
+ * syslog yet are marked with a '*'. Works on the ring of a running
+ * daemon as well as on the .old ring left behind by a crash.
+ *
+ * With -l or -s, the recording or syslog level of a running daemon is
+ * changed instead.
+ *
+ * Usage: blogdump [-l level] [-s level] FILE
+ *
+ * level is the syslog priority: 0 emerg ... 6 info, 7 debug
+ */
+
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../i2cbus/blog.h"
+
+static const char *levels[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/**
+ * Print a record with wall clock time.
+ */
+static void print_record(const struct blog_header *h,
+                         const struct blog_record *rec, int pending) {
+  const int64_t ns = rec->nsec + h->realtime_offset;
+  const time_t t = ns / 1000000000LL;
+  struct tm tm;
+  char stamp[32];
+  char msg[128];
+
+  localtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  blog_sprint(msg, sizeof(msg), rec);
+
+  printf("%s.%06ld %-7s %c%s\n", stamp, (long)(ns % 1000000000LL) / 1000,
+         (rec->level < 8) ? levels[rec->level] : "?",
+         pending ? '*' : ' ', msg);
+}
+
+int main(int argc, char *argv[]) {
+  long level = -1;
+  long syslog_level = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:")) != -1) {
+    switch (opt) {
+      case 'l': level = strtol(optarg, NULL, 0); break;
+      case 's': syslog_level = strtol(optarg, NULL, 0); break;
+      default: argc = 0;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, "Usage: %s [-l level] [-s level] FILE\n", argv[0]);
+    return 2;
+  }
+
+  if ((level > LOG_DEBUG) || (syslog_level > LOG_DEBUG)) {
+    fprintf(stderr, "Error: level out of range\n");
+    return 2;
+  }
+
+  const char *path = argv[optind];
+  const int write = (level >= 0) || (syslog_level >= 0);
+
+  const int fd = open(path, write ? O_RDWR : O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || fstat(fd, &st)) {
+    fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if (st.st_size < (off_t)sizeof(struct blog_header)) {
+    fprintf(stderr, "Error: %s is not a log ring\n", path);
+    return 1;
+  }
+
+  struct blog_header *h = mmap(NULL, st.st_size,
+                               PROT_READ | (write ? PROT_WRITE : 0),
+                               MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    fprintf(stderr, "Error: could not map %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if ((h->magic != BLOG_MAGIC) ||
+      (h->version != BLOG_VERSION) ||
+      (h->size != sizeof(struct blog_record)) ||
+      (st.st_size < (off_t)(sizeof(struct blog_header) +
+                            (off_t)h->count*h->size))) {
+    fprintf(stderr, "Error: %s is not a compatible log ring\n", path);
+    return 1;
+  }
+
+  if (write) {
+    if (level >= 0)
+      atomic_store(&h->level, level);
+    if (syslog_level >= 0)
+      atomic_store(&h->syslog_level, syslog_level);
+    printf("%.*s [%d]: recording up to %s, syslog up to %s\n",
+           (int)sizeof(h->name), h->name, h->pid,
+           levels[atomic_load(&h->level)],
+           levels[atomic_load(&h->syslog_level)]);
+    return 0;
+  }
+
+  const uint64_t head = atomic_load(&h->head);
+  const uint64_t flushed = atomic_load(&h->flushed);
+  printf("%.*s [%d]: %llu records, %llu forwarded to syslog\n",
+         (int)sizeof(h->name), h->name, h->pid,
+         (unsigned long long)head, (unsigned long long)flushed);
+
+  uint64_t idx = (head > h->count) ? head - h->count : 0;
+  for (; idx < head; idx++) {
+    struct blog_record rec;
+    if (blog_read(h, idx, &rec) > 0)
+      print_record(h, &rec, idx >= flushed);
+  }
+
+  return 0;
+}
@@ -1,6 +1,12 @@
 #!/usr/bin/python3
 
+import errno
+import os
+import random
 import signal
+import socket
+import stat
+import struct
 import sys
 import time
 
@@ -43,14 +49,136 @@ def sigint_handler(_signal, _frame):
     sys.exit(0)
 
 
+I2CD_SOCKET_BUS = "/run/i2cd-{}.sock"
+
+# i2cd priority classes
+I2CD_PRIO_POLL = 0
+I2CD_PRIO_USER = 1
+I2CD_PRIO_SAFETY = 2
+
+
+class I2cdBus:
+    """SMBus replacement that lets the I2C bus daemon do the transfers.
+
+    See raspberry/i2cbus/i2cproto.h for the protocol.
+    """
+
+    REQUEST = struct.Struct("=BBBB")
+    RESPONSE = struct.Struct("=hBBI32s")
+
+    def __init__(self, path, prio=I2CD_PRIO_POLL):
+        self.path = path
+        self.prio = prio
+        self.sock = None
+
+    def _transfer(self, address, cmd, length):
+        if self.sock is None:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+            self.sock.connect(self.path)
+
+        try:
+            self.sock.send(self.REQUEST.pack(address, cmd, length, self.prio))
+            res = self.sock.recv(self.RESPONSE.size)
+        except OSError:
+            self.sock.close()
+            self.sock = None
+            raise
+
+        if len(res) != self.RESPONSE.size:
+            self.sock.close()
+            self.sock = None
+            raise OSError(errno.EPIPE, "I2C bus daemon closed the connection")
+
+        err, rlen, _, _, reply = self.RESPONSE.unpack(res)
+        if err:
+            raise OSError(-err, os.strerror(-err))
+
+        return reply[:rlen]
+
+    def read_byte_data(self, address, cmd):
+        return self._transfer(address, cmd, 1)[0]
+
+    def read_word_data(self, address, cmd):
+        reply = self._transfer(address, cmd, 2)
+        return reply[0] | (reply[1] << 8)
+
+
+def open_bus(socket_path, bus, prio=I2CD_PRIO_POLL):
+    """Use the I2C bus daemon if it is running, otherwise the bus itself."""
+    try:
+        if stat.S_ISSOCK(os.stat(socket_path).st_mode):
+            return I2cdBus(socket_path, prio)
+    except OSError:
+        pass
+
+    return smbus.SMBus(bus)
+
+
+class I2cRetry:
+    """Retry I2C transactions with a capped exponential backoff and full jitter.
+
+    Soft failures (zero reply, mismatch, NACK, bus timeout, full i2cd
+    queue) are retried, hard OS errors end the transaction at once. A
+    device that gave up several times in a row only gets a single try
+    until it answers again.
+    """
+
+    SOFT_ERRNOS = (errno.ENXIO, errno.EREMOTEIO, errno.ETIMEDOUT, errno.EAGAIN, errno.EIO,
+                   errno.EBUSY)
+
+    def __init__(self, tries=10, base=0.01, cap=0.5, degrade_after=3):
+        self.tries = tries
+        self.base = base
+        self.cap = cap
+        self.degrade_after = degrade_after
+
+        self.giveup_streak = 0
+        self.failures = {'zero': 0, 'mismatch': 0, 'oserror': 0, 'hard': 0}
+        self.giveups = 0
+
+    def run(self, transaction):
+        """Call transaction() until it returns a value that is not None.
+
+        The transaction may return the name of a soft failure class
+        ('zero' or 'mismatch') as a string to request a retry.
+        """
+        tries = 1 if self.giveup_streak >= self.degrade_after else self.tries
+
+        for attempt in range(tries):
+            if attempt:
+                time.sleep(random.uniform(0, min(self.cap, self.base * 2 ** (attempt - 1))))
+
+            try:
+                res = transaction()
+            except OSError as e:
+                if e.errno not in self.SOFT_ERRNOS:
+                    self.failures['hard'] += 1
+                    syslog.syslog(syslog.LOG_WARNING, "OS error on I2C transaction {}".format(str(e)))
+                    break
+                self.failures['oserror'] += 1
+                continue
+
+            if isinstance(res, str):
+                self.failures[res] += 1
+                continue
+
+            self.giveup_streak = 0
+            return res
+
+        self.giveups += 1
+        self.giveup_streak += 1
+        return None
+
+
 class I2cObserver:
-    def __init__(self, address, cb):
+    def __init__(self, address, cb, socket_path, bus):
         self.address = address
         self.cb = cb
 
         self.run = True
 
-        self.bus = smbus.SMBus(1)
+        self.bus = open_bus(socket_path, bus)
+        self.retry = I2cRetry()
 
     def stop(self):
         self.run = False
@@ -95,22 +223,18 @@ class I2cObserver:
         return state
 
     def _receive(self):
-        hops = 10
-        while hops:
-            try:
-                d = self.bus.read_word_data(self.address, 0x30)
-                data = [d & 0xff, (d & 0xff00) >> 8]
-                # data is valid if first byte is binary inversion of second byte
-                # and result is not zero
-                if data[0] == (data[1] ^ 0xff) and data[0] != 0:
-                    return data[0]
-            except OSError as e:
-                pass
-                # syslog.syslog(syslog.LOG_WARNING, "OS error on I2C receive {}".format(str(e)))
-            hops = hops-1
-            time.sleep(0.5)
+        def transaction():
+            d = self.bus.read_word_data(self.address, 0x30)
+            data = [d & 0xff, (d & 0xff00) >> 8]
+            # data is valid if first byte is binary inversion of second byte
+            # and result is not zero
+            if data[0] != (data[1] ^ 0xff):
+                return 'mismatch'
+            if data[0] == 0:
+                return 'zero'
+            return data[0]
 
-        return None
+        return self.retry.run(transaction)
 
 
 class MqttAnnouncer:
@@ -140,14 +264,16 @@ class MqttAnnouncer:
 
 
 class CommandHandler:
-    def __init__(self, device, mqttclient, topic_base):
+    def __init__(self, device, mqttclient, topic_base, socket_path, bus):
         self.device = device
         self.mqttclient = mqttclient
         self.topic_base = topic_base
 
         self.run = True
 
-        self.bus = smbus.SMBus(1)
+        # door lock actions go first
+        self.bus = open_bus(socket_path, bus, I2CD_PRIO_SAFETY)
+        self.retry = I2cRetry()
 
         topic = "{0}/{1}".format(self.topic_base, 'Command')
         mqtt_add_topic_callback(self.mqttclient, topic, self.callback)
@@ -169,16 +295,12 @@ class CommandHandler:
         self._i2c_send(0xa0)
 
     def _i2c_send(self, data):
-        hops = 10
-        while hops:
-            try:
-                res = self.bus.read_byte_data(self.device, data)
-                if res == 0x01:
-                    break
-            except OSError as e:
-                syslog.syslog(syslog.LOG_WARNING, "OS error on I2C receive {}".format(str(e)))
-            hops = hops-1
-            time.sleep(0.5)
+        def transaction():
+            res = self.bus.read_byte_data(self.device, data)
+            return res if res == 0x01 else 'zero'
+
+        if self.retry.run(transaction) is None:
+            syslog.syslog(syslog.LOG_WARNING, "Giving up I2C command 0x{:02x}.".format(data))
 
 
 def main():
@@ -188,7 +310,11 @@ def main():
     parser.add_argument("--mqttport", help="MQTT port", default=1883)
     parser.add_argument("--topic", help="MQTT topic prefix", default="Netz39/Things/Door")
     parser.add_argument("--i2c", help="I2C device address for the door controller", default=0x23)
+    parser.add_argument("--bus", help="I2C adapter number of the door controller", type=int, default=1)
+    parser.add_argument("--i2cd", help="Socket of the I2C bus daemon (default: the one of the bus)")
     args = parser.parse_args()
+    if args.i2cd is None:
+        args.i2cd = I2CD_SOCKET_BUS.format(args.bus)
 
     syslog.openlog("doorservice", syslog.LOG_CONS | syslog.LOG_PID, syslog.LOG_USER)
     syslog.syslog(syslog.LOG_INFO, "Starting doorstate observer.")
@@ -198,11 +324,11 @@ def main():
     mqttclient.connect(args.mqtthost, args.mqttport, 60)
     mqttclient.loop_start()
 
-    ch = CommandHandler(args.i2c, mqttclient, args.topic)
+    ch = CommandHandler(args.i2c, mqttclient, args.topic, args.i2cd, args.bus)
 
     mqtta = MqttAnnouncer(mqttclient, args.topic)
 
-    obs = I2cObserver(args.i2c, mqtta.callback)
+    obs = I2cObserver(args.i2c, mqtta.callback, args.i2cd, args.bus)
     obs.loop()
 
     mqttclient.loop_stop()
@@ -3,6 +3,6 @@
 
 ret=""
 while [[ "$ret" != "0x01" ]]; do
-        ret=$(/usr/sbin/i2cget -y 1 0x23 0xa0)
+        ret=$(/usr/local/bin/i2cctl -p 2 0x23 0xa0)
         echo $ret
 done
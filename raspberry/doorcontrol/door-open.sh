@@ -5,15 +5,23 @@ logger -t shuttercontrol "Opening door from shell script via $caller."
 
 ret=""
 errcount=0
+# backoff between the tries in ms, doubled up to the cap like in the daemons
+delay=50
 while [[ "$ret" != "0x01" ]]; do
-	ret=$(/usr/sbin/i2cget -y 1 0x23 0x90)
+	ret=$(/usr/local/bin/i2cctl -p 2 0x23 0x90)
 	echo $ret
+	[[ "$ret" == "0x01" ]] && break
+
 	errcount=$(($errcount+1))
+	# i2cd frees a stuck bus on its own, so do not retry forever
 	if [[ $errcount -eq 10 ]]; then
-		logger -t shuttercontrol "I2C seems to be stuck, restarting the hardware."
-		sleep 5
-		~/unstuck.sh
-		sleep 5
+		logger -p user.err -t shuttercontrol "Giving up opening the door after $errcount tries."
+		exit 1
 	fi
-done
 
+	# full jitter, so concurrent callers do not retry in lockstep
+	pause=$((RANDOM % delay + 1))
+	sleep $(($pause / 1000)).$(printf %03d $(($pause % 1000)))
+	delay=$(($delay * 2))
+	[[ $delay -gt 1000 ]] && delay=1000
+done
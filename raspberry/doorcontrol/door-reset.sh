@@ -1,3 +1,3 @@
 #!/bin/bash
 
-i2cget -y 1 0x23 0x00
+/usr/local/bin/i2cctl -p 2 0x23 0x00
@@ -1,3 +1,6 @@
 #!/bin/bash
 
-i2cget -y 1 0x23 0x30
+# read the state published by doorstate, ask the door controller only
+# if doorstate is not running
+/usr/local/bin/statedump -d -m 10 /dev/shm/doorstate.state 2>/dev/null \
+	|| /usr/local/bin/i2cctl 0x23 0x30
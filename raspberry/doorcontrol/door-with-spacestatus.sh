@@ -38,7 +38,7 @@ function i2c_set {
 
 	ret=""
 	while [[ "$ret" != "0x01" ]]; do
-		ret=$(/usr/sbin/i2cget -y 1 $addr $cmd)
+		ret=$(/usr/local/bin/i2cctl $addr $cmd)
 		echo $ret
 	done
 }
@@ -8,10 +8,21 @@
 #include <string.h>
 
 #include <time.h>
+#include <signal.h>
 #include <syslog.h>
 
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <sys/epoll.h>
+
+#include "../i2cbus/i2cbus.h"
+#include "../i2cbus/i2cproto.h"
+#include "../i2cbus/i2crecover.h"
+#include "../i2cbus/i3cint.h"
+#include "../i2cbus/evloop.h"
+#include "../i2cbus/mqttpub.h"
+#include "../i2cbus/blog.h"
+#include "../i2cbus/metrics.h"
+#include "../i2cbus/rtmode.h"
+#include "../i2cbus/shmstate.h"
 
 #include <mosquitto.h>
 
@@ -21,6 +32,8 @@ const char* MQTT_HOST 	= "platon";
 const int   MQTT_PORT 	= 1883;
 const char* MQTT_TOPIC 	= "Netz39/Things/Door/Events";
 const char* MQTT_TOPIC_BTN = "Netz39/Things/Door/Button/Events";
+// undelivered messages are kept here during broker outages
+const char* MQTT_SPOOL  = "/var/spool/doorstate.mqtt";
 
 #define MQTT_MSG_MAXLEN		  16
 const char* MQTT_MSG_DOOROPEN   = "door open";
@@ -40,129 +53,216 @@ struct door_status_t {
   bool force_open;	// Forcing the door open (cmd)
 };
 
-/**
- * Get the milliseconds since epoch.
- */
-long current_millis() {
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-  
-  return tv.tv_sec*1000L + tv.tv_usec/1000L;
-}
+///// Logging /////
+
+// binary log ring on tmpfs, see blog.h and blogdump
+const char* LOG_RING    = "/dev/shm/doorstate.blog";
+
+///// Live state /////
+
+// the polled state for local readers, see shmstate.h and statedump
+const char* STATE_FILE  = "/dev/shm/doorstate.state";
+
+struct shmstate state;
+
+///// Metrics /////
+
+// Prometheus endpoint on the loopback interface
+const int METRICS_PORT  = 9723;
+
+unsigned long polls_int   = 0;  // polls after an I3C interrupt
+unsigned long polls_timer = 0;  // polls by the timer
+struct metrics_histogram poll_lateness;  // timer wake-up after its deadline
+long long poll_deadline = 0;    // monotonic usec the poll timer is due
+struct metrics_histogram int_wakeup;    // INT edge to the handler
+struct metrics_histogram int_reaction;  // INT edge to the door status read
+unsigned long door_events = 0;         // events read from the controller FIFO
+unsigned long door_events_missed = 0;  // events lost, by sequence number gaps
+
+// worst wake-up latencies in usec, reported on exit
+long long wakeup_max_int   = 0;
+long long wakeup_max_timer = 0;
+
+///// Real-time mode /////
+
+// enabled with -r <priority>, see rtmode.h
+struct rt_config rt = { .priority = 0, .cpu = -1 };
 
 ///// I2C stuff /////
 
-/**
-  * This record contains the I2C file descriptors we use in this program
-  */
-struct I2C_descriptors {
-  int doorctrl;
-} I2C_fd;
+// adapter number N of /dev/i2c-N, changed with -b
+int I2C_ADAPTER = 1;
+
+// the socket of i2cd for the adapter, or the adapter itself
+char I2C_SOCKET[64];
+char I2C_BUS[64];
+
+// environment variables to record all transfers to a trace file, or to
+// replay one instead of using the bus (see i2ctrace.h)
+#define I2C_ENV_TRACE        "I2C_TRACE"
+#define I2C_ENV_REPLAY       "I2C_REPLAY"
+#define I2C_ENV_REPLAY_SPEED "I2C_REPLAY_SPEED"
 
-#define I2C_FD_DOORCTRL (I2C_fd.doorctrl)
+struct I2C_bus I2C_bus;
 
 /**
-  * Initialize an I2C channel to the specified address. Exits with an error
-  * message if the initialization fails,
-  *
-  * @param addr The target address.
-  * @return File Descriptor for the I2C channel
+  * This record contains the I2C devices we use in this program
   */
-int I2C_setup_fd(const int addr) {
-  const int fd = wiringPiI2CSetup(addr);
-  if (!fd) {
-    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
-    exit(-1);
-  }
-  return fd;
-}
+struct I2C_devices {
+  struct I2C_device doorctrl;
+} I2C_dev;
+
+#define I2C_DEV_DOORCTRL   (&I2C_dev.doorctrl)
 
 /**
-  * Initialize all I2C channels and store the file descriptors.
+  * Connect to the I2C bus daemon, or open the I2C bus if the daemon is
+  * not running, and initialize all devices. Exits with an error
+  * message if the initialization fails.
   */
 void I2C_init(void) {
-  I2C_fd.doorctrl = I2C_setup_fd(I2C_ADDR_DOORCTRL);
-}
+  snprintf(I2C_SOCKET, sizeof(I2C_SOCKET), I2CD_SOCKET_BUS, I2C_ADAPTER);
+  snprintf(I2C_BUS, sizeof(I2C_BUS), "/dev/i2c-%d", I2C_ADAPTER);
 
-#define I2C_ERR_INVALIDARGUMENT -2
+  // answer the transfers from a recorded trace, for offline tests
+  const char *replay = getenv(I2C_ENV_REPLAY);
+  const char *speed = getenv(I2C_ENV_REPLAY_SPEED);
 
-  union I2C_result {
-    unsigned char c[2];
-    unsigned short r;
-  };
+  if (replay) {
+    if (I2C_replay_open(&I2C_bus, replay, speed ? atof(speed) : 1.0)) {
+      syslog(LOG_EMERG, "Error %d on opening the I2C trace %s!", errno, replay);
+      exit(-1);
+    }
+    syslog(LOG_INFO, "Replaying the I2C trace %s.", replay);
+  } else if (!I2C_bus_open(&I2C_bus, I2C_SOCKET))
+    syslog(LOG_INFO, "Using the I2C bus daemon at %s.", I2C_SOCKET);
+  else if (I2C_bus_open(&I2C_bus, I2C_BUS)) {
+    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
+    exit(-1);
+  } else if ((I2C_ADAPTER == 1) &&
+             I2C_recovery_init(&I2C_bus, &I2C_recovery_pihat))
+    // without i2cd, this daemon frees a stuck bus itself
+    syslog(LOG_WARNING, "Error %d on enabling the bus recovery.", errno);
 
+  const char *trace = getenv(I2C_ENV_TRACE);
+  if (trace && I2C_trace_start(&I2C_bus, trace))
+    syslog(LOG_WARNING, "Error %d on starting the I2C trace %s.", errno, trace);
 
-int I2C_command(const int fd, const char command, const char data) {
-  // check parameter range
-  if ((command < 0) || (command > 0x07))
-    return I2C_ERR_INVALIDARGUMENT;
-  if ((data < 0) || (data > 0x0f))
-    return I2C_ERR_INVALIDARGUMENT;
-  
-  // TODO check fd
-  
-    
-  // build the I2C data byte
-  // arguments have been checked, 
-  // this cannot be negative or more than 8 bits
-  unsigned char send = (command << 4) + data; 
-  
-  // calculate the parity
-  char v = send;
-  char c;
-  for (c = 0; v; c++) 
-    v &= v-1;
-  c &= 1;
-
-  // set parity bit  
-  send += (c << 7);
-  
-  union I2C_result result;
-  result.r = 0;
-
-  // maximal number of tries
-  int hops=20;
-
-  // try for hops times until the result is not zero
-  while (!result.c[0] && --hops) {
-    // send command
-    result.r = wiringPiI2CReadReg16(fd, send);
-
-    // check for transmission errors: 2nd byte is inverted 1st byte
-    const unsigned char c = ~result.c[0];
-    if (result.c[1] != c) 
-      // if no match, reset the result
-      result.r = 0;
-  }
-  
-  if (!hops)
-    syslog(LOG_DEBUG, "Giving up transmission!\n");
-  
-  return result.c[0];
+  I2C_device_init(&I2C_dev.doorctrl, &I2C_bus, I2C_ADDR_DOORCTRL);
 }
 
 ///// I3C stuff /////
 
+const char* I3C_INT_CHIP = "/dev/gpiochip0";
+const int   I3C_INT_LINE = 17;  // BCM GPIO17, INT on the pi-hat
+
+// poll interval without a working INT line
+#define POLL_FALLBACK_MS  1000
+// safety poll interval, in case an INT event has been missed
+#define POLL_SAFETY_MS    5000
+// poll interval while the shared INT line is held low by another device
+#define POLL_INT_BUSY_MS   200
+
+struct I3C_int I3C_irq;
+
+/**
+  * Get the I3C INT edges: from i2cd, which owns the line, or from the
+  * line itself without the daemon.
+  * @return 0 on success, -1 on error (errno is set)
+  */
+int I3C_init(void) {
+  if (I2C_bus.sock)
+    return I3C_int_connect(&I3C_irq, I2CD_INT_SOCKET);
+  return I3C_int_open(&I3C_irq, I3C_INT_CHIP, I3C_INT_LINE);
+}
+
 #define DOORCTRL_CMD_RESET	0x00
 #define DOORCTRL_CMD_OPEN	0x01
 #define DOORCTRL_CMD_CLOSE	0x02
 #define DOORCTRL_CMD_STATE	0x03
+#define DOORCTRL_CMD_EVENT	0x04
+
+// reply of DOORCTRL_CMD_EVENT, see tuer-controller/firmware.c
+#define DOORCTRL_EVENT_LEN	7
+#define DOORCTRL_EVENT_FIFO	8
+#define DOORCTRL_EVENT_STATUS_EVENT	1
+#define DOORCTRL_EVENT_STATUS_EMPTY	2
+// data of DOORCTRL_CMD_EVENT: acknowledge the event with this sequence number
+#define DOORCTRL_EVENT_ACK	0x08
+#define DOORCTRL_EVENT_ACK_SEQ	0x07
+
+struct doorctrl_event {
+  uint8_t status;
+  uint8_t seq;          // sequence number, of the last event if empty
+  uint8_t isb;          // status byte after the change
+  uint8_t prev;         // status byte before the change
+  uint16_t tick;        // controller time, 4.096ms per tick
+  uint8_t queued;       // events in the FIFO, including this one
+};
 
 void I3C_reset_doorctrl() {
-  I2C_command(I2C_FD_DOORCTRL, DOORCTRL_CMD_RESET, 0x0);
+  I2C_command(I2C_DEV_DOORCTRL, DOORCTRL_CMD_RESET, 0x0);
 }
 
 ///// Door Controller /////
 
 char doorctrl_read_status() {
   // send the command    
-  const char state = I2C_command(I2C_FD_DOORCTRL,
+  const char state = I2C_command(I2C_DEV_DOORCTRL,
                                  DOORCTRL_CMD_STATE, 0);
   
   // return result
   return state;  
 }
 
+/**
+  * Tell if the controller firmware has the event FIFO. A firmware
+  * without it answers the unknown command with 0 and its inversion. The
+  * probe does not acknowledge any event.
+  * @return 1 yes, 0 no, -1 if the reply is not conclusive
+  */
+int doorctrl_probe_events() {
+  const int send = I2C_build_command(DOORCTRL_CMD_EVENT, 0);
+  uint8_t r[2];
+
+  if (I2C_transfer(I2C_DEV_DOORCTRL, send, r, 2) ||
+      (r[1] != (uint8_t)~r[0]))
+    return -1;
+
+  if (r[0] == 0)
+    return 0;
+  if ((r[0] == DOORCTRL_EVENT_STATUS_EVENT) ||
+      (r[0] == DOORCTRL_EVENT_STATUS_EMPTY))
+    return 1;
+  return -1;
+}
+
+/**
+  * Get the oldest event from the FIFO of the door controller.
+  * @param ack DOORCTRL_EVENT_ACK and the sequence number of the last
+  *            handled event, which the controller removes, or 0
+  * @return 0 on success, otherwise an I2C_ERR_XXX code
+  */
+int doorctrl_read_event(struct doorctrl_event *ev, const uint8_t ack) {
+  uint8_t r[DOORCTRL_EVENT_LEN];
+
+  const int ret = I2C_command_block(I2C_DEV_DOORCTRL, DOORCTRL_CMD_EVENT, ack,
+                                    r, DOORCTRL_EVENT_LEN);
+  if (ret)
+    return ret;
+
+  if ((r[0] != DOORCTRL_EVENT_STATUS_EVENT) &&
+      (r[0] != DOORCTRL_EVENT_STATUS_EMPTY))
+    return I2C_ERR_TRANSMISSION;
+
+  ev->status = r[0];
+  ev->seq    = r[1];
+  ev->isb    = r[2];
+  ev->prev   = r[3];
+  ev->tick   = r[4] | (r[5] << 8);
+  ev->queued = r[6];
+  return 0;
+}
+
 void decode_door_status(uint8_t status,
                         struct door_status_t *ds)
 {
@@ -174,178 +274,466 @@ void decode_door_status(uint8_t status,
   ds->force_open   = (status & 0x01);
 }
 
-void mqtt_send(struct mosquitto* mosq,
-               const char* mqtt_payload,
+///// MQTT stuff /////
+
+// publisher thread, which owns the mosquitto client
+struct mqtt_pub mqtt;
+int mqtt_running = 0;
+
+/**
+  * Queue a retained MQTT message for the publisher thread, if there is
+  * payload. Never waits for the broker.
+  */
+void mqtt_send(const char* mqtt_payload,
                const char* mqtt_topic)
 {
-    // send MQTT message if there is payload
-    if (mqtt_payload[0] && mosq) {
-      int ret;
-      int mid;
-      ret = mosquitto_publish(
-                        mosq,
-                        &mid,
-                        mqtt_topic,
-                        strlen(mqtt_payload), mqtt_payload,
-                        2, /* qos */
-                        true /* retain */
-                       );
-      if (ret != MOSQ_ERR_SUCCESS)
-        syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)",
-                        mqtt_payload,
-                        ret,
-                        mosquitto_strerror(ret));
-      else
-        syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.",
-                         mqtt_payload, mid);
-    }
+    if (mqtt_payload[0] && mqtt_running)
+      mqtt_pub_send(&mqtt, mqtt_topic, mqtt_payload,
+                    2, /* qos */
+                    true /* retain */);
 }
 
-int main(int argc, char *argv[]) {
-  // initialize the system logging
-  openlog("doorstate", LOG_CONS | LOG_PID, LOG_USER);
-  syslog(LOG_INFO, "Starting doorstate observer.");
+///// Event handling /////
 
-  // initialize I2C
-  I2C_init();
-  
-  // initialize MQTT
-  mosquitto_lib_init();
+struct evloop loop;
+
+struct evloop_handler ev_int;       // I3C INT line
+struct evloop_handler ev_poll;      // safety poll timer
+struct evloop_handler ev_signal;    // SIGINT, SIGTERM
+
+// the known door status
+struct door_status_t before;
+
+/**
+  * Emit MQTT messages for all changes of the door status.
+  */
+void door_update(const uint8_t status) {
+  static int i=0;
+
+  char mqtt_payload[MQTT_MSG_MAXLEN];
+
+  struct door_status_t ds;
+  decode_door_status(status, &ds);
   
-  void *mqtt_obj;
-  struct mosquitto *mosq;
-  mosq = mosquitto_new("doorstate", true, mqtt_obj);
-  if ((int)mosq == ENOMEM) {
-    syslog(LOG_ERR, "Not enough memory to create a new mosquitto session.");
-    mosq = NULL;
-  }
-  if ((int)mosq == EINVAL) {
-    syslog(LOG_ERR, "Invalid values for creating mosquitto session.");
-    return -1;
+  BLOG(LOG_DEBUG, BLOG_DOOR_STATUS, i++, status);
+
+  // publish for the local scripts before anything else
+  struct shmstate_values sv;
+  shmstate_clear(&sv);
+  sv.door_status  = status;
+  sv.door_closed  = ds.door_closed;
+  sv.lock_open    = ds.lock_open;
+  sv.green_active = ds.green_active;
+  sv.red_active   = ds.red_active;
+  shmstate_publish(&state, &sv);
+
+  // Check door status for changes and emit MQTT messages
+  mqtt_payload[0] = 0;
+
+  // door status changed
+  if (before.door_closed != ds.door_closed) {
+    if (ds.door_closed) {
+      BLOG(LOG_INFO, BLOG_DOOR_CLOSED);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_DOORCLOSE);
+    } else {
+      BLOG(LOG_INFO, BLOG_DOOR_OPENED);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_DOOROPEN);
+    }
+    
+    before.door_closed = ds.door_closed;
   }
-  
-  if (mosq) {
-    int ret;
+
+  // lock status changed
+  if (before.lock_open != ds.lock_open) {
+    if (ds.lock_open) {
+      BLOG(LOG_INFO, BLOG_DOOR_UNLOCKED);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LOCKOPEN);
+    } else {
+      BLOG(LOG_INFO, BLOG_DOOR_LOCKED);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LOCKCLOSE);
+    }
     
-    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 30);
-    if (ret == MOSQ_ERR_SUCCESS)
-      syslog(LOG_INFO, "MQTT connection to %s established.", MQTT_HOST);
-      
-    // TODO error handling
+    before.lock_open = ds.lock_open;
   }
+
+  // send MQTT messages if there is payload
+  mqtt_send(mqtt_payload, MQTT_TOPIC);
+  mqtt_payload[0] = 0;
   
-  char mqtt_payload[MQTT_MSG_MAXLEN];
-  
-  // the known door status
-  struct door_status_t before; 
-  decode_door_status(doorctrl_read_status(), &before);
-  
-  char run=1;
-  int i=0;
-  while(run) {
-    printf("****** %u\n", i++);
-
-    uint8_t status = doorctrl_read_status();    
-    struct door_status_t ds;
-    decode_door_status(status, &ds);
-    
-    printf("Door status byte: 0x%02x\n", status);
-    printf("Green active:\t%s\n", (ds.green_active ? "yes" : "no"));
-    printf("Red active:\t%s\n", (ds.red_active ? "yes" : "no"));
-    printf("Door closed:\t%s\n", (ds.door_closed ? "yes" : "no"));
-    printf("Lock open:\t%s\n", (ds.lock_open ? "yes" : "no"));
-    printf("Force closed:\t%s\n", (ds.force_close ? "yes" : "no"));
-    printf("Force open:\t%s\n", (ds.force_open ? "yes" : "no"));
-    printf("\n");
-
-    // Check door status for changes and emit MQTT messages
-    mqtt_payload[0] = 0;
-
-    // door status changed
-    if (before.door_closed != ds.door_closed) {
-      if (ds.door_closed) {
-        syslog(LOG_INFO, "Door has been closed.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_DOORCLOSE);
-      } else {
-        syslog(LOG_INFO, "Door has been opened.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_DOOROPEN);
-      }
-      
-      before.door_closed = ds.door_closed;
+  // green button status changed
+  if (before.green_active != ds.green_active) {
+    if (ds.green_active) {
+      BLOG(LOG_INFO, BLOG_BUTTON_GREEN);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_BTNGREEN);
     }
+    // only button activation is an event
+    before.green_active = ds.green_active;
+  }
 
-    // lock status changed
-    if (before.lock_open != ds.lock_open) {
-      if (ds.lock_open) {
-        syslog(LOG_INFO, "Door has been unlocked.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LOCKOPEN);
-      } else {
-        syslog(LOG_INFO, "Door has been locked.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LOCKCLOSE);
-      }
-      
-      before.lock_open = ds.lock_open;
-    }
+  // send MQTT messages if there is payload
+  mqtt_send(mqtt_payload, MQTT_TOPIC_BTN);
+  mqtt_payload[0] = 0;
 
-    // send MQTT messages if there is payload
-    mqtt_send(mosq, mqtt_payload, MQTT_TOPIC);
-    mqtt_payload[0] = 0;
-    
-    // green button status changed
-    if (before.green_active != ds.green_active) {
-      if (ds.green_active) {
-        syslog(LOG_INFO, "Green button active.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_BTNGREEN);
-      }
-      // only button activation is an event
-      before.green_active = ds.green_active;
+  // red button status changed
+  if (before.red_active != ds.red_active) {
+    if (ds.red_active) {
+      BLOG(LOG_INFO, BLOG_BUTTON_RED);
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_BTNRED);
     }
+    // only button activation is an event
+    before.red_active = ds.red_active;
+  }
+
+  // send MQTT messages if there is payload
+  mqtt_send(mqtt_payload, MQTT_TOPIC_BTN);
+}
 
-    // send MQTT messages if there is payload
-    mqtt_send(mosq, mqtt_payload, MQTT_TOPIC_BTN);
-    mqtt_payload[0] = 0;
+// the controller firmware has the event FIFO: 1 yes, 0 no, -1 unknown
+int doorctrl_has_events = -1;
+// failed FIFO reads in a row
+int doorctrl_event_fails = 0;
+// the state is read instead after this many failed FIFO reads in a row
+#define DOORCTRL_EVENT_FAILS_MAX	3
 
-    // red button status changed
-    if (before.red_active != ds.red_active) {
-      if (ds.red_active) {
-        syslog(LOG_INFO, "Red button active.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_BTNRED);
+/**
+  * Read all queued events of the door controller in order and handle
+  * each status change. Each read acknowledges the event before, so an
+  * event is only removed from the FIFO after it has been handled; a
+  * failed read is simply repeated. Events dropped by a full FIFO are
+  * counted from the gaps in the sequence numbers, the final empty reply
+  * brings the current status.
+  * @return 0 if the FIFO has been drained, -1 on an error
+  */
+int door_drain_events() {
+  static bool synced = false;
+  static uint8_t last_seq;
+  // the event last_seq has been handled, but not acknowledged yet
+  static bool pending_ack = false;
+
+  // one more read than the FIFO holds, for the empty reply
+  int n;
+  for (n = 0; n <= DOORCTRL_EVENT_FIFO; n++) {
+    const uint8_t ack = pending_ack
+                      ? (DOORCTRL_EVENT_ACK | (last_seq & DOORCTRL_EVENT_ACK_SEQ))
+                      : 0;
+    struct doorctrl_event ev;
+    if (doorctrl_read_event(&ev, ack))
+      return -1;
+
+    // a valid reply means that the acknowledgement has been processed
+    pending_ack = false;
+
+    const bool empty = (ev.status == DOORCTRL_EVENT_STATUS_EMPTY);
+    if (synced && !empty && (ev.seq == last_seq)) {
+      // already handled
+      pending_ack = true;
+      continue;
+    }
+
+    if (synced) {
+      // the empty reply carries the number of the last event
+      const uint8_t missed = ev.seq - last_seq - (empty ? 0 : 1);
+      if (missed) {
+        door_events_missed += missed;
+        BLOG(LOG_WARNING, BLOG_DOOR_EVENTS_MISSED, missed, ev.seq);
       }
-      // only button activation is an event
-      before.red_active = ds.red_active;
+    }
+    synced = true;
+    last_seq = ev.seq;
+
+    if (!empty) {
+      door_events++;
+      BLOG(LOG_DEBUG, BLOG_DOOR_EVENT, ev.seq, ev.prev, ev.isb, ev.tick);
+      pending_ack = true;
     }
 
-    // send MQTT messages if there is payload
-    mqtt_send(mosq, mqtt_payload, MQTT_TOPIC_BTN);
+    // the empty reply has the current status
+    door_update(ev.isb);
+    if (empty)
+      return 0;
+  }
+
+  return 0;
+}
+
+/**
+  * Read the door status and emit MQTT messages for all changes. Uses
+  * the event FIFO of the controller if the firmware has one.
+  */
+void door_poll() {
+  // find out once if the firmware has the event FIFO
+  if (doorctrl_has_events < 0) {
+    doorctrl_has_events = doorctrl_probe_events();
+    if (!doorctrl_has_events)
+      syslog(LOG_INFO, "Door controller has no event FIFO, reading the state.");
+  }
 
-    // call the mosquitto loop to process messages
-    if (mosq) {
-      int ret;
-      ret = mosquitto_loop(mosq, 100, 1);
-      // if failed, try to reconnect
-      if (ret)
-        mosquitto_reconnect(mosq);
+  if (doorctrl_has_events > 0) {
+    if (!door_drain_events()) {
+      doorctrl_event_fails = 0;
+      return;
     }
 
-    //I3C_reset_doorctrl();
-    
-    if (sleep(1)) 
-      break;
+    /*
+     * The events stay queued and are read on the next poll; the state is
+     * only read if the FIFO keeps failing, as the queued events are
+     * older than the state.
+     */
+    if (++doorctrl_event_fails < DOORCTRL_EVENT_FAILS_MAX)
+      return;
+    if (doorctrl_event_fails == DOORCTRL_EVENT_FAILS_MAX)
+      syslog(LOG_WARNING, "Reading the door controller events failed %d "
+                        "times, reading the state.", doorctrl_event_fails);
   }
 
-  // clean-up MQTT
-  if (mosq) {
-    mosquitto_disconnect(mosq);
-    mosquitto_destroy(mosq);
+  door_update(doorctrl_read_status());
+}
+
+/**
+  * Arm the poll timer: short while the shared INT line is held low by
+  * another device, long as a safety net otherwise.
+  */
+void arm_poll_timer() {
+  long timeout = POLL_SAFETY_MS;
+  if (I3C_irq.fd < 0)
+    timeout = POLL_FALLBACK_MS;
+  else if (I3C_int_active(&I3C_irq))
+    timeout = POLL_INT_BUSY_MS;
+
+  // on replay, the trace paces the polls; stop at its end
+  if (I2C_bus.replay) {
+    if (I2C_replay_finished(&I2C_bus))
+      loop.run = 0;
+    timeout = 1;
   }
-  mosquitto_lib_cleanup();
 
+  poll_deadline = monotonic_micros() + timeout*1000LL;
+  evloop_timer_set(&ev_poll, timeout, 0);
+}
+
+/**
+  * Drop the INT relay of an i2cd that has gone away. We poll until it
+  * is back, see int_reconnect.
+  */
+void int_drop() {
+  syslog(LOG_WARNING, "Lost the I3C INT relay, falling back to polling.");
+  evloop_del(&loop, &ev_int);
+  I3C_int_close(&I3C_irq);
+}
+
+/**
+  * Connect to the INT relay again after i2cd has been restarted.
+  */
+void int_reconnect() {
+  if ((I3C_irq.fd >= 0) || !I2C_bus.sock || I3C_init())
+    return;
+
+  ev_int.fd = I3C_irq.fd;
+  if (evloop_add(&loop, &ev_int, EPOLLIN)) {
+    syslog(LOG_WARNING, "Error %d on watching the I3C INT line.", errno);
+    I3C_int_close(&I3C_irq);
+  } else
+    syslog(LOG_INFO, "I3C INT relay re-established.");
+}
+
+static void on_int(struct evloop_handler *h, uint32_t events) {
+  const long long woken = monotonic_micros();
+  const int ret = I3C_int_ack(&I3C_irq);
+  if ((ret < 0) && I3C_irq.sock)
+    int_drop();
+  // a release of the line only changes the poll interval
+  if (ret <= 0) {
+    arm_poll_timer();
+    return;
+  }
+
+  const long long edge_usec = I3C_irq.event_ns / 1000;
+  const long long wakeup = woken - edge_usec;
+  metrics_observe(&int_wakeup, wakeup);
+  if (wakeup > wakeup_max_int)
+    wakeup_max_int = wakeup;
+
+  polls_int++;
+  door_poll();
+  metrics_observe(&int_reaction, monotonic_micros() - edge_usec);
+  arm_poll_timer();
+}
+
+static void on_poll_timer(struct evloop_handler *h, uint32_t events) {
+  evloop_timer_ack(h);
+  polls_timer++;
+  if (poll_deadline) {
+    const long long late = monotonic_micros() - poll_deadline;
+    metrics_observe(&poll_lateness, late);
+    if (late > wakeup_max_timer)
+      wakeup_max_timer = late;
+  }
+  int_reconnect();
+  door_poll();
+  arm_poll_timer();
+}
+
+static void on_signal(struct evloop_handler *h, uint32_t events) {
+  const int sig = evloop_signal_read(h);
+  syslog(LOG_INFO, "Signal %d received.", sig);
+  loop.run = 0;
+}
+
+/**
+  * Register the INT line, the poll timer and the signals with the event
+  * loop. Exits with an error message on failure.
+  */
+void events_init() {
+  if (evloop_init(&loop)) {
+    syslog(LOG_EMERG, "Error %d on event loop initialization!", errno);
+    exit(-1);
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  ev_signal.cb = on_signal;
+  ev_poll.cb = on_poll_timer;
+  if (evloop_signal_init(&ev_signal, &mask) ||
+      evloop_add(&loop, &ev_signal, EPOLLIN) ||
+      evloop_timer_init(&ev_poll) ||
+      evloop_add(&loop, &ev_poll, EPOLLIN)) {
+    syslog(LOG_EMERG, "Error %d on event loop initialization!", errno);
+    exit(-1);
+  }
+
+  ev_int.cb = on_int;
+  if (I3C_irq.fd >= 0) {
+    ev_int.fd = I3C_irq.fd;
+    if (evloop_add(&loop, &ev_int, EPOLLIN))
+      syslog(LOG_WARNING, "Error %d on watching the I3C INT line.", errno);
+  }
+}
+
+/**
+  * Register the metrics and serve them on METRICS_PORT.
+  */
+void metrics_init() {
+  I2C_metrics_register(I2C_DEV_DOORCTRL);
+  I2C_recovery_metrics_register(&I2C_bus);
+  metrics_counter("polls_total", "Device polls by trigger.",
+                  "trigger=\"int\"", &polls_int);
+  metrics_counter("polls_total", "Device polls by trigger.",
+                  "trigger=\"timer\"", &polls_timer);
+  metrics_counter("door_events_total",
+                  "Events read from the door controller FIFO.",
+                  NULL, &door_events);
+  metrics_counter("door_events_missed_total",
+                  "Door controller events lost before they were read.",
+                  NULL, &door_events_missed);
+  metrics_histogram("poll_timer_lateness_seconds",
+                    "Delay of the poll timer wake-up after its deadline.",
+                    NULL, &poll_lateness);
+  metrics_histogram("int_wakeup_latency_seconds",
+                    "Delay from the I3C INT edge to the handler.",
+                    NULL, &int_wakeup);
+  metrics_histogram("int_reaction_seconds",
+                    "Delay from the I3C INT edge to the door status read.",
+                    NULL, &int_reaction);
+
+  if (metrics_http_init(&loop, METRICS_PORT))
+    syslog(LOG_WARNING, "Error %d on serving metrics on port %d.",
+                        errno, METRICS_PORT);
+}
+
+/**
+  * Switch the event loop thread to real-time mode, if enabled. The
+  * helper threads must have been started already.
+  */
+void rt_init() {
+  if (!rt.priority)
+    return;
+
+  if (rt_enter(&rt))
+    syslog(LOG_WARNING, "Error %d on entering real-time mode, "
+                        "continuing with normal scheduling.", errno);
+  else
+    syslog(LOG_INFO, "Real-time mode: SCHED_FIFO priority %d, CPU %d.",
+                     rt.priority, rt.cpu);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:b:")) != -1) {
+    switch (opt) {
+      case 'b': I2C_ADAPTER = atoi(optarg); break;
+      case 'r': rt.priority = atoi(optarg); break;
+      case 'c': rt.cpu = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-b bus] [-r rt-priority] [-c cpu]\n",
+                        argv[0]);
+        return -1;
+    }
+  }
+
+  // initialize the system logging
+  openlog("doorstate", LOG_CONS | LOG_PID, LOG_USER);
+  syslog(LOG_INFO, "Starting doorstate observer.");
+  if (blog_start(LOG_RING, "doorstate", LOG_DEBUG, LOG_INFO))
+    syslog(LOG_WARNING, "Error %d on starting the log ring, logging to syslog.",
+                        errno);
+
+  if (shmstate_create(&state, STATE_FILE))
+    syslog(LOG_WARNING, "Error %d on creating the state file %s.",
+                        errno, STATE_FILE);
+
+  // initialize I2C
+  I2C_init();
+  if (I3C_init())
+    syslog(LOG_WARNING, "Error %d on I3C INT request, falling back to polling.",
+                        errno);
+  
+  // initialize MQTT
+  mosquitto_lib_init();
+  
+  if (mqtt_pub_start(&mqtt, "doorstate", MQTT_HOST, MQTT_PORT, MQTT_SPOOL))
+    syslog(LOG_ERR, "Error %d on starting the MQTT publisher.", errno);
+  else
+    mqtt_running = 1;
+
+  events_init();
+  metrics_init();
+  rt_init();
+  
+  // the known door status
+  decode_door_status(doorctrl_read_status(), &before);
+
+  // first poll right away, then wait for events
+  evloop_timer_set(&ev_poll, 1, 0);
+  if (evloop_run(&loop))
+    syslog(LOG_ERR, "Error %d in the event loop.", errno);
+
+  // clean-up MQTT
+  if (mqtt_running)
+    mqtt_pub_stop(&mqtt);
+  mosquitto_lib_cleanup();
+  metrics_http_close();
+  evloop_close(&loop);
+
+  // clean-up I2C
+  I2C_stats_log(I2C_DEV_DOORCTRL, "doorctrl");
+  syslog(LOG_INFO, "Door controller events: %lu read, %lu missed.",
+                   door_events, door_events_missed);
+  I2C_recovery_stats_log(&I2C_bus);
+  syslog(LOG_INFO, "Worst wake-up: %lld us after INT, %lld us after the timer.",
+                   wakeup_max_int, wakeup_max_timer);
+  I2C_bus_close(&I2C_bus);
+  I3C_int_close(&I3C_irq);
+  shmstate_close(&state);
+
+  blog_stop();
   syslog(LOG_INFO, "Doorstate observer finished.");
   closelog();
     
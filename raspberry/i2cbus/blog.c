@@ -0,0 +1,222 @@
+/**
+ * @file blog.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Binary ring-buffer logger for the hot paths of the Pi daemons
+ */
+
+#include "blog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+// flusher interval
+#define BLOG_FLUSH_MS 100
+
+struct blog_header *blog_hdr = NULL;
+
+static struct blog_record *blog_ring;
+static size_t blog_maplen;
+static pthread_t blog_thread;
+static atomic_int blog_run;
+
+#define BLOG_FORMAT(id, fmt) fmt,
+static const char *blog_formats[] = {
+  BLOG_MESSAGES(BLOG_FORMAT)
+};
+#undef BLOG_FORMAT
+
+const char *blog_format(unsigned msg) {
+  return (msg < BLOG_MSG_COUNT) ? blog_formats[msg] : NULL;
+}
+
+int blog_sprint(char *buf, size_t len, const struct blog_record *rec) {
+  const char *fmt = blog_format(rec->msg);
+  if (!fmt)
+    return snprintf(buf, len, "Unknown message %u", rec->msg);
+
+  // unused arguments are ignored by the format
+  int32_t a[BLOG_ARGS] = {0};
+  memcpy(a, rec->arg, rec->nargs*sizeof(a[0]));
+  return snprintf(buf, len, fmt, a[0], a[1], a[2], a[3]);
+}
+
+static uint64_t blog_clock(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void blog_write(int level, enum blog_msg msg, int nargs, const int32_t *args) {
+  if (nargs > BLOG_ARGS)
+    nargs = BLOG_ARGS;
+
+  if (!blog_hdr) {
+    struct blog_record rec = {.msg = msg, .level = level, .nargs = nargs};
+    char buf[128];
+
+    memcpy(rec.arg, args, nargs*sizeof(args[0]));
+    blog_sprint(buf, sizeof(buf), &rec);
+    syslog(level, "%s", buf);
+    return;
+  }
+
+  const uint64_t idx = atomic_fetch_add_explicit(&blog_hdr->head, 1,
+                                                 memory_order_relaxed);
+  struct blog_record *rec = &blog_ring[idx & (BLOG_RECORDS-1)];
+
+  // invalidate the slot before it is overwritten, like a seqlock
+  atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  rec->nsec = blog_clock(CLOCK_MONOTONIC);
+  rec->msg = msg;
+  rec->level = level;
+  rec->nargs = nargs;
+  memcpy(rec->arg, args, nargs*sizeof(args[0]));
+
+  atomic_store_explicit(&rec->seq, idx+1, memory_order_release);
+}
+
+int blog_read(struct blog_header *h, uint64_t idx, struct blog_record *out) {
+  struct blog_record *ring = (struct blog_record *)(h+1);
+  struct blog_record *rec = &ring[idx % h->count];
+
+  const uint64_t s1 = atomic_load_explicit(&rec->seq, memory_order_acquire);
+  if (s1 != idx+1)
+    return (s1 > idx+1) ? -1 : 0;
+
+  out->nsec = rec->nsec;
+  out->msg = rec->msg;
+  out->level = rec->level;
+  out->nargs = rec->nargs;
+  memcpy(out->arg, rec->arg, sizeof(out->arg));
+
+  atomic_thread_fence(memory_order_acquire);
+  const uint64_t s2 = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+  return (s2 == s1) ? 1 : -1;
+}
+
+/**
+ * Forward all complete records to syslog.
+ */
+static void blog_flush() {
+  uint64_t idx = atomic_load(&blog_hdr->flushed);
+  const uint64_t head = atomic_load(&blog_hdr->head);
+
+  if (head - idx > BLOG_RECORDS) {
+    syslog(LOG_WARNING, "%d log records lost.", (int)(head - idx - BLOG_RECORDS));
+    idx = head - BLOG_RECORDS;
+  }
+
+  const int syslog_level = atomic_load(&blog_hdr->syslog_level);
+  while (idx < head) {
+    struct blog_record rec;
+    const int ret = blog_read(blog_hdr, idx, &rec);
+    // a writer is still busy with this one
+    if (!ret)
+      break;
+
+    if ((ret > 0) && (rec.level <= syslog_level)) {
+      char buf[128];
+      blog_sprint(buf, sizeof(buf), &rec);
+      syslog(rec.level, "%s", buf);
+    }
+    idx++;
+  }
+
+  atomic_store(&blog_hdr->flushed, idx);
+}
+
+static void *blog_flusher(void *arg) {
+  const struct timespec delay = {0, BLOG_FLUSH_MS*1000000L};
+
+  while (atomic_load(&blog_run)) {
+    nanosleep(&delay, NULL);
+    blog_flush();
+  }
+
+  return NULL;
+}
+
+int blog_start(const char *path, const char *name,
+               int level, int syslog_level) {
+  char old[256];
+
+  // keep the ring of the last run, it may tell why it has ended
+  snprintf(old, sizeof(old), "%s.old", path);
+  rename(path, old);
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+  if (fd < 0)
+    return -1;
+
+  blog_maplen = sizeof(struct blog_header) +
+                BLOG_RECORDS*sizeof(struct blog_record);
+  if (ftruncate(fd, blog_maplen)) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  void *map = mmap(NULL, blog_maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  struct blog_header *h = map;
+  h->version = BLOG_VERSION;
+  h->size = sizeof(struct blog_record);
+  h->count = BLOG_RECORDS;
+  h->pid = getpid();
+  h->realtime_offset = blog_clock(CLOCK_REALTIME) - blog_clock(CLOCK_MONOTONIC);
+  atomic_init(&h->level, level);
+  atomic_init(&h->syslog_level, syslog_level);
+  atomic_init(&h->head, 0);
+  atomic_init(&h->flushed, 0);
+  strncpy(h->name, name, sizeof(h->name)-1);
+  h->magic = BLOG_MAGIC;
+
+  blog_ring = (struct blog_record *)(h+1);
+  blog_hdr = h;
+  atomic_store(&blog_run, 1);
+
+  // signals are handled by the main thread only
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &prev);
+  const int err = pthread_create(&blog_thread, NULL, blog_flusher, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if (err) {
+    blog_hdr = NULL;
+    munmap(map, blog_maplen);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+void blog_stop() {
+  if (!blog_hdr)
+    return;
+
+  atomic_store(&blog_run, 0);
+  pthread_join(blog_thread, NULL);
+  blog_flush();
+
+  struct blog_header *h = blog_hdr;
+  blog_hdr = NULL;
+  munmap(h, blog_maplen);
+}
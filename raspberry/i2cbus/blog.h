@@ -0,0 +1,164 @@
+/**
+ * @file blog.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Binary ring-buffer logger for the hot paths of the Pi daemons
+ *
+ * A log record is a message id from the table below plus up to four
+ * integer arguments, written into a ring of fixed-size records in a
+ * shared memory file. Writing a record takes one atomic increment, a
+ * clock read and a few stores; nothing is formatted and no system call
+ * is made. A background thread formats the records and forwards them to
+ * syslog, but only up to the syslog level, so the verbose records stay
+ * in memory.
+ *
+ * The ring file survives a crash of the daemon and is moved aside on
+ * the next start; blogdump decodes it and also changes both levels of a
+ * running daemon.
+ *
+ * Without blog_start, records are formatted and sent to syslog
+ * directly, so library code may always log through BLOG.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+/**
+ * The message table. Arguments are printed as int.
+ */
+#define BLOG_MESSAGES(X) \
+  X(I2C_GIVEUP,         "Giving up transmission to 0x%02x after %d tries (failure class %d)!") \
+  X(I2C_RECOVERED,      "I2C device 0x%02x answers again.") \
+  X(DOOR_STATUS,        "Poll %u, door status byte: 0x%02x") \
+  X(DOOR_CLOSED,        "Door has been closed.") \
+  X(DOOR_OPENED,        "Door has been opened.") \
+  X(DOOR_UNLOCKED,      "Door has been unlocked.") \
+  X(DOOR_LOCKED,        "Door has been locked.") \
+  X(BUTTON_GREEN,       "Green button active.") \
+  X(BUTTON_RED,         "Red button active.") \
+  X(MANUAL_MODE,        "Poll %u, manual control 0x%02x mode: %d") \
+  X(MANUAL_READ_FAILED, "Could not read the status of manual control 0x%02x.") \
+  X(SWITCH_STATUS,      "Manual control 0x%02x switch %d status: %d") \
+  X(SWITCH_LOCK,        "Locking manual control 0x%02x switch %d.") \
+  X(SWITCH_OFF,         "Shutting manual control 0x%02x switch %d off.") \
+  X(SWITCH_CHANGE,      "Changing switch state for manual control 0x%02x switch %d to %d.") \
+  X(I2C_STUCK,          "I2C bus held low (SDA %d, SCL %d), recovering.") \
+  X(I2C_POWER_CYCLE,    "Power-cycling the I2C devices via GPIO%d.") \
+  X(I2C_BUS_RECOVERED,  "I2C bus free again after recovery step %d (%d clocks, %d us).") \
+  X(I2C_STILL_STUCK,    "I2C bus still held low after %d us of recovery!") \
+  X(I2C_SPEED,          "I2C bus speed set to %d kHz (divider %d).") \
+  X(I2C_SPEED_FALLBACK, "I2C error rate %d of %d transfers, lowering the bus speed to %d kHz.") \
+  X(DOOR_EVENT,         "Door event %u: status 0x%02x -> 0x%02x at tick %u.") \
+  X(DOOR_EVENTS_MISSED, "%d door controller events missed before event %u.") \
+  X(SWITCH_EVENT,       "Manual control 0x%02x switch event %u: 0x%02x") \
+  X(SWITCH_EVENTS_MISSED, "%d switch events of manual control 0x%02x missed.")
+
+#define BLOG_ENUM(id, fmt) BLOG_##id,
+enum blog_msg {
+  BLOG_MESSAGES(BLOG_ENUM)
+  BLOG_MSG_COUNT
+};
+#undef BLOG_ENUM
+
+/**
+ * @return the format string of a message id, or NULL if unknown
+ */
+const char *blog_format(unsigned msg);
+
+#define BLOG_MAGIC    0x474f4c42  // "BLOG"
+#define BLOG_VERSION  1
+#define BLOG_ARGS     4
+// must be a power of two
+#define BLOG_RECORDS  4096
+
+struct blog_record {
+  atomic_uint_least64_t seq;    // index + 1 when valid, 0 while written
+  uint64_t nsec;                // CLOCK_MONOTONIC
+  uint16_t msg;
+  uint8_t level;
+  uint8_t nargs;
+  int32_t arg[BLOG_ARGS];
+};
+
+struct blog_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;                // size of a record
+  uint32_t count;               // number of records
+  int32_t pid;
+  int64_t realtime_offset;      // CLOCK_REALTIME - CLOCK_MONOTONIC in ns
+  atomic_int level;             // records above are not written
+  atomic_int syslog_level;      // records above are not forwarded
+  atomic_uint_least64_t head;   // records written
+  atomic_uint_least64_t flushed;// records forwarded to syslog
+  char name[32];
+};
+
+// the mapped ring, or NULL if the logger has not been started
+extern struct blog_header *blog_hdr;
+
+/**
+ * @return the current recording level
+ */
+static inline int blog_level() {
+  return blog_hdr ? atomic_load_explicit(&blog_hdr->level, memory_order_relaxed)
+                  : LOG_INFO;
+}
+
+/**
+ * Write a record. Use the BLOG macro instead.
+ */
+void blog_write(int level, enum blog_msg msg, int nargs, const int32_t *args);
+
+/**
+ * Log a message from the table with up to four integer arguments, e.g.
+ * BLOG(LOG_DEBUG, BLOG_SWITCH_STATUS, addr, idx, sw);
+ */
+#define BLOG(level, msg, ...) \
+  do { \
+    if ((level) <= blog_level()) { \
+      const int32_t _blog_args[] = {0, ##__VA_ARGS__}; \
+      blog_write((level), (msg), \
+                 sizeof(_blog_args)/sizeof(_blog_args[0]) - 1, \
+                 _blog_args + 1); \
+    } \
+  } while (0)
+
+/**
+ * Format a record into a buffer.
+ * @return the number of characters as snprintf
+ */
+int blog_sprint(char *buf, size_t len, const struct blog_record *rec);
+
+/**
+ * Copy a record out of a ring, also from another process.
+ * @param h    the mapped ring
+ * @param idx  record index, see head
+ * @param out  the copy
+ * @return 1 if the record is valid, 0 if it has not been completely
+ *         written yet, -1 if it has been overwritten
+ */
+int blog_read(struct blog_header *h, uint64_t idx, struct blog_record *out);
+
+/**
+ * Create the ring file and start the flusher thread. An existing ring
+ * file, e.g. from a crash, is renamed to <path>.old first. The
+ * calling thread's signals are blocked in the flusher thread.
+ * @param path          ring file, preferably on tmpfs
+ * @param name          program name for the dump
+ * @param level         initial recording level
+ * @param syslog_level  initial level for forwarding to syslog
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int blog_start(const char *path, const char *name,
+               int level, int syslog_level);
+
+/**
+ * Forward the remaining records and stop the flusher thread. The ring
+ * file is kept for inspection.
+ */
+void blog_stop();
@@ -0,0 +1,130 @@
+/**
+ * @file diskq.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Bounded persistent FIFO on an mmap'd ring file
+ */
+
+#include "diskq.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int diskq_open(struct diskq *q, const char *path, size_t size, uint32_t count) {
+  q->fd = -1;
+  q->hdr = NULL;
+
+  if (!size || (size > UINT16_MAX) || !count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  q->maplen = sizeof(struct diskq_header) + size*count;
+
+  q->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+  if (q->fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(q->fd, &st))
+    goto fail;
+  const int fresh = (st.st_size != (off_t)q->maplen);
+
+  // allocate the blocks now, so a full disk is noticed here and not
+  // with a SIGBUS on the first write to the mapping
+  if (fresh &&
+      (ftruncate(q->fd, 0) ||
+       (errno = posix_fallocate(q->fd, 0, q->maplen))))
+    goto fail;
+
+  void *map = mmap(NULL, q->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   q->fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  q->hdr = map;
+  q->slots = (unsigned char *)map + sizeof(struct diskq_header);
+
+  struct diskq_header *h = q->hdr;
+  if (fresh ||
+      (h->magic != DISKQ_MAGIC) ||
+      (h->version != DISKQ_VERSION) ||
+      (h->size != size) ||
+      (h->count != count) ||
+      (h->head - h->tail > count)) {
+    memset(h, 0, sizeof(*h));
+    h->version = DISKQ_VERSION;
+    h->size = size;
+    h->count = count;
+    // a valid magic marks a completely initialized header
+    h->magic = DISKQ_MAGIC;
+    msync(h, sizeof(*h), MS_ASYNC);
+  }
+
+  return 0;
+
+fail:
+  {
+    const int err = errno;
+    close(q->fd);
+    q->fd = -1;
+    errno = err;
+  }
+  return -1;
+}
+
+void diskq_close(struct diskq *q) {
+  if (q->hdr) {
+    msync(q->hdr, q->maplen, MS_SYNC);
+    munmap(q->hdr, q->maplen);
+  }
+  q->hdr = NULL;
+
+  if (q->fd >= 0)
+    close(q->fd);
+  q->fd = -1;
+}
+
+int diskq_push(struct diskq *q, const void *rec) {
+  struct diskq_header *h = q->hdr;
+  int dropped = 0;
+
+  if (h->head - h->tail >= h->count) {
+    h->tail++;
+    h->dropped++;
+    dropped = 1;
+  }
+
+  memcpy(q->slots + (h->head % h->count)*h->size, rec, h->size);
+  // count the record only after it has been written
+  h->head++;
+
+  // let the kernel write back in its own time; never wait for the disk
+  msync(q->hdr, q->maplen, MS_ASYNC);
+
+  return dropped;
+}
+
+const void *diskq_peek(struct diskq *q) {
+  const struct diskq_header *h = q->hdr;
+
+  if (h->head == h->tail)
+    return NULL;
+
+  return q->slots + (h->tail % h->count)*h->size;
+}
+
+void diskq_pop(struct diskq *q) {
+  struct diskq_header *h = q->hdr;
+
+  if (h->head != h->tail)
+    h->tail++;
+}
+
+uint32_t diskq_length(struct diskq *q) {
+  return q->hdr->head - q->hdr->tail;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file diskq.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Bounded persistent FIFO on an mmap'd ring file
+ *
+ * The file holds a small header with the ring indices and a fixed
+ * number of fixed-size records. Records are appended at the head and
+ * removed at the tail; both indices live in the mapping, so the queue
+ * survives a restart of the daemon. If the ring is full, the oldest
+ * record is overwritten.
+ *
+ * The queue is not thread-safe; it is meant to be owned by a single
+ * thread.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DISKQ_MAGIC   0x51444952  // "RIDQ"
+#define DISKQ_VERSION 1
+
+struct diskq_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;                // size of a record in bytes
+  uint32_t count;               // number of slots
+  uint32_t reserved;
+  uint64_t head;                // next slot to write, runs freely
+  uint64_t tail;                // oldest record, runs freely
+  uint64_t dropped;             // records overwritten while full
+};
+
+struct diskq {
+  int fd;
+  struct diskq_header *hdr;     // start of the mapping
+  unsigned char *slots;
+  size_t maplen;
+};
+
+/**
+ * Open or create the queue file. An existing file with a different
+ * layout is reset.
+ * @param q      the queue
+ * @param path   file name
+ * @param size   size of a record in bytes
+ * @param count  number of slots
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int diskq_open(struct diskq *q, const char *path, size_t size, uint32_t count);
+
+/**
+ * Unmap and close the queue file.
+ */
+void diskq_close(struct diskq *q);
+
+/**
+ * Append a record, overwriting the oldest one if the queue is full.
+ * @return 0 if the record was added, 1 if an old record was dropped
+ */
+int diskq_push(struct diskq *q, const void *rec);
+
+/**
+ * Get the oldest record without removing it.
+ * @return pointer into the mapping or NULL if the queue is empty
+ */
+const void *diskq_peek(struct diskq *q);
+
+/**
+ * Remove the oldest record.
+ */
+void diskq_pop(struct diskq *q);
+
+/**
+ * @return the number of queued records
+ */
+uint32_t diskq_length(struct diskq *q);
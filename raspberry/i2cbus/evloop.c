@@ -0,0 +1,133 @@
+/**
+ * @file evloop.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Minimal epoll event loop for the Pi daemons
+ */
+
+#include "evloop.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define EVLOOP_MAX_EVENTS 8
+
+long long monotonic_millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec*1000LL + ts.tv_nsec/1000000L;
+}
+
+long long monotonic_micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+int evloop_init(struct evloop *loop) {
+  loop->run = 1;
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+  return (loop->epfd < 0) ? -1 : 0;
+}
+
+void evloop_close(struct evloop *loop) {
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  loop->epfd = -1;
+}
+
+static int evloop_ctl(struct evloop *loop, const int op,
+                      struct evloop_handler *h, const uint32_t events) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = h;
+
+  return epoll_ctl(loop->epfd, op, h->fd, &ev);
+}
+
+int evloop_add(struct evloop *loop, struct evloop_handler *h,
+               const uint32_t events) {
+  return evloop_ctl(loop, EPOLL_CTL_ADD, h, events);
+}
+
+int evloop_mod(struct evloop *loop, struct evloop_handler *h,
+               const uint32_t events) {
+  return evloop_ctl(loop, EPOLL_CTL_MOD, h, events);
+}
+
+int evloop_del(struct evloop *loop, struct evloop_handler *h) {
+  return evloop_ctl(loop, EPOLL_CTL_DEL, h, 0);
+}
+
+int evloop_timer_init(struct evloop_handler *h) {
+  h->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  return (h->fd < 0) ? -1 : 0;
+}
+
+int evloop_timer_set(struct evloop_handler *h,
+                     const long initial_ms, const long interval_ms) {
+  struct itimerspec its;
+  its.it_value.tv_sec     = initial_ms / 1000;
+  its.it_value.tv_nsec    = (initial_ms % 1000) * 1000000L;
+  its.it_interval.tv_sec  = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+  return timerfd_settime(h->fd, 0, &its, NULL);
+}
+
+uint64_t evloop_timer_ack(struct evloop_handler *h) {
+  uint64_t exp = 0;
+  if (read(h->fd, &exp, sizeof(exp)) != sizeof(exp))
+    return 0;
+
+  return exp;
+}
+
+int evloop_signal_init(struct evloop_handler *h, const sigset_t *mask) {
+  if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+    return -1;
+
+  h->fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  return (h->fd < 0) ? -1 : 0;
+}
+
+int evloop_signal_read(struct evloop_handler *h) {
+  struct signalfd_siginfo si;
+  if (read(h->fd, &si, sizeof(si)) != sizeof(si))
+    return -1;
+
+  return si.ssi_signo;
+}
+
+int evloop_run(struct evloop *loop) {
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+  while (loop->run) {
+    const int n = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    int i;
+    for (i = 0; (i < n) && loop->run; i++) {
+      struct evloop_handler *h = events[i].data.ptr;
+      h->cb(h, events[i].events);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file evloop.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Minimal epoll event loop for the Pi daemons
+ *
+ * Everything the daemons wait for is a file descriptor: the MQTT
+ * socket, the I³C INT line, timers (timerfd on CLOCK_MONOTONIC) and
+ * signals (signalfd). Each one is registered with a handler that is
+ * called as soon as the descriptor is ready.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <signal.h>
+
+struct evloop;
+struct evloop_handler;
+
+typedef void (*evloop_cb)(struct evloop_handler *h, uint32_t events);
+
+/**
+ * A registered file descriptor. The record must stay valid as long as
+ * it is registered.
+ */
+struct evloop_handler {
+  int fd;
+  evloop_cb cb;
+  void *ctx;                    // free for the user
+};
+
+struct evloop {
+  int epfd;
+  int run;
+};
+
+/**
+ * Get the milliseconds from the monotonic clock.
+ */
+long long monotonic_millis();
+
+/**
+ * Get the microseconds from the monotonic clock.
+ */
+long long monotonic_micros();
+
+/**
+ * Create the event loop.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int evloop_init(struct evloop *loop);
+
+/**
+ * Close the event loop.
+ */
+void evloop_close(struct evloop *loop);
+
+/**
+ * Register a handler for its file descriptor.
+ *
+ * @param events epoll events, e.g. EPOLLIN
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int evloop_add(struct evloop *loop, struct evloop_handler *h,
+               const uint32_t events);
+
+/**
+ * Change the events of a registered handler.
+ */
+int evloop_mod(struct evloop *loop, struct evloop_handler *h,
+               const uint32_t events);
+
+/**
+ * Unregister a handler.
+ */
+int evloop_del(struct evloop *loop, struct evloop_handler *h);
+
+/**
+ * Create a timerfd on CLOCK_MONOTONIC and store it in the handler.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int evloop_timer_init(struct evloop_handler *h);
+
+/**
+ * Arm a timer.
+ *
+ * @param initial_ms  Time until the first expiration, 0 disarms.
+ * @param interval_ms Period of the following expirations, 0 for a
+ *                    one-shot timer.
+ */
+int evloop_timer_set(struct evloop_handler *h,
+                     const long initial_ms, const long interval_ms);
+
+/**
+ * Acknowledge a timer expiration in the handler.
+ * @return number of expirations since the last call
+ */
+uint64_t evloop_timer_ack(struct evloop_handler *h);
+
+/**
+ * Block the signals and deliver them through a signalfd stored in the
+ * handler.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int evloop_signal_init(struct evloop_handler *h, const sigset_t *mask);
+
+/**
+ * Read a delivered signal in the handler.
+ * @return the signal number, or -1 if none is pending
+ */
+int evloop_signal_read(struct evloop_handler *h);
+
+/**
+ * Dispatch events until loop->run is cleared.
+ * @return 0 if stopped, -1 on error (errno is set)
+ */
+int evloop_run(struct evloop *loop);
@@ -0,0 +1,529 @@
+/**
+ * @file i2cbus.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief I2C transport for the I³C devices on the Raspberry Pi
+ */
+
+#include "i2cbus.h"
+#include "i2cproto.h"
+#include "i2crecover.h"
+#include "blog.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <time.h>
+#include <syslog.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+const struct I2C_retry_policy I2C_retry_default = {
+  .max_tries       = 10,
+  .base_delay_usec = 500,
+  .max_delay_usec  = 50000,
+  .degrade_after   = 3
+};
+
+/**
+ * Get the microseconds from the monotonic clock.
+ */
+static long long monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+/**
+ * Connect to the socket of the I2C bus daemon.
+ *
+ * @return the socket or -1 on error
+ */
+static int I2C_sock_connect(const char *path) {
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // a stalled daemon must not block the client for good
+  const struct timeval tv = {
+    I2CD_TIMEOUT_MS / 1000, (I2CD_TIMEOUT_MS % 1000) * 1000
+  };
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+      (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0)) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+int I2C_bus_open(struct I2C_bus *bus, const char *path) {
+  bus->path = path;
+  bus->sock = 0;
+  bus->trace_fd = -1;
+  bus->replay = NULL;
+  bus->recovery = NULL;
+  bus->resets = 0;
+
+  struct stat st;
+  if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+    bus->sock = 1;
+    bus->fd = I2C_sock_connect(path);
+  } else
+    bus->fd = open(path, O_RDWR | O_CLOEXEC);
+
+  return (bus->fd < 0) ? -1 : 0;
+}
+
+void I2C_bus_close(struct I2C_bus *bus) {
+  I2C_trace_stop(bus);
+  I2C_replay_close(bus);
+  I2C_recovery_close(bus);
+
+  if (bus->fd >= 0)
+    close(bus->fd);
+  bus->fd = -1;
+}
+
+void I2C_device_init(struct I2C_device *dev, struct I2C_bus *bus,
+                     const uint8_t addr) {
+  dev->bus = bus;
+  dev->addr = addr;
+  dev->policy = &I2C_retry_default;
+  dev->prio = I2CD_PRIO_POLL;
+  dev->seed = (unsigned int)monotonic_usec() ^ addr;
+  memset(&dev->shadow, 0, sizeof(dev->shadow));
+  dev->shadow.resets = bus->resets;
+  memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+int I2C_build_command(const char command, const char data) {
+  // check parameter range
+  if ((command < 0) || (command > 0x07))
+    return I2C_ERR_INVALIDARGUMENT;
+  if ((data < 0) || (data > 0x0f))
+    return I2C_ERR_INVALIDARGUMENT;
+
+  // build the I2C data byte
+  // arguments have been checked,
+  // this cannot be negative or more than 8 bits
+  unsigned char send = (command << 4) + data;
+
+  // calculate the parity
+  char v = send;
+  char c;
+  for (c = 0; v; c++)
+    v &= v-1;
+  c &= 1;
+
+  // set parity bit
+  send += (c << 7);
+
+  return send;
+}
+
+/**
+ * Record the duration of a transfer.
+ */
+static void I2C_record_time(struct I2C_stats *st, const long usec) {
+  st->transactions++;
+  st->last_usec = usec;
+  st->total_usec += usec;
+  if (usec > st->max_usec)
+    st->max_usec = usec;
+  metrics_observe(&st->latency, usec);
+}
+
+/**
+ * Let the I2C bus daemon execute a transfer.
+ * If the daemon has gone away, try to connect again once.
+ *
+ * @return 0 on success, -ETIMEDOUT if the daemon does not answer within
+ *         I2CD_TIMEOUT_MS, otherwise -errno
+ */
+static int I2C_sock_transfer(struct I2C_device *dev, const uint8_t cmd,
+                             uint8_t *reply, const size_t len) {
+  struct I2C_bus *bus = dev->bus;
+
+  if (len > I2CD_REPLY_MAX)
+    return -EINVAL;
+
+  const struct i2cd_request req = {
+    .addr = dev->addr, .send = cmd, .len = len, .prio = dev->prio
+  };
+  struct i2cd_response res;
+
+  int tries;
+  for (tries = 0; tries < 2; tries++) {
+    if (bus->fd < 0)
+      bus->fd = I2C_sock_connect(bus->path);
+    if (bus->fd < 0)
+      return -errno;
+
+    int err = EPIPE;
+    if (send(bus->fd, &req, sizeof(req), MSG_NOSIGNAL) == (ssize_t)sizeof(req)) {
+      const ssize_t n = recv(bus->fd, &res, sizeof(res), 0);
+      if (n == (ssize_t)sizeof(res))
+        break;
+      // 0 if the daemon has closed the connection
+      if (n < 0)
+        err = ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? ETIMEDOUT : errno;
+    } else
+      err = errno;
+
+    // a late response must not be taken for the next request
+    close(bus->fd);
+    bus->fd = -1;
+    if (tries || (err == ETIMEDOUT))
+      return -err;
+  }
+
+  // the daemon has power cycled the devices, see I2C_shadow_sync
+  bus->resets = res.resets;
+
+  if (res.err)
+    return res.err;
+  if (res.len != len)
+    return -EPROTO;
+
+  memcpy(reply, res.reply, len);
+  return 0;
+}
+
+int I2C_transfer(struct I2C_device *dev, const uint8_t send,
+                 uint8_t *reply, const size_t len) {
+  if (dev->bus->replay || dev->bus->sock) {
+    const long long start = monotonic_usec();
+    const int ret = dev->bus->replay
+                  ? I2C_replay_transfer(dev->bus, dev->addr, send, reply, len)
+                  : I2C_sock_transfer(dev, send, reply, len);
+    I2C_record_time(&dev->stats, monotonic_usec() - start);
+    I2C_trace_write(dev->bus, dev->addr, send, reply, len, ret);
+    return ret;
+  }
+
+  uint8_t cmd = send;
+
+  // write the command, then read the reply after a repeated start
+  struct i2c_msg msgs[2] = {
+    { .addr = dev->addr, .flags = 0,        .len = 1,   .buf = &cmd  },
+    { .addr = dev->addr, .flags = I2C_M_RD, .len = len, .buf = reply }
+  };
+  struct i2c_rdwr_ioctl_data xfer = { .msgs = msgs, .nmsgs = 2 };
+
+  // no recovery of another process may take the pins meanwhile
+  I2C_recovery_hold(dev->bus);
+  const long long start = monotonic_usec();
+  const int ret = ioctl(dev->bus->fd, I2C_RDWR, &xfer) < 0 ? -errno : 0;
+  I2C_recovery_release(dev->bus);
+  I2C_record_time(&dev->stats, monotonic_usec() - start);
+  I2C_trace_write(dev->bus, dev->addr, send, reply, len, ret);
+
+  return ret;
+}
+
+enum I2C_failure I2C_classify_errno(const int err) {
+  switch (err) {
+    // the device did not acknowledge, e.g. while it is busy
+    case ENXIO:
+    case EREMOTEIO:
+      return I2C_FAIL_NACK;
+    // bus timeout, lost arbitration or a held clock
+    case ETIMEDOUT:
+    case EAGAIN:
+    case EIO:
+    case EINTR:
+    // the queue of i2cd is full, a transient overload
+    case EBUSY:
+      return I2C_FAIL_TIMEOUT;
+    // bad descriptor, unsupported transfer, adapter gone
+    default:
+      return I2C_FAIL_HARD;
+  }
+}
+
+/**
+ * Wait before the next try: capped exponential backoff with full jitter.
+ *
+ * @param try Number of the failed try, starting with 0.
+ */
+static void I2C_backoff(struct I2C_device *dev, const int try) {
+  const struct I2C_retry_policy *p = dev->policy;
+
+  long cap = p->base_delay_usec;
+  int i;
+  for (i = 0; (i < try) && (cap < p->max_delay_usec); i++)
+    cap <<= 1;
+  if (cap > p->max_delay_usec)
+    cap = p->max_delay_usec;
+  if (cap <= 0)
+    return;
+
+  const long delay = rand_r(&dev->seed) % (cap + 1);
+  dev->stats.backoff_usec += delay;
+  usleep(delay);
+}
+
+/**
+ * Do one transfer and validate the reply.
+ *
+ * @return I2C_FAIL_NONE if the reply is valid, otherwise the failure class
+ */
+static enum I2C_failure I2C_try_block(struct I2C_device *dev,
+                                      const uint8_t send,
+                                      uint8_t *reply, const size_t len) {
+  const int ret = I2C_transfer(dev, send, reply, 2*len);
+  if (ret)
+    return I2C_classify_errno(-ret);
+
+  // check for transmission errors: each byte is followed by its inversion
+  size_t i;
+  for (i = 0; i < len; i++) {
+    const unsigned char c = ~reply[2*i];
+    if (reply[2*i+1] != c)
+      return I2C_FAIL_MISMATCH;
+  }
+
+  // the first byte must not be zero
+  if (!reply[0])
+    return I2C_FAIL_ZERO;
+
+  return I2C_FAIL_NONE;
+}
+
+int I2C_command_block(struct I2C_device *dev,
+                      const char command, const char data,
+                      uint8_t *result, const size_t len) {
+  const int send = I2C_build_command(command, data);
+  if (send < 0)
+    return send;
+  if (!len || (len > I2C_BLOCK_MAX))
+    return I2C_ERR_INVALIDARGUMENT;
+
+  const struct I2C_retry_policy *p = dev->policy;
+  struct I2C_stats *st = &dev->stats;
+
+  // a device that keeps failing only gets one try until it recovers
+  int tries = (st->giveup_streak >= p->degrade_after) ? 1 : p->max_tries;
+
+  uint8_t reply[2*I2C_BLOCK_MAX];
+  enum I2C_failure fail = I2C_FAIL_NONE;
+
+  int try;
+  int attempts = 0;
+  int recovered = 0;
+  for (try = 0; try < tries; try++) {
+    attempts++;
+    if (try) {
+      st->retries++;
+      I2C_backoff(dev, try-1);
+    }
+
+    fail = I2C_try_block(dev, send, reply, len);
+    if (fail == I2C_FAIL_NONE)
+      break;
+
+    st->failures++;
+    st->failure_class[fail]++;
+
+    // a bus held low fails every try; free it and try once more
+    if (((fail == I2C_FAIL_HARD) || (try == tries-1)) && !recovered &&
+        (I2C_recover(dev->bus) > 0)) {
+      recovered = 1;
+      tries = try + 2;
+      continue;
+    }
+
+    // retrying does not help here
+    if (fail == I2C_FAIL_HARD)
+      break;
+  }
+
+  if (fail != I2C_FAIL_NONE) {
+    st->giveups++;
+    st->giveup_streak++;
+    I2C_shadow_invalidate(dev, I2C_SHADOW_ALL);
+    BLOG(LOG_DEBUG, BLOG_I2C_GIVEUP, dev->addr, attempts, fail);
+    return (fail == I2C_FAIL_HARD) ? I2C_ERR_IO : I2C_ERR_TRANSMISSION;
+  }
+
+  if (st->giveup_streak >= p->degrade_after)
+    BLOG(LOG_INFO, BLOG_I2C_RECOVERED, dev->addr);
+  st->giveup_streak = 0;
+
+  size_t i;
+  for (i = 0; i < len; i++)
+    result[i] = reply[2*i];
+
+  return 0;
+}
+
+int I2C_command(struct I2C_device *dev, const char command, const char data) {
+  uint8_t result = 0;
+
+  const int ret = I2C_command_block(dev, command, data, &result, 1);
+  if (ret == I2C_ERR_INVALIDARGUMENT)
+    return ret;
+
+  // 0 states an error
+  return ret ? 0 : result;
+}
+
+int I2C_command_prio(struct I2C_device *dev, const uint8_t prio,
+                     const char command, const char data) {
+  const uint8_t old = dev->prio;
+
+  dev->prio = prio;
+  const int ret = I2C_command(dev, command, data);
+  dev->prio = old;
+
+  return ret;
+}
+
+int I2C_command_shadow(struct I2C_device *dev, const int slot,
+                       const char command, const char data) {
+  if ((slot < 0) || (slot >= I2C_SHADOW_SLOTS))
+    return I2C_ERR_INVALIDARGUMENT;
+
+  const int send = I2C_build_command(command, data);
+  if (send < 0)
+    return send;
+
+  struct I2C_shadow *sh = &dev->shadow;
+  I2C_shadow_sync(dev);
+
+  // drop the write if it would not change anything
+  if ((sh->valid & (1 << slot)) && (sh->send[slot] == send)) {
+    dev->stats.shadow_hits++;
+    return sh->reply[slot];
+  }
+
+  const int ret = I2C_command(dev, command, data);
+  // a power cycle during the command has reset the other slots; the
+  // command itself has been repeated after it
+  I2C_shadow_sync(dev);
+  if (ret > 0) {
+    sh->send[slot] = send;
+    sh->reply[slot] = ret;
+    sh->valid |= (1 << slot);
+  } else
+    I2C_shadow_invalidate(dev, slot);
+
+  return ret;
+}
+
+void I2C_shadow_store(struct I2C_device *dev, const int slot,
+                      const char command, const char data,
+                      const uint8_t reply) {
+  const int send = I2C_build_command(command, data);
+  if ((slot < 0) || (slot >= I2C_SHADOW_SLOTS) || (send < 0))
+    return;
+
+  I2C_shadow_sync(dev);
+  dev->shadow.send[slot] = send;
+  dev->shadow.reply[slot] = reply;
+  dev->shadow.valid |= (1 << slot);
+}
+
+void I2C_shadow_invalidate(struct I2C_device *dev, const int slot) {
+  if (slot == I2C_SHADOW_ALL)
+    dev->shadow.valid = 0;
+  else if ((slot >= 0) && (slot < I2C_SHADOW_SLOTS))
+    dev->shadow.valid &= ~(1 << slot);
+}
+
+void I2C_shadow_sync(struct I2C_device *dev) {
+  if (dev->shadow.resets == dev->bus->resets)
+    return;
+
+  dev->shadow.valid = 0;
+  dev->shadow.resets = dev->bus->resets;
+}
+
+int I2C_shadow_get(struct I2C_device *dev, const int slot,
+                   char *command, char *data) {
+  I2C_shadow_sync(dev);
+  if ((slot < 0) || (slot >= I2C_SHADOW_SLOTS) ||
+      !(dev->shadow.valid & (1 << slot)))
+    return 0;
+
+  *command = (dev->shadow.send[slot] & 0x70) >> 4;
+  *data    = dev->shadow.send[slot] & 0x0f;
+  return 1;
+}
+
+void I2C_stats_log(const struct I2C_device *dev, const char *name) {
+  const struct I2C_stats *st = &dev->stats;
+
+  syslog(LOG_INFO, "I2C %s (0x%02x): %lu transfers, %lu failures "
+                   "(zero %lu, mismatch %lu, nack %lu, timeout %lu, hard %lu), "
+                   "%lu retries, %lu give-ups, avg %lld us, max %ld us, "
+                   "backoff %lld us, %lu writes dropped.",
+                   name, dev->addr,
+                   st->transactions, st->failures,
+                   st->failure_class[I2C_FAIL_ZERO],
+                   st->failure_class[I2C_FAIL_MISMATCH],
+                   st->failure_class[I2C_FAIL_NACK],
+                   st->failure_class[I2C_FAIL_TIMEOUT],
+                   st->failure_class[I2C_FAIL_HARD],
+                   st->retries, st->giveups,
+                   st->transactions ? st->total_usec / st->transactions : 0,
+                   st->max_usec, st->backoff_usec, st->shadow_hits);
+}
+
+int I2C_metrics_register(struct I2C_device *dev) {
+  static const char *classes[I2C_FAIL_CLASSES] = {
+    [I2C_FAIL_ZERO] = "zero", [I2C_FAIL_MISMATCH] = "mismatch",
+    [I2C_FAIL_NACK] = "nack", [I2C_FAIL_TIMEOUT] = "timeout",
+    [I2C_FAIL_HARD] = "hard"
+  };
+  struct I2C_stats *st = &dev->stats;
+  char labels[METRICS_LABELS_MAX];
+  int ret = 0;
+
+  snprintf(labels, sizeof(labels), "device=\"0x%02x\"", dev->addr);
+  ret |= metrics_counter("i2c_transfers_total",
+                         "I2C transfers including retries.",
+                         labels, &st->transactions);
+  ret |= metrics_counter("i2c_retries_total",
+                         "I2C transfers repeated after a failure.",
+                         labels, &st->retries);
+  ret |= metrics_counter("i2c_giveups_total",
+                         "I2C commands that ran out of retries.",
+                         labels, &st->giveups);
+  ret |= metrics_counter("i2c_shadow_hits_total",
+                         "I2C writes dropped by the shadow cache.",
+                         labels, &st->shadow_hits);
+  ret |= metrics_histogram("i2c_transfer_duration_seconds",
+                           "Duration of a single I2C transfer.",
+                           labels, &st->latency);
+
+  int i;
+  for (i = I2C_FAIL_ZERO; i < I2C_FAIL_CLASSES; i++) {
+    snprintf(labels, sizeof(labels), "device=\"0x%02x\",class=\"%s\"",
+             dev->addr, classes[i]);
+    ret |= metrics_counter("i2c_failures_total",
+                           "Failed I2C transfers by failure class.",
+                           labels, &st->failure_class[i]);
+  }
+
+  return ret;
+}
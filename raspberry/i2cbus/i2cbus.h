@@ -0,0 +1,307 @@
+/**
+ * @file i2cbus.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief I2C transport for the I³C devices on the Raspberry Pi
+ *
+ * Talks to /dev/i2c-N directly. Each command is sent as one combined
+ * I2C_RDWR transfer: the command byte is written and the reply is read
+ * back after a repeated start, within a single kernel call.
+ *
+ * I³C command byte format:
+ *
+ *   PCCCDDDD
+ *
+ *   parity (P)   even parity over the lower 7 bits
+ *   command (C)
+ *   data (D)
+ *
+ * The devices reply with two bytes, the second byte being the binary
+ * inversion of the first. A first byte of 0 states an error.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "metrics.h"
+#include "i2ctrace.h"
+
+#define I2C_ERR_TRANSMISSION    -1
+#define I2C_ERR_INVALIDARGUMENT -2
+#define I2C_ERR_IO              -3
+
+// maximal number of reply bytes for I2C_command_block
+#define I2C_BLOCK_MAX 16
+
+/**
+ * Failure classes of a single transfer.
+ */
+enum I2C_failure {
+  I2C_FAIL_NONE = 0,
+  I2C_FAIL_ZERO,        // device replied 0, i.e. it rejected the command
+  I2C_FAIL_MISMATCH,    // reply byte and its inversion do not match
+  I2C_FAIL_NACK,        // address or data not acknowledged
+  I2C_FAIL_TIMEOUT,     // bus timeout or lost arbitration
+  I2C_FAIL_HARD,        // adapter error, retrying does not help
+  I2C_FAIL_CLASSES
+};
+
+/**
+ * Retry policy for I³C commands.
+ *
+ * Soft failures are retried with a capped exponential backoff and full
+ * jitter, hard failures end the command at once. A device that gave up
+ * degrade_after times in a row only gets a single try per command until
+ * it answers again, so it cannot hog the bus.
+ */
+struct I2C_retry_policy {
+  int max_tries;         // maximal number of transfers per command
+  long base_delay_usec;  // backoff before the second try
+  long max_delay_usec;   // upper limit of the backoff
+  unsigned long degrade_after;  // give-ups in a row until the device is degraded
+};
+
+extern const struct I2C_retry_policy I2C_retry_default;
+
+/**
+ * Transaction statistics, kept per device.
+ */
+struct I2C_stats {
+  unsigned long transactions;   // number of I2C_RDWR transfers
+  unsigned long failures;       // transfers that failed or did not validate
+  unsigned long failure_class[I2C_FAIL_CLASSES];  // failures by class
+  unsigned long retries;        // transfers repeated after a failure
+  unsigned long giveups;        // commands that ran out of retries
+  unsigned long giveup_streak;  // give-ups in a row
+  long long backoff_usec;       // time spent in backoff
+  unsigned long shadow_hits;    // writes dropped by the shadow cache
+  long last_usec;               // duration of the last transfer
+  long max_usec;                // longest transfer seen
+  long long total_usec;         // sum of all transfer durations
+  struct metrics_histogram latency;  // transfer durations
+};
+
+// number of shadowed settings per device
+#define I2C_SHADOW_SLOTS 8
+#define I2C_SHADOW_ALL   -1
+
+/**
+ * Shadow of the idempotent settings of a device (LED pattern, shutter
+ * direction, ...). Each slot holds the last command byte the device
+ * acknowledged and its reply, so that a write that would not change
+ * anything can be dropped.
+ */
+struct I2C_shadow {
+  uint8_t valid;                // bit mask of valid slots
+  uint8_t resets;               // bus->resets when the slots were valid
+  uint8_t send[I2C_SHADOW_SLOTS];
+  uint8_t reply[I2C_SHADOW_SLOTS];
+};
+
+/**
+ * An opened I2C adapter, e.g. /dev/i2c-1, or a connection to the
+ * socket of the I2C bus daemon, see i2cproto.h
+ */
+struct I2C_bus {
+  int fd;
+  const char *path;
+  int sock;                     // connected to i2cd
+  int trace_fd;                 // transfers are recorded here, or -1
+  struct I2C_replay *replay;    // transfers are answered from a trace
+  struct I2C_recovery *recovery;  // frees a stuck bus, see i2crecover.h
+  uint8_t resets;               // power cycles of the devices, mod 256
+};
+
+/**
+ * An I³C device on a bus.
+ */
+struct I2C_device {
+  struct I2C_bus *bus;
+  uint8_t addr;
+  const struct I2C_retry_policy *policy;
+  uint8_t prio;                 // i2cd priority class of the commands
+  unsigned int seed;            // jitter random state
+  struct I2C_shadow shadow;
+  struct I2C_stats stats;
+};
+
+/**
+ * Open an I2C adapter. If path is a Unix socket, connect to the I2C bus
+ * daemon instead; all transfers are then executed by the daemon.
+ *
+ * @param bus  The bus record to initialize.
+ * @param path Path of the adapter device, e.g. "/dev/i2c-1", or of the
+ *             daemon socket, e.g. I2CD_SOCKET
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I2C_bus_open(struct I2C_bus *bus, const char *path);
+
+/**
+ * Close an I2C adapter.
+ */
+void I2C_bus_close(struct I2C_bus *bus);
+
+/**
+ * Initialize a device record with the default retry policy and the
+ * priority class for periodic polls.
+ *
+ * @param dev  The device record.
+ * @param bus  The bus the device is attached to.
+ * @param addr 7-bit slave address of the device.
+ */
+void I2C_device_init(struct I2C_device *dev, struct I2C_bus *bus,
+                     const uint8_t addr);
+
+/**
+ * Build the I³C command byte including the parity bit.
+ *
+ * @return the command byte or I2C_ERR_INVALIDARGUMENT if command or
+ *         data are out of range
+ */
+int I2C_build_command(const char command, const char data);
+
+/**
+ * Send a raw command byte and read the reply in one combined transfer.
+ * The duration of the transfer is recorded in the device statistics.
+ *
+ * @param dev   The target device.
+ * @param send  The command byte, see I2C_build_command.
+ * @param reply Buffer for the reply.
+ * @param len   Number of reply bytes to read.
+ * @return 0 on success, otherwise -errno of the failed ioctl
+ */
+int I2C_transfer(struct I2C_device *dev, const uint8_t send,
+                 uint8_t *reply, const size_t len);
+
+/**
+ * Send an I³C command and return the validated reply byte.
+ *
+ * @param dev     The target device.
+ * @param command Command, 0x0 to 0x7.
+ * @param data    Data, 0x0 to 0xf.
+ * @return the reply byte, 0 if the transmission failed or
+ *         I2C_ERR_INVALIDARGUMENT
+ */
+int I2C_command(struct I2C_device *dev, const char command, const char data);
+
+/**
+ * Send an I³C command with the given i2cd priority class instead of the
+ * priority of the device. Only has an effect when using the I2C bus
+ * daemon.
+ *
+ * @param dev     The target device.
+ * @param prio    Priority class, one of I2CD_PRIO_XXX.
+ * @param command Command, 0x0 to 0x7.
+ * @param data    Data, 0x0 to 0xf.
+ * @return see I2C_command
+ */
+int I2C_command_prio(struct I2C_device *dev, const uint8_t prio,
+                     const char command, const char data);
+
+/**
+ * Send an I³C command with a multi-byte reply. The device sends each
+ * reply byte followed by its inversion; the first byte must not be zero.
+ *
+ * @param dev     The target device.
+ * @param command Command, 0x0 to 0x7.
+ * @param data    Data, 0x0 to 0xf.
+ * @param result  Buffer for the validated reply bytes.
+ * @param len     Number of reply bytes, at most I2C_BLOCK_MAX.
+ * If recovery is enabled for the bus and a line is found held low after
+ * the last try, the bus is recovered and the command is tried once more.
+ *
+ * @return 0 on success, I2C_ERR_TRANSMISSION if all tries failed,
+ *         I2C_ERR_IO on a hard error or I2C_ERR_INVALIDARGUMENT
+ */
+int I2C_command_block(struct I2C_device *dev,
+                      const char command, const char data,
+                      uint8_t *result, const size_t len);
+
+/**
+ * Send an idempotent I³C command through the shadow cache: if the device
+ * has already acknowledged the same command for this slot, nothing is
+ * sent and the cached reply is returned. A failed command invalidates
+ * the slot.
+ *
+ * All slots of a device are invalidated when a command to the device
+ * gives up, as its state is unknown afterwards.
+ *
+ * @param dev     The target device.
+ * @param slot    Shadow slot of the setting, 0 to I2C_SHADOW_SLOTS-1.
+ * @param command Command, 0x0 to 0x7.
+ * @param data    Data, 0x0 to 0xf.
+ * @return see I2C_command
+ */
+int I2C_command_shadow(struct I2C_device *dev, const int slot,
+                       const char command, const char data);
+
+/**
+ * Record a setting that is known to be active on the device, e.g.
+ * after a command that changes several settings at once.
+ *
+ * @param dev     The device.
+ * @param slot    Shadow slot of the setting.
+ * @param command Command that would set this state.
+ * @param data    Data that would set this state.
+ * @param reply   Reply of the device to this command.
+ */
+void I2C_shadow_store(struct I2C_device *dev, const int slot,
+                      const char command, const char data,
+                      const uint8_t reply);
+
+/**
+ * Forget a shadowed setting, so that the next write is sent in any case,
+ * e.g. after the device has been reset or the setting was changed by
+ * somebody else.
+ *
+ * @param dev  The device.
+ * @param slot Shadow slot or I2C_SHADOW_ALL.
+ */
+void I2C_shadow_invalidate(struct I2C_device *dev, const int slot);
+
+/**
+ * Forget all shadowed settings if the devices of the bus have been power
+ * cycled since they were stored, i.e. bus->resets has changed. Called by
+ * the other shadow functions.
+ *
+ * @param dev  The device.
+ */
+void I2C_shadow_sync(struct I2C_device *dev);
+
+/**
+ * Get a shadowed setting.
+ *
+ * @param dev     The device.
+ * @param slot    Shadow slot of the setting.
+ * @param command Receives the command of the setting.
+ * @param data    Receives the data of the setting.
+ * @return 1 if the slot is valid, otherwise 0
+ */
+int I2C_shadow_get(struct I2C_device *dev, const int slot,
+                   char *command, char *data);
+
+/**
+ * Classify the errno of a failed transfer.
+ *
+ * @return one of I2C_FAIL_NACK, I2C_FAIL_TIMEOUT or I2C_FAIL_HARD
+ */
+enum I2C_failure I2C_classify_errno(const int err);
+
+/**
+ * Log the transaction statistics of a device to syslog.
+ *
+ * @param dev  The device.
+ * @param name Name of the device for the log message.
+ */
+void I2C_stats_log(const struct I2C_device *dev, const char *name);
+
+/**
+ * Register the transaction statistics of a device with the metrics
+ * registry, labelled with the device address.
+ *
+ * @param dev  The device.
+ * @return 0 on success, -1 if the registry is full
+ */
+int I2C_metrics_register(struct I2C_device *dev);
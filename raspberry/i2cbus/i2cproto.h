@@ -0,0 +1,74 @@
+/**
+ * @file i2cproto.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Request/response protocol of the I2C bus daemon (i2cd)
+ *
+ * i2cd owns the I2C adapter and serializes all transfers. Clients
+ * connect to its Unix socket (SOCK_SEQPACKET, one message per request
+ * or response) and send one request per transfer. Each request is
+ * executed as one combined transfer: the command byte is written and
+ * len reply bytes are read after a repeated start.
+ *
+ * Retries and reply validation stay with the client.
+ *
+ * Pending requests are scheduled by priority class: the daemon always
+ * executes the most urgent request next, so a door unlock only has to
+ * wait for the transfer that is currently on the bus.
+ *
+ * The daemon may serve several adapters, each with its own queues. A
+ * client selects the bus by the socket it connects to.
+ *
+ * The daemon also owns the I³C INT line. Clients connected to
+ * I2CD_INT_SOCKET get an i2cd_int_event on each edge, and one with the
+ * current level right after connecting; they never send anything.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// socket of the first bus
+#define I2CD_SOCKET     "/run/i2cd.sock"
+// socket of the adapter /dev/i2c-N, formatted with N
+#define I2CD_SOCKET_BUS "/run/i2cd-%d.sock"
+// edges of the I³C INT line
+#define I2CD_INT_SOCKET "/run/i2cd-int.sock"
+// maximal number of adapters served by one daemon
+#define I2CD_BUSES_MAX  4
+
+/*
+ * A client gives up waiting for a response after this time. It covers
+ * the queued requests and a bus recovery with a power cycle.
+ */
+#define I2CD_TIMEOUT_MS 3000
+
+// maximal number of reply bytes, same as the usitwislave buffer
+#define I2CD_REPLY_MAX 32
+
+// priority classes, see i2cd_request.prio
+#define I2CD_PRIO_POLL   0  // periodic status polls
+#define I2CD_PRIO_USER   1  // user-triggered actions, e.g. shutter moves
+#define I2CD_PRIO_SAFETY 2  // safety stop and door lock actions
+#define I2CD_PRIO_LEVELS 3
+
+struct i2cd_request {
+  uint8_t addr;     // 7-bit slave address
+  uint8_t send;     // command byte
+  uint8_t len;      // number of reply bytes
+  uint8_t prio;     // priority class, I2CD_PRIO_XXX
+};
+
+struct i2cd_response {
+  int16_t err;      // 0 or -errno of the failed transfer
+  uint8_t len;      // number of reply bytes
+  uint8_t resets;   // power cycles of the bus devices, mod 256
+  uint32_t usec;    // duration of the transfer on the bus
+  uint8_t reply[I2CD_REPLY_MAX];
+};
+
+struct i2cd_int_event {
+  uint64_t event_ns;  // falling edge, CLOCK_MONOTONIC; 0 if none
+  uint8_t active;     // the line is held low
+  uint8_t reserved[7];
+};
@@ -0,0 +1,363 @@
+/**
+ * @file i2crecover.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Recovery of an I2C bus that is held low by a device
+ */
+
+#include "i2crecover.h"
+#include "i2cbus.h"
+#include "blog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+const struct I2C_recovery_config I2C_recovery_pihat = {
+  .sda = 2,
+  .scl = 3,
+  .power = 23,
+  .power_on_level = 1,
+  .power_off_ms = 200,
+  .power_on_ms = 500,
+  .power_holdoff_ms = 10000
+};
+
+// GPIO registers, as 32 bit word offsets
+#define GPFSEL0 (0x00/4)
+#define GPSET0  (0x1c/4)
+#define GPCLR0  (0x28/4)
+#define GPLEV0  (0x34/4)
+
+#define GPIO_FSEL_INPUT  0
+#define GPIO_FSEL_OUTPUT 1
+#define GPIO_FSEL_ALT0   4
+
+#define GPIO_MAP_SIZE 4096
+
+// half of an SCL period at 100 kHz
+#define HALF_PERIOD_NSEC 5000
+// a device may stretch the clock up to this long
+#define STRETCH_USEC     1000
+// clocks that complete any byte a device may be stuck in
+#define RECOVERY_CLOCKS  9
+
+static long long recovery_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+/**
+ * Busy-wait for a few microseconds; nanosleep is far too coarse here.
+ */
+static void recovery_delay(long nsec) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  while ((now.tv_sec - start.tv_sec)*1000000000L +
+         (now.tv_nsec - start.tv_nsec) < nsec);
+}
+
+static void gpio_fsel(volatile uint32_t *gpio, int pin, int fsel) {
+  volatile uint32_t *reg = &gpio[GPFSEL0 + pin/10];
+  const int shift = (pin % 10) * 3;
+
+  *reg = (*reg & ~(7u << shift)) | ((uint32_t)fsel << shift);
+}
+
+static int gpio_level(volatile uint32_t *gpio, int pin) {
+  return (gpio[GPLEV0] >> pin) & 1;
+}
+
+static void gpio_write(volatile uint32_t *gpio, int pin, int level) {
+  gpio[level ? GPSET0 : GPCLR0] = 1u << pin;
+}
+
+/**
+ * Pull a line low, with the output latch cleared first.
+ */
+static void line_low(volatile uint32_t *gpio, int pin) {
+  gpio_write(gpio, pin, 0);
+  gpio_fsel(gpio, pin, GPIO_FSEL_OUTPUT);
+}
+
+/**
+ * Release a line; the pull-ups take it high.
+ */
+static void line_release(volatile uint32_t *gpio, int pin) {
+  gpio_fsel(gpio, pin, GPIO_FSEL_INPUT);
+}
+
+/**
+ * Release SCL and wait while a device stretches the clock.
+ * @return 1 if SCL is high
+ */
+static int scl_release(volatile uint32_t *gpio, int scl) {
+  line_release(gpio, scl);
+
+  const long long until = recovery_usec() + STRETCH_USEC;
+  while (!gpio_level(gpio, scl))
+    if (recovery_usec() > until)
+      return 0;
+  return 1;
+}
+
+static int lines_free(const struct I2C_recovery *r) {
+  return gpio_level(r->gpio, r->cfg->sda) && gpio_level(r->gpio, r->cfg->scl);
+}
+
+/**
+ * Step 1: clock SCL until SDA is released, then send a STOP.
+ * @return 1 if the lines are free afterwards
+ */
+static int recovery_clock(struct I2C_recovery *r) {
+  volatile uint32_t *gpio = r->gpio;
+  const int sda = r->cfg->sda;
+  const int scl = r->cfg->scl;
+
+  // take the pins from the I2C controller
+  line_release(gpio, sda);
+  scl_release(gpio, scl);
+
+  int i;
+  for (i = 0; (i < RECOVERY_CLOCKS) && !gpio_level(gpio, sda); i++) {
+    line_low(gpio, scl);
+    recovery_delay(HALF_PERIOD_NSEC);
+    scl_release(gpio, scl);
+    recovery_delay(HALF_PERIOD_NSEC);
+    r->stats.clocks++;
+  }
+
+  // STOP: SDA goes high while SCL is high
+  line_low(gpio, scl);
+  recovery_delay(HALF_PERIOD_NSEC);
+  line_low(gpio, sda);
+  recovery_delay(HALF_PERIOD_NSEC);
+  scl_release(gpio, scl);
+  recovery_delay(HALF_PERIOD_NSEC);
+  line_release(gpio, sda);
+  recovery_delay(HALF_PERIOD_NSEC);
+
+  const int free = lines_free(r);
+
+  // give the pins back to the I2C controller
+  gpio_fsel(gpio, sda, GPIO_FSEL_ALT0);
+  gpio_fsel(gpio, scl, GPIO_FSEL_ALT0);
+
+  return free;
+}
+
+/**
+ * Step 2: switch the devices off and on again.
+ * @return 1 if the lines are free afterwards
+ */
+static int recovery_power(struct I2C_recovery *r) {
+  const struct I2C_recovery_config *cfg = r->cfg;
+  const long long now = recovery_usec();
+
+  // devices that hang right after a power cycle do not get another one
+  if ((cfg->power < 0) ||
+      (r->last_power_usec &&
+       (now - r->last_power_usec < cfg->power_holdoff_ms*1000LL)))
+    return 0;
+  r->last_power_usec = now;
+
+  BLOG(LOG_WARNING, BLOG_I2C_POWER_CYCLE, cfg->power);
+
+  gpio_write(r->gpio, cfg->power, !cfg->power_on_level);
+  gpio_fsel(r->gpio, cfg->power, GPIO_FSEL_OUTPUT);
+  usleep(cfg->power_off_ms * 1000);
+  gpio_write(r->gpio, cfg->power, cfg->power_on_level);
+  usleep(cfg->power_on_ms * 1000);
+
+  return lines_free(r);
+}
+
+int I2C_recovery_init(struct I2C_bus *bus, const struct I2C_recovery_config *cfg) {
+  if (bus->sock || bus->replay || (bus->fd < 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // one lock file per adapter, shared by all processes
+  const char *name = strrchr(bus->path, '/');
+  char lock_path[64];
+  snprintf(lock_path, sizeof(lock_path), I2C_RECOVERY_LOCK,
+           name ? name + 1 : bus->path);
+  const int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+  if (lock_fd < 0)
+    return -1;
+
+  const int fd = open("/dev/gpiomem", O_RDWR | O_SYNC | O_CLOEXEC);
+  if (fd < 0) {
+    const int err = errno;
+    close(lock_fd);
+    errno = err;
+    return -1;
+  }
+
+  void *map = mmap(NULL, GPIO_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  const int err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    close(lock_fd);
+    errno = err;
+    return -1;
+  }
+
+  struct I2C_recovery *r = calloc(1, sizeof(*r));
+  if (!r) {
+    munmap(map, GPIO_MAP_SIZE);
+    close(lock_fd);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  r->cfg = cfg;
+  r->gpio = map;
+  r->lock_fd = lock_fd;
+  I2C_recovery_close(bus);
+  bus->recovery = r;
+  return 0;
+}
+
+void I2C_recovery_close(struct I2C_bus *bus) {
+  struct I2C_recovery *r = bus->recovery;
+  if (!r)
+    return;
+
+  munmap((void *)r->gpio, GPIO_MAP_SIZE);
+  close(r->lock_fd);
+  free(r);
+  bus->recovery = NULL;
+}
+
+/**
+ * Change the lock of the bus, retried on signals.
+ */
+static void recovery_flock(const struct I2C_recovery *r, int op) {
+  while (flock(r->lock_fd, op) && (errno == EINTR))
+    ;
+}
+
+void I2C_recovery_hold(struct I2C_bus *bus) {
+  if (bus->recovery)
+    recovery_flock(bus->recovery, LOCK_SH);
+}
+
+void I2C_recovery_release(struct I2C_bus *bus) {
+  if (bus->recovery)
+    recovery_flock(bus->recovery, LOCK_UN);
+}
+
+int I2C_recover(struct I2C_bus *bus) {
+  struct I2C_recovery *r = bus->recovery;
+  if (!r)
+    return 0;
+
+  // another process may just be recovering the bus, check afterwards
+  recovery_flock(r, LOCK_EX);
+
+  r->stats.checks++;
+  const int sda = gpio_level(r->gpio, r->cfg->sda);
+  const int scl = gpio_level(r->gpio, r->cfg->scl);
+  if (sda && scl) {
+    recovery_flock(r, LOCK_UN);
+    return 0;
+  }
+
+  r->stats.stuck++;
+  BLOG(LOG_WARNING, BLOG_I2C_STUCK, sda, scl);
+
+  const long long start = recovery_usec();
+  const unsigned long clocks = r->stats.clocks;
+  const long long last_power = r->last_power_usec;
+
+  enum I2C_recovery_step step = I2C_RECOVERY_CLOCK;
+  if (!recovery_clock(r)) {
+    step = I2C_RECOVERY_POWER;
+    if (!recovery_power(r))
+      step = I2C_RECOVERY_FAILED;
+  }
+
+  recovery_flock(r, LOCK_UN);
+
+  // the devices have lost their settings, see I2C_shadow_sync
+  if (r->last_power_usec != last_power)
+    bus->resets++;
+
+  const long usec = recovery_usec() - start;
+  metrics_observe(&r->stats.duration, usec);
+  r->stats.result[step]++;
+
+  if (step == I2C_RECOVERY_FAILED) {
+    BLOG(LOG_ERR, BLOG_I2C_STILL_STUCK, usec);
+    return -1;
+  }
+
+  BLOG(LOG_NOTICE, BLOG_I2C_BUS_RECOVERED, step,
+       (int)(r->stats.clocks - clocks), usec);
+  return 1;
+}
+
+void I2C_recovery_stats_log(const struct I2C_bus *bus) {
+  const struct I2C_recovery *r = bus->recovery;
+  if (!r)
+    return;
+
+  const struct I2C_recovery_stats *st = &r->stats;
+  syslog(LOG_INFO, "I2C recovery on %s: %lu checks, %lu stuck, recovered by "
+                   "clocking %lu, power cycle %lu, failed %lu, "
+                   "%lu clocks.",
+                   bus->path, st->checks, st->stuck,
+                   st->result[I2C_RECOVERY_CLOCK],
+                   st->result[I2C_RECOVERY_POWER],
+                   st->result[I2C_RECOVERY_FAILED], st->clocks);
+}
+
+int I2C_recovery_metrics_register(struct I2C_bus *bus) {
+  static const char *steps[I2C_RECOVERY_STEPS] = {
+    [I2C_RECOVERY_CLOCK] = "clock", [I2C_RECOVERY_POWER] = "power",
+    [I2C_RECOVERY_FAILED] = "failed"
+  };
+  struct I2C_recovery *r = bus->recovery;
+  if (!r)
+    return 0;
+
+  struct I2C_recovery_stats *st = &r->stats;
+  int ret = 0;
+
+  ret |= metrics_counter("i2c_bus_checks_total",
+                         "Line checks after failed I2C transfers.",
+                         NULL, &st->checks);
+  ret |= metrics_counter("i2c_bus_stuck_total",
+                         "Line checks that found the I2C bus held low.",
+                         NULL, &st->stuck);
+  ret |= metrics_histogram("i2c_bus_recovery_duration_seconds",
+                           "Duration of an I2C bus recovery.",
+                           NULL, &st->duration);
+
+  int i;
+  for (i = 0; i < I2C_RECOVERY_STEPS; i++) {
+    char labels[METRICS_LABELS_MAX];
+    snprintf(labels, sizeof(labels), "step=\"%s\"", steps[i]);
+    ret |= metrics_counter("i2c_bus_recoveries_total",
+                           "I2C bus recoveries by the step that freed the bus.",
+                           labels, &st->result[i]);
+  }
+
+  return ret;
+}
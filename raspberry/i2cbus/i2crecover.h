@@ -0,0 +1,123 @@
+/**
+ * @file i2crecover.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Recovery of an I2C bus that is held low by a device
+ *
+ * A device that lost a clock edge in the middle of a byte keeps SDA
+ * low until it gets the rest of its clocks, and the adapter cannot
+ * start any transfer. The recovery checks the line levels and, if a
+ * line is held low, goes through these steps until the bus is free:
+ *
+ *   1. clock SCL up to 9 times until the device releases SDA,
+ *      then send a STOP condition
+ *   2. switch the power of the devices off and on again (last resort)
+ *
+ * The I2C controller itself needs no reset: the driver sets it up anew
+ * for every transfer.
+ *
+ * The lines are driven through the GPIO registers in /dev/gpiomem, as
+ * the I2C controller has to get its pin function back afterwards; this
+ * works on the BCM2835 to BCM2711 based Pis. The lines are only pulled
+ * low or released, like an open-drain output.
+ *
+ * Several processes may use the same adapter without i2cd. A recovery
+ * holds an exclusive flock on a lock file of the bus, and the transfers
+ * of a bus with recovery hold a shared one, so no process bit-bangs
+ * the pins while another one transfers or recovers.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+struct I2C_bus;
+
+// lock file of a bus, from the adapter name, e.g. /run/lock/i2c-1.lock
+#define I2C_RECOVERY_LOCK "/run/lock/%s.lock"
+
+/**
+ * Pins and timing of a bus, BCM GPIO numbers.
+ */
+struct I2C_recovery_config {
+  int sda;
+  int scl;
+  int power;                    // switches the device power, or -1
+  int power_on_level;           // level of the power pin when switched on
+  long power_off_ms;            // off time of a power cycle
+  long power_on_ms;             // start-up time of the devices
+  long power_holdoff_ms;        // minimal time between two power cycles
+};
+
+// bus 1 on the pi-hat; the power switch is wiringPi pin 4
+extern const struct I2C_recovery_config I2C_recovery_pihat;
+
+enum I2C_recovery_step {
+  I2C_RECOVERY_CLOCK = 0,       // freed by clocking SCL and a STOP
+  I2C_RECOVERY_POWER,           // freed by a power cycle
+  I2C_RECOVERY_FAILED,          // still held low
+  I2C_RECOVERY_STEPS
+};
+
+struct I2C_recovery_stats {
+  unsigned long checks;         // line checks after failed transfers
+  unsigned long stuck;          // checks that found a line held low
+  unsigned long result[I2C_RECOVERY_STEPS];  // recoveries by final step
+  unsigned long clocks;         // SCL pulses sent in total
+  struct metrics_histogram duration;
+};
+
+struct I2C_recovery {
+  const struct I2C_recovery_config *cfg;
+  volatile uint32_t *gpio;      // mapped GPIO registers
+  int lock_fd;                  // see I2C_RECOVERY_LOCK
+  long long last_power_usec;    // time of the last power cycle
+  struct I2C_recovery_stats stats;
+};
+
+/**
+ * Enable the recovery for an adapter opened with I2C_bus_open.
+ * @return 0 on success, -1 on error (errno is set), e.g. without
+ *         access to /dev/gpiomem or the lock file, or if the bus is no
+ *         adapter
+ */
+int I2C_recovery_init(struct I2C_bus *bus, const struct I2C_recovery_config *cfg);
+
+/**
+ * Disable the recovery, called by I2C_bus_close.
+ */
+void I2C_recovery_close(struct I2C_bus *bus);
+
+/**
+ * Wait until no other process recovers the bus and keep it from
+ * starting, before a transfer. Does nothing without I2C_recovery_init.
+ */
+void I2C_recovery_hold(struct I2C_bus *bus);
+
+/**
+ * Allow recoveries again after a transfer.
+ */
+void I2C_recovery_release(struct I2C_bus *bus);
+
+/**
+ * Check the lines after a failed transfer and recover the bus if a
+ * line is held low. Waits for the transfers and recoveries of other
+ * processes first. Does nothing without I2C_recovery_init. A power cycle
+ * bumps bus->resets.
+ * @return 0 if the bus was not stuck, 1 if it has been recovered,
+ *         -1 if it is still stuck
+ */
+int I2C_recover(struct I2C_bus *bus);
+
+/**
+ * Log the recovery statistics of a bus to syslog.
+ */
+void I2C_recovery_stats_log(const struct I2C_bus *bus);
+
+/**
+ * Register the recovery statistics of a bus with the metrics registry.
+ * @return 0 on success, -1 if the registry is full
+ */
+int I2C_recovery_metrics_register(struct I2C_bus *bus);
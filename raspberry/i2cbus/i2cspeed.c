@@ -0,0 +1,229 @@
+/**
+ * @file i2cspeed.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Calibration and supervision of the I2C bus speed
+ */
+
+#include "i2cspeed.h"
+#include "i2cbus.h"
+#include "blog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <sys/mman.h>
+
+const struct I2C_speed_config I2C_speed_default = {
+  .samples = 200,
+  .max_error_rate = 0.005,
+  .window = 500,
+  .fallback_rate = 0.02
+};
+
+static const long speed_hz[I2C_SPEED_COUNT] = { I2C_SPEED_LEVELS };
+
+// BSC registers, as 32 bit word offsets
+#define BSC_DIV (0x14/4)
+#define BSC_DEL (0x18/4)
+
+#define BSC_MAP_SIZE 4096
+
+// speed of the adapters if the device tree does not tell
+#define SPEED_DEFAULT_HZ 100000
+
+/**
+ * Read a big-endian cell from the device tree.
+ * @return the value, or def if the file cannot be read
+ */
+static long dt_cell(const char *path, int offset, long def) {
+  uint8_t b[4];
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return def;
+
+  const ssize_t n = pread(fd, b, sizeof(b), offset);
+  close(fd);
+  if (n != sizeof(b))
+    return def;
+
+  return ((long)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/**
+ * @return the physical address of the peripherals
+ */
+static long peripheral_base() {
+  // the BCM2711 has two address cells for the parent bus
+  const long base = dt_cell("/proc/device-tree/soc/ranges", 4, 0x20000000);
+  return base ? base : dt_cell("/proc/device-tree/soc/ranges", 8, 0xfe000000);
+}
+
+int I2C_speed_open(struct I2C_speed *s, int adapter,
+                   const struct I2C_speed_config *cfg) {
+  static const long bsc_offset[] = { 0x205000, 0x804000 };
+
+  if ((adapter < 0) || (adapter > 1)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  const int fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  void *map = mmap(NULL, BSC_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   peripheral_base() + bsc_offset[adapter]);
+  const int err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = err;
+    return -1;
+  }
+
+  s->cfg = cfg;
+  s->bsc = map;
+  s->transfers = 0;
+  s->errors = 0;
+  s->fallbacks = 0;
+
+  // the divider was set by the driver for the configured speed
+  char path[80];
+  snprintf(path, sizeof(path),
+           "/sys/class/i2c-adapter/i2c-%d/of_node/clock-frequency", adapter);
+  const long hz = dt_cell(path, 0, SPEED_DEFAULT_HZ);
+  const uint32_t div = s->bsc[BSC_DIV] & 0xffff;
+  s->core_hz = (div ? div : 0x10000) * hz;
+
+  // the nearest level
+  s->level = 0;
+  int i;
+  for (i = 1; i < I2C_SPEED_COUNT; i++)
+    if (labs(speed_hz[i] - hz) < labs(speed_hz[s->level] - hz))
+      s->level = i;
+
+  return 0;
+}
+
+void I2C_speed_close(struct I2C_speed *s) {
+  if (s->bsc)
+    munmap((void *)s->bsc, BSC_MAP_SIZE);
+  s->bsc = NULL;
+}
+
+long I2C_speed_get(const struct I2C_speed *s) {
+  return speed_hz[s->level];
+}
+
+int I2C_speed_set(struct I2C_speed *s, int level) {
+  if ((level < 0) || (level >= I2C_SPEED_COUNT))
+    return -1;
+
+  // the divider is even and rounded up, so the speed is never exceeded
+  uint32_t div = (s->core_hz + speed_hz[level] - 1) / speed_hz[level];
+  div = (div + 1) & ~1u;
+
+  // sample and drive SDA away from the SCL edges, as the driver does
+  const uint32_t fedl = (div / 16) ? div / 16 : 1;
+  const uint32_t redl = (div / 4) ? div / 4 : 1;
+
+  s->bsc[BSC_DIV] = div;
+  s->bsc[BSC_DEL] = (fedl << 16) | redl;
+  s->level = level;
+  s->transfers = 0;
+  s->errors = 0;
+
+  BLOG(LOG_INFO, BLOG_I2C_SPEED, (int)(speed_hz[level] / 1000), (int)div);
+  return 0;
+}
+
+/**
+ * Run the status command of a device at the current speed.
+ * @return 1 if the device answered reliably
+ */
+static int speed_probe(const struct I2C_speed *s,
+                       const struct I2C_speed_probe *p) {
+  struct I2C_stats *st = &p->dev->stats;
+  const unsigned long transactions = st->transactions;
+  const unsigned long failures = st->failures;
+  const unsigned long retries = st->retries;
+  const unsigned long giveups = st->giveups;
+  const unsigned long streak = st->giveup_streak;
+
+  int i;
+  for (i = 0; i < s->cfg->samples; i++)
+    I2C_command(p->dev, (p->send >> 4) & 0x7, p->send & 0xf);
+
+  // the calibration must not degrade the device
+  st->giveup_streak = streak;
+
+  const unsigned long n = st->transactions - transactions;
+  const unsigned long failed = st->failures - failures;
+  syslog(LOG_INFO, "I2C speed %ld kHz, device 0x%02x: %lu transfers, "
+                   "%lu failed, %lu retries, %lu give-ups.",
+                   I2C_speed_get(s) / 1000, p->dev->addr, n, failed,
+                   st->retries - retries, st->giveups - giveups);
+
+  return n && (st->giveups == giveups) &&
+         (failed <= s->cfg->max_error_rate * n);
+}
+
+long I2C_speed_calibrate(struct I2C_speed *s,
+                         const struct I2C_speed_probe *probes, int n) {
+  const int previous = s->level;
+  int best = -1;
+
+  // from slow to fast, up to the first speed that is not reliable
+  int level;
+  for (level = 0; level < I2C_SPEED_COUNT; level++) {
+    I2C_speed_set(s, level);
+
+    int i;
+    for (i = 0; i < n; i++)
+      if (!speed_probe(s, &probes[i]))
+        break;
+    if (i < n)
+      break;
+
+    best = level;
+  }
+
+  if (best < 0) {
+    syslog(LOG_WARNING, "No reliable I2C speed found, keeping %ld kHz.",
+                        speed_hz[previous] / 1000);
+    I2C_speed_set(s, previous);
+    return -1;
+  }
+
+  I2C_speed_set(s, best);
+  syslog(LOG_NOTICE, "I2C speed calibrated to %ld kHz.", speed_hz[best] / 1000);
+  return speed_hz[best];
+}
+
+void I2C_speed_observe(struct I2C_speed *s, int failed) {
+  s->transfers++;
+  if (failed)
+    s->errors++;
+
+  if (s->transfers < s->cfg->window)
+    return;
+
+  if ((s->errors > s->cfg->fallback_rate * s->transfers) && s->level) {
+    BLOG(LOG_WARNING, BLOG_I2C_SPEED_FALLBACK, (int)s->errors,
+         (int)s->transfers, (int)(speed_hz[s->level-1] / 1000));
+    s->fallbacks++;
+    I2C_speed_set(s, s->level - 1);
+  }
+
+  s->transfers = 0;
+  s->errors = 0;
+}
+
+void I2C_speed_stats_log(const struct I2C_speed *s, const char *name) {
+  syslog(LOG_INFO, "I2C speed on %s: %ld kHz, %lu fallbacks.",
+                   name, I2C_speed_get(s) / 1000, s->fallbacks);
+}
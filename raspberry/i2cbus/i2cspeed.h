@@ -0,0 +1,112 @@
+/**
+ * @file i2cspeed.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Calibration and supervision of the I2C bus speed
+ *
+ * The adapters run at the clock from the device tree, usually 100 kHz.
+ * The USI slaves stretch the clock in software, so whether they keep up
+ * at a higher speed depends on the firmware and the wiring. The
+ * calibration tries the speeds of I2C_SPEED_LEVELS from the slowest to
+ * the fastest with a harmless status command per device, and keeps the
+ * fastest speed that every device answered reliably at.
+ *
+ * In operation, the error rate of all transfers is checked over a window
+ * of transfers; a window with too many errors lowers the speed by one
+ * step.
+ *
+ * The speed is set through the clock divider of the BSC controller in
+ * /dev/mem (BCM2835 to BCM2711). The divider is only set by the kernel
+ * when the driver is probed, so the setting is kept while the adapter
+ * is in use. Only the thread that does the transfers may change it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct I2C_device;
+
+// bus speeds that are tried, in Hz
+#define I2C_SPEED_LEVELS 50000, 100000, 200000, 300000, 400000
+#define I2C_SPEED_COUNT  5
+
+struct I2C_speed_config {
+  int samples;                  // status commands per device and speed
+  double max_error_rate;        // failed transfers per transfer still reliable
+  unsigned long window;         // transfers per error rate check in operation
+  double fallback_rate;         // error rate in a window that lowers the speed
+};
+
+extern const struct I2C_speed_config I2C_speed_default;
+
+/**
+ * A status command used for the calibration: the raw command byte as
+ * given to i2cctl, with a one byte reply.
+ */
+struct I2C_speed_probe {
+  struct I2C_device *dev;
+  uint8_t send;
+};
+
+struct I2C_speed {
+  const struct I2C_speed_config *cfg;
+  volatile uint32_t *bsc;       // mapped controller registers
+  long core_hz;                 // input clock of the divider
+  int level;                    // current speed, index into I2C_SPEED_LEVELS
+  unsigned long transfers;      // transfers in the current window
+  unsigned long errors;         // errors in the current window
+  unsigned long fallbacks;      // speed steps down in operation
+};
+
+/**
+ * Get access to the clock divider of an adapter. Does not change the
+ * speed.
+ * @param s        the speed record to initialize
+ * @param adapter  N of /dev/i2c-N; 0 and 1 are the BSC controllers
+ * @param cfg      the calibration and supervision parameters
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I2C_speed_open(struct I2C_speed *s, int adapter,
+                   const struct I2C_speed_config *cfg);
+
+/**
+ * Release the registers. The speed stays as it is.
+ */
+void I2C_speed_close(struct I2C_speed *s);
+
+/**
+ * @return the current bus speed in Hz
+ */
+long I2C_speed_get(const struct I2C_speed *s);
+
+/**
+ * Set the bus speed.
+ * @param level  index into I2C_SPEED_LEVELS
+ * @return 0 on success, -1 if the level is out of range
+ */
+int I2C_speed_set(struct I2C_speed *s, int level);
+
+/**
+ * Sweep all speeds with the status commands of the devices and set the
+ * fastest reliable one. The results are logged per device and speed.
+ * The devices must not be used by anybody else meanwhile.
+ * @param probes  a status command per device
+ * @param n       number of probes
+ * @return the chosen speed in Hz, or -1 if no speed was reliable; the
+ *         previous speed is kept then
+ */
+long I2C_speed_calibrate(struct I2C_speed *s,
+                         const struct I2C_speed_probe *probes, int n);
+
+/**
+ * Count a transfer for the supervision. Lowers the speed by one step if
+ * the error rate of the window is too high.
+ * @param failed  non-zero if the transfer failed or did not validate
+ */
+void I2C_speed_observe(struct I2C_speed *s, int failed);
+
+/**
+ * Log the current speed and the fallbacks to syslog.
+ */
+void I2C_speed_stats_log(const struct I2C_speed *s, const char *name);
@@ -0,0 +1,256 @@
+/**
+ * @file i2ctrace.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Record I2C transactions to a trace file and replay them
+ */
+
+#include "i2ctrace.h"
+#include "i2cbus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// records of an address searched for a matching command byte
+#define I2C_REPLAY_LOOKAHEAD 8
+#define I2C_REPLAY_ADDRS     128
+
+struct I2C_replay {
+  const uint8_t *map;
+  size_t size;
+  size_t cursor[I2C_REPLAY_ADDRS];  // offset of the next record per address
+  uint64_t t0_trace;            // time stamp of the first record
+  long long t0_real;            // monotonic usec at the start of the replay
+  double speed;
+  unsigned long replayed;
+  unsigned long diverged;
+  int finished;
+};
+
+static long long trace_clock(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+///// Recorder /////
+
+int I2C_trace_start(struct I2C_bus *bus, const char *path) {
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                      0640);
+  if (fd < 0)
+    return -1;
+
+  const struct I2C_trace_header hdr = {
+    .magic = I2C_TRACE_MAGIC,
+    .version = I2C_TRACE_VERSION,
+    .start_realtime_usec = trace_clock(CLOCK_REALTIME)
+  };
+  if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  I2C_trace_stop(bus);
+  bus->trace_fd = fd;
+  return 0;
+}
+
+void I2C_trace_stop(struct I2C_bus *bus) {
+  if (bus->trace_fd >= 0)
+    close(bus->trace_fd);
+  bus->trace_fd = -1;
+}
+
+void I2C_trace_write(struct I2C_bus *bus, uint8_t addr, uint8_t cmd,
+                     const uint8_t *reply, size_t len, int result) {
+  if (bus->trace_fd < 0)
+    return;
+
+  // a failed transfer has no reply worth keeping
+  if (result)
+    len = 0;
+
+  struct I2C_trace_record rec = {
+    .usec = trace_clock(CLOCK_MONOTONIC),
+    .addr = addr, .cmd = cmd, .len = len, .result = result
+  };
+  struct iovec iov[2] = {
+    { .iov_base = &rec, .iov_len = sizeof(rec) },
+    { .iov_base = (void *)reply, .iov_len = len }
+  };
+
+  // one write per record, so records are never torn apart
+  if (writev(bus->trace_fd, iov, 2) < 0) {
+    syslog(LOG_WARNING, "Error %d on writing the I2C trace, trace stopped.",
+                        errno);
+    I2C_trace_stop(bus);
+  }
+}
+
+///// Replay /////
+
+/**
+ * Copy the record at an offset. Records are not aligned, because the
+ * replies have different lengths.
+ * @return 1 on success, 0 at the end of the trace
+ */
+static int replay_record(const struct I2C_replay *r, size_t off,
+                         struct I2C_trace_record *rec) {
+  if (off + sizeof(*rec) > r->size)
+    return 0;
+
+  memcpy(rec, r->map + off, sizeof(*rec));
+  return (off + sizeof(*rec) + rec->len <= r->size);
+}
+
+/**
+ * Find the next record of an address, starting at an offset.
+ * @return the offset of the record, or r->size if there is none
+ */
+static size_t replay_next(const struct I2C_replay *r, size_t off, uint8_t addr) {
+  struct I2C_trace_record rec;
+
+  while (replay_record(r, off, &rec)) {
+    if (rec.addr == addr)
+      return off;
+    off += sizeof(rec) + rec.len;
+  }
+
+  return r->size;
+}
+
+int I2C_replay_open(struct I2C_bus *bus, const char *path, double speed) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(struct I2C_trace_header))) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  const void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const struct I2C_trace_header *hdr = map;
+  struct I2C_replay *r = calloc(1, sizeof(*r));
+  if (!r || (hdr->magic != I2C_TRACE_MAGIC) ||
+      (hdr->version != I2C_TRACE_VERSION)) {
+    const int err = r ? EINVAL : ENOMEM;
+    free(r);
+    munmap((void *)map, st.st_size);
+    errno = err;
+    return -1;
+  }
+
+  r->map = map;
+  r->size = st.st_size;
+  r->speed = speed;
+  r->t0_real = trace_clock(CLOCK_MONOTONIC);
+
+  struct I2C_trace_record first;
+  r->t0_trace = replay_record(r, sizeof(*hdr), &first) ? first.usec : 0;
+
+  int i;
+  for (i = 0; i < I2C_REPLAY_ADDRS; i++)
+    r->cursor[i] = replay_next(r, sizeof(*hdr), i);
+
+  bus->path = path;
+  bus->sock = 0;
+  bus->fd = -1;
+  bus->trace_fd = -1;
+  bus->replay = r;
+  bus->recovery = NULL;
+  bus->resets = 0;
+  return 0;
+}
+
+int I2C_replay_transfer(struct I2C_bus *bus, uint8_t addr, uint8_t cmd,
+                        uint8_t *reply, size_t len) {
+  struct I2C_replay *r = bus->replay;
+
+  if (addr >= I2C_REPLAY_ADDRS)
+    return -EINVAL;
+
+  // look for the command among the next records of the address
+  size_t off = r->cursor[addr];
+  struct I2C_trace_record rec;
+  int valid = 0;
+  int skipped;
+  for (skipped = 0; skipped < I2C_REPLAY_LOOKAHEAD; skipped++) {
+    valid = replay_record(r, off, &rec);
+    if (!valid || (rec.cmd == cmd))
+      break;
+    off = replay_next(r, off + sizeof(rec) + rec.len, addr);
+  }
+
+  if (!valid) {
+    if (!r->finished)
+      syslog(LOG_NOTICE, "I2C trace replay finished after %lu transfers "
+                         "(%lu diverged).", r->replayed, r->diverged);
+    r->finished = 1;
+    return -ENODATA;
+  }
+
+  if (rec.cmd != cmd) {
+    // the program does something the recorded one did not
+    r->diverged++;
+    return -EPROTO;
+  }
+  r->diverged += skipped;
+  r->cursor[addr] = replay_next(r, off + sizeof(rec) + rec.len, addr);
+  r->replayed++;
+
+  // wait until the transfer is due at the requested speed
+  if (r->speed > 0) {
+    const long long due = r->t0_real + (rec.usec - r->t0_trace) / r->speed;
+    const long long now = trace_clock(CLOCK_MONOTONIC);
+    if (due > now) {
+      const struct timespec ts = {
+        (due - now) / 1000000LL, ((due - now) % 1000000LL) * 1000L
+      };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  if (rec.result)
+    return rec.result;
+  if (rec.len != len)
+    return -EPROTO;
+
+  memcpy(reply, r->map + off + sizeof(rec), len);
+  return 0;
+}
+
+int I2C_replay_finished(const struct I2C_bus *bus) {
+  return bus->replay && bus->replay->finished;
+}
+
+void I2C_replay_close(struct I2C_bus *bus) {
+  struct I2C_replay *r = bus->replay;
+  if (!r)
+    return;
+
+  syslog(LOG_INFO, "I2C trace replay: %lu transfers, %lu diverged.",
+                   r->replayed, r->diverged);
+  munmap((void *)r->map, r->size);
+  free(r);
+  bus->replay = NULL;
+}
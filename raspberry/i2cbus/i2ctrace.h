@@ -0,0 +1,95 @@
+/**
+ * @file i2ctrace.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Record I2C transactions to a trace file and replay them
+ *
+ * The recorder appends every transfer of a bus to a binary trace file:
+ * monotonic time, address, command byte, result and the raw reply
+ * (including the inverted bytes). One write per transfer, so a trace is
+ * complete up to the last transfer even if the daemon crashes.
+ *
+ * The replay backend answers the transfers of a bus from such a trace
+ * instead of the hardware. Each address has its own cursor, so a trace
+ * recorded at i2cd with all devices can be replayed for a single
+ * daemon. Transfers are paced by the recorded time stamps, scaled by a
+ * speed factor, or run as fast as possible.
+ *
+ * File layout: a struct I2C_trace_header, then records, each a struct
+ * I2C_trace_record followed by len reply bytes. Host byte order.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define I2C_TRACE_MAGIC   0x54433249  // "I2CT"
+#define I2C_TRACE_VERSION 1
+
+struct I2C_trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  int64_t start_realtime_usec;  // wall clock at the start of recording
+};
+
+struct I2C_trace_record {
+  uint64_t usec;                // CLOCK_MONOTONIC at the end of the transfer
+  uint8_t addr;
+  uint8_t cmd;
+  uint8_t len;                  // number of reply bytes that follow
+  uint8_t reserved;
+  int32_t result;               // 0 or -errno
+};
+
+struct I2C_bus;
+
+/**
+ * Start recording all transfers of a bus. An existing file is
+ * replaced.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I2C_trace_start(struct I2C_bus *bus, const char *path);
+
+/**
+ * Stop recording.
+ */
+void I2C_trace_stop(struct I2C_bus *bus);
+
+/**
+ * Append a transfer to the trace of a bus, if it is recording.
+ */
+void I2C_trace_write(struct I2C_bus *bus, uint8_t addr, uint8_t cmd,
+                     const uint8_t *reply, size_t len, int result);
+
+/**
+ * Replay a trace file instead of opening an adapter. The bus must be
+ * closed with I2C_bus_close as usual.
+ * @param bus    the bus record to initialize
+ * @param path   the trace file
+ * @param speed  time scale: 1 for the recorded timing, 10 for ten times
+ *               as fast, 0 for no delays at all
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I2C_replay_open(struct I2C_bus *bus, const char *path, double speed);
+
+/**
+ * Answer a transfer from the trace: the next record for the address
+ * with the same command byte. Records with other command bytes for the
+ * same address are skipped and counted as divergence.
+ * @return the recorded result, -ENODATA at the end of the trace, or
+ *         -EPROTO if the reply length does not match
+ */
+int I2C_replay_transfer(struct I2C_bus *bus, uint8_t addr, uint8_t cmd,
+                        uint8_t *reply, size_t len);
+
+/**
+ * @return non-zero if a transfer has run into the end of the trace
+ */
+int I2C_replay_finished(const struct I2C_bus *bus);
+
+/**
+ * Log the replay statistics and release the trace.
+ */
+void I2C_replay_close(struct I2C_bus *bus);
@@ -0,0 +1,171 @@
+/**
+ * @file i3cint.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Wait for the I³C interrupt line
+ */
+
+#include "i3cint.h"
+#include "i2cproto.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/gpio.h>
+
+int I3C_int_open(struct I3C_int *irq, const char *chip, const unsigned int line) {
+  irq->fd = -1;
+  irq->line = line;
+  irq->sock = 0;
+  irq->active = 0;
+  irq->event_ns = 0;
+
+  const int cfd = open(chip, O_RDONLY | O_CLOEXEC);
+  if (cfd < 0)
+    return -1;
+
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = line;
+  req.num_lines = 1;
+  strncpy(req.consumer, "i3c-int", sizeof(req.consumer) - 1);
+  // the devices pull the line low to signal a state change; the rising
+  // edges tell when the last one has been served
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING |
+                     GPIO_V2_LINE_FLAG_EDGE_RISING;
+
+  const int ret = ioctl(cfd, GPIO_V2_GET_LINE_IOCTL, &req);
+  const int err = errno;
+  close(cfd);
+
+  if (ret < 0) {
+    errno = err;
+    return -1;
+  }
+
+  irq->fd = req.fd;
+  irq->active = I3C_int_active(irq);
+  return 0;
+}
+
+int I3C_int_connect(struct I3C_int *irq, const char *path) {
+  irq->fd = -1;
+  irq->line = 0;
+  irq->sock = 1;
+  irq->active = 0;
+  irq->event_ns = 0;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  // i2cd sends the current level right away
+  irq->fd = fd;
+  return 0;
+}
+
+/**
+ * Consume the edges relayed by i2cd.
+ */
+static int I3C_int_receive(struct I3C_int *irq) {
+  int ret = 0;
+  struct i2cd_int_event ev;
+
+  for (;;) {
+    const ssize_t n = recv(irq->fd, &ev, sizeof(ev), 0);
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return ret;
+    if (n == 0)
+      errno = EPIPE;
+    if (n != (ssize_t)sizeof(ev))
+      return -1;
+
+    if (ev.event_ns && !ret) {
+      irq->event_ns = ev.event_ns;
+      ret = 1;
+    }
+    irq->active = ev.active;
+  }
+}
+
+void I3C_int_close(struct I3C_int *irq) {
+  if (irq->fd >= 0)
+    close(irq->fd);
+  irq->fd = -1;
+}
+
+int I3C_int_wait(struct I3C_int *irq, const int timeout_ms) {
+  // without an INT line this is the good old polling sleep
+  if (irq->fd < 0)
+    return (poll(NULL, 0, timeout_ms) < 0) ? -1 : 0;
+
+  struct pollfd pfd = { .fd = irq->fd, .events = POLLIN };
+  const int ret = poll(&pfd, 1, timeout_ms);
+  if (ret <= 0)
+    return ret;
+
+  return (I3C_int_ack(irq) < 0) ? -1 : 1;
+}
+
+int I3C_int_ack(struct I3C_int *irq) {
+  if (irq->fd < 0)
+    return 0;
+  if (irq->sock)
+    return I3C_int_receive(irq);
+
+  struct pollfd pfd = { .fd = irq->fd, .events = POLLIN };
+  if (poll(&pfd, 1, 0) <= 0)
+    return 0;
+
+  // consume the pending edge events
+  struct gpio_v2_line_event ev[16];
+  const ssize_t n = read(irq->fd, ev, sizeof(ev));
+  if (n < (ssize_t)sizeof(ev[0]))
+    return -1;
+
+  int ret = 0;
+  int i;
+  for (i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+    const int falling = (ev[i].id == GPIO_V2_LINE_EVENT_FALLING_EDGE);
+    // the edge time stamps are taken on CLOCK_MONOTONIC in the kernel
+    if (falling && !ret) {
+      irq->event_ns = ev[i].timestamp_ns;
+      ret = 1;
+    }
+    irq->active = falling;
+  }
+
+  return ret;
+}
+
+int I3C_int_active(struct I3C_int *irq) {
+  if (irq->fd < 0)
+    return 0;
+  if (irq->sock)
+    return irq->active;
+
+  struct gpio_v2_line_values vals = { .bits = 0, .mask = 1 };
+  if (ioctl(irq->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) < 0)
+    return 0;
+
+  // the line is active low
+  return (vals.bits & 1) ? 0 : 1;
+}
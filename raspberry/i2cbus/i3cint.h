@@ -0,0 +1,82 @@
+/**
+ * @file i3cint.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Wait for the I³C interrupt line
+ *
+ * The I³C devices pull the shared INT line low when their state has
+ * changed. The line is requested through the GPIO character device
+ * with edge detection, so a daemon can sleep until a device signals a
+ * change instead of polling the bus.
+ *
+ * A line can be requested only once. When i2cd is running, it owns the
+ * line and relays the edges to its clients, see I3C_int_connect.
+ */
+
+#pragma once
+
+/**
+ * A requested INT line.
+ * If the request failed, fd is -1 and waiting falls back to a plain
+ * sleep for the timeout.
+ */
+struct I3C_int {
+  int fd;
+  unsigned int line;
+  int sock;                     // relayed by i2cd, see I3C_int_connect
+  int active;                   // level after the last ack, 1 if held low
+  unsigned long long event_ns;  // first edge of the last ack, CLOCK_MONOTONIC
+};
+
+/**
+ * Request the INT line for edge events.
+ *
+ * @param irq  The record to initialize.
+ * @param chip Path of the GPIO chip, e.g. "/dev/gpiochip0"
+ * @param line Line offset on the chip, i.e. the BCM GPIO number
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I3C_int_open(struct I3C_int *irq, const char *chip, const unsigned int line);
+
+/**
+ * Receive the INT edges from i2cd instead of requesting the line. The
+ * record is then used like an opened line.
+ *
+ * @param irq  The record to initialize.
+ * @param path Path of the relay socket, i.e. I2CD_INT_SOCKET
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int I3C_int_connect(struct I3C_int *irq, const char *path);
+
+/**
+ * Release the INT line.
+ */
+void I3C_int_close(struct I3C_int *irq);
+
+/**
+ * Wait until the INT line is pulled low or the timeout expires.
+ * Pending edge events are consumed.
+ *
+ * @param irq        The INT line.
+ * @param timeout_ms Maximal time to wait in milliseconds.
+ * @return 1 on an INT event, 0 on timeout or a release of the line, -1 on
+ *         error (errno is set, EINTR if a signal arrived)
+ */
+int I3C_int_wait(struct I3C_int *irq, const int timeout_ms);
+
+/**
+ * Consume the pending edge events, e.g. after an event loop reported
+ * the descriptor as readable. The kernel time stamp of the first falling
+ * edge is kept in event_ns.
+ *
+ * @return 1 if the line has been pulled low, 0 if not, -1 on error, e.g.
+ *         EPIPE if i2cd has gone away
+ */
+int I3C_int_ack(struct I3C_int *irq);
+
+/**
+ * Tell if the INT line is currently asserted (low).
+ *
+ * @return 1 if asserted, 0 if released or unknown
+ */
+int I3C_int_active(struct I3C_int *irq);
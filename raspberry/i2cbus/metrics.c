@@ -0,0 +1,315 @@
+/**
+ * @file metrics.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Metrics registry with a Prometheus text endpoint
+ */
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+enum metrics_type {
+  METRICS_COUNTER,
+  METRICS_COUNTER_ATOMIC,
+  METRICS_HISTOGRAM
+};
+
+struct metrics_entry {
+  enum metrics_type type;
+  const char *name;
+  const char *help;
+  char labels[METRICS_LABELS_MAX];
+  union {
+    const unsigned long *counter;
+    const atomic_ulong *atomic;
+    struct metrics_histogram *histogram;
+  } value;
+};
+
+static struct metrics_entry metrics[METRICS_MAX];
+static int metrics_count = 0;
+
+static const long metrics_bounds[METRICS_BUCKETS] = { METRICS_LATENCY_BUCKETS };
+
+void metrics_observe(struct metrics_histogram *h, long usec) {
+  int i = 0;
+  while ((i < METRICS_BUCKETS) && (usec > metrics_bounds[i]))
+    i++;
+
+  atomic_fetch_add_explicit(&h->bucket[i], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_usec, usec, memory_order_relaxed);
+}
+
+static struct metrics_entry *metrics_add(enum metrics_type type,
+                                         const char *name, const char *help,
+                                         const char *labels) {
+  if (metrics_count >= METRICS_MAX)
+    return NULL;
+
+  struct metrics_entry *e = &metrics[metrics_count++];
+  e->type = type;
+  e->name = name;
+  e->help = help;
+  strncpy(e->labels, labels ? labels : "", METRICS_LABELS_MAX-1);
+  e->labels[METRICS_LABELS_MAX-1] = 0;
+
+  return e;
+}
+
+int metrics_counter(const char *name, const char *help, const char *labels,
+                    const unsigned long *value) {
+  struct metrics_entry *e = metrics_add(METRICS_COUNTER, name, help, labels);
+  if (!e)
+    return -1;
+
+  e->value.counter = value;
+  return 0;
+}
+
+int metrics_counter_atomic(const char *name, const char *help,
+                           const char *labels, const atomic_ulong *value) {
+  struct metrics_entry *e = metrics_add(METRICS_COUNTER_ATOMIC, name, help,
+                                        labels);
+  if (!e)
+    return -1;
+
+  e->value.atomic = value;
+  return 0;
+}
+
+int metrics_histogram(const char *name, const char *help, const char *labels,
+                      struct metrics_histogram *h) {
+  struct metrics_entry *e = metrics_add(METRICS_HISTOGRAM, name, help, labels);
+  if (!e)
+    return -1;
+
+  e->value.histogram = h;
+  return 0;
+}
+
+/**
+ * Write the samples of one entry.
+ */
+static void metrics_write_entry(FILE *out, const struct metrics_entry *e) {
+  const char *sep = e->labels[0] ? "," : "";
+  char lb[METRICS_LABELS_MAX+2] = "";
+
+  // no braces without labels
+  if (e->labels[0])
+    snprintf(lb, sizeof(lb), "{%s}", e->labels);
+
+  switch (e->type) {
+    case METRICS_COUNTER:
+      fprintf(out, "%s%s %lu\n", e->name, lb, *e->value.counter);
+      break;
+    case METRICS_COUNTER_ATOMIC:
+      fprintf(out, "%s%s %lu\n", e->name, lb, atomic_load(e->value.atomic));
+      break;
+    case METRICS_HISTOGRAM: {
+      struct metrics_histogram *h = e->value.histogram;
+      unsigned long cumulative = 0;
+      int i;
+
+      for (i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += atomic_load(&h->bucket[i]);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", e->name,
+                     e->labels, sep, metrics_bounds[i] / 1e6, cumulative);
+      }
+      cumulative += atomic_load(&h->bucket[METRICS_BUCKETS]);
+      fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", e->name,
+                   e->labels, sep, cumulative);
+      fprintf(out, "%s_sum%s %g\n", e->name, lb,
+                   atomic_load(&h->sum_usec) / 1e6);
+      // the count is the +Inf bucket by definition
+      fprintf(out, "%s_count%s %lu\n", e->name, lb, cumulative);
+      break;
+    }
+  }
+}
+
+void metrics_write(FILE *out) {
+  int i, j;
+
+  for (i = 0; i < metrics_count; i++) {
+    // each name once, with all its label sets
+    for (j = 0; j < i; j++)
+      if (!strcmp(metrics[j].name, metrics[i].name))
+        break;
+    if (j < i)
+      continue;
+
+    fprintf(out, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+    fprintf(out, "# TYPE %s %s\n", metrics[i].name,
+                 (metrics[i].type == METRICS_HISTOGRAM) ? "histogram" : "counter");
+    for (j = i; j < metrics_count; j++)
+      if (!strcmp(metrics[j].name, metrics[i].name))
+        metrics_write_entry(out, &metrics[j]);
+  }
+}
+
+///// HTTP endpoint /////
+
+#define METRICS_CLIENTS     4
+#define METRICS_REQUEST_MAX 1024
+
+struct metrics_client {
+  struct evloop_handler h;
+  size_t len;
+  char request[METRICS_REQUEST_MAX];
+};
+
+static struct evloop *metrics_loop;
+static struct evloop_handler metrics_listen = { .fd = -1 };
+static struct metrics_client metrics_clients[METRICS_CLIENTS];
+
+static void metrics_client_close(struct metrics_client *c) {
+  evloop_del(metrics_loop, &c->h);
+  close(c->h.fd);
+  c->h.fd = -1;
+}
+
+/**
+ * Answer a complete request and close the connection.
+ */
+static void metrics_respond(struct metrics_client *c) {
+  char *body = NULL;
+  size_t len = 0;
+  const char *status = "200 OK";
+
+  FILE *out = open_memstream(&body, &len);
+  if (!out) {
+    metrics_client_close(c);
+    return;
+  }
+
+  if (!strncmp(c->request, "GET /metrics ", 13) ||
+      !strncmp(c->request, "GET / ", 6))
+    metrics_write(out);
+  else {
+    status = "404 Not Found";
+    fprintf(out, "Not found\n");
+  }
+  fclose(out);
+
+  char header[160];
+  const int hlen = snprintf(header, sizeof(header),
+                            "HTTP/1.0 %s\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", status, len);
+
+  // the socket buffer takes the whole response; a scraper that does not
+  // read is not waited for
+  if ((send(c->h.fd, header, hlen, MSG_NOSIGNAL | MSG_DONTWAIT) != hlen) ||
+      (send(c->h.fd, body, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len))
+    syslog(LOG_DEBUG, "Metrics response incomplete.");
+
+  free(body);
+  metrics_client_close(c);
+}
+
+static void metrics_on_client(struct evloop_handler *h, uint32_t events) {
+  struct metrics_client *c = h->ctx;
+
+  const ssize_t n = recv(h->fd, c->request + c->len,
+                         METRICS_REQUEST_MAX - 1 - c->len, MSG_DONTWAIT);
+  if (n <= 0) {
+    if ((n < 0) && (errno == EAGAIN))
+      return;
+    metrics_client_close(c);
+    return;
+  }
+  c->len += n;
+  c->request[c->len] = 0;
+
+  // only the request line matters, but wait for the complete header
+  if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n"))
+    metrics_respond(c);
+  else if (c->len >= METRICS_REQUEST_MAX - 1)
+    metrics_client_close(c);
+}
+
+static void metrics_on_accept(struct evloop_handler *h, uint32_t events) {
+  const int fd = accept4(h->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  int i;
+  for (i = 0; i < METRICS_CLIENTS; i++)
+    if (metrics_clients[i].h.fd < 0)
+      break;
+
+  if (i == METRICS_CLIENTS) {
+    close(fd);
+    return;
+  }
+
+  struct metrics_client *c = &metrics_clients[i];
+  c->h.fd = fd;
+  c->h.cb = metrics_on_client;
+  c->h.ctx = c;
+  c->len = 0;
+  if (evloop_add(metrics_loop, &c->h, EPOLLIN)) {
+    close(fd);
+    c->h.fd = -1;
+  }
+}
+
+int metrics_http_init(struct evloop *loop, int port) {
+  int i;
+  for (i = 0; i < METRICS_CLIENTS; i++)
+    metrics_clients[i].h.fd = -1;
+  metrics_loop = loop;
+
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  const int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  metrics_listen.fd = fd;
+  metrics_listen.cb = metrics_on_accept;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, METRICS_CLIENTS) ||
+      evloop_add(loop, &metrics_listen, EPOLLIN)) {
+    const int err = errno;
+    close(fd);
+    metrics_listen.fd = -1;
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+void metrics_http_close() {
+  int i;
+  for (i = 0; i < METRICS_CLIENTS; i++)
+    if (metrics_clients[i].h.fd >= 0)
+      metrics_client_close(&metrics_clients[i]);
+
+  if (metrics_listen.fd >= 0) {
+    evloop_del(metrics_loop, &metrics_listen);
+    close(metrics_listen.fd);
+  }
+  metrics_listen.fd = -1;
+}
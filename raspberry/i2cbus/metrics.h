@@ -0,0 +1,91 @@
+/**
+ * @file metrics.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Metrics registry with a Prometheus text endpoint
+ *
+ * Counters and latency histograms live where they are updated, e.g. in
+ * the I2C device statistics; the registry only keeps pointers to them
+ * together with name, help text and labels. On a scrape, all registered
+ * metrics are written in the Prometheus text exposition format.
+ *
+ * Histograms use fixed buckets and atomic counters, so they may be
+ * updated from any thread. Plain counters must be updated by the thread
+ * that serves the scrapes.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "evloop.h"
+
+// maximum number of registered metrics
+#define METRICS_MAX 128
+// maximum length of a label list
+#define METRICS_LABELS_MAX 64
+
+// upper bucket bounds in microseconds, +Inf is implicit
+#define METRICS_LATENCY_BUCKETS \
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+#define METRICS_BUCKETS 12
+
+/**
+ * A latency histogram in microseconds.
+ */
+struct metrics_histogram {
+  atomic_ulong bucket[METRICS_BUCKETS+1];   // non-cumulative, last is +Inf
+  atomic_ullong sum_usec;
+};
+
+/**
+ * Add an observation to a histogram.
+ */
+void metrics_observe(struct metrics_histogram *h, long usec);
+
+/**
+ * Register a counter. The value must stay valid.
+ * @param name    metric name, e.g. "i2c_retries_total"
+ * @param help    help text
+ * @param labels  label list without braces, e.g. "device=\"0x21\"",
+ *                or NULL; the list is copied
+ * @return 0 on success, -1 if the registry is full
+ */
+int metrics_counter(const char *name, const char *help, const char *labels,
+                    const unsigned long *value);
+
+/**
+ * Register a counter that is updated from other threads.
+ * @see metrics_counter
+ */
+int metrics_counter_atomic(const char *name, const char *help,
+                           const char *labels, const atomic_ulong *value);
+
+/**
+ * Register a histogram, exported in seconds.
+ * @see metrics_counter
+ */
+int metrics_histogram(const char *name, const char *help, const char *labels,
+                      struct metrics_histogram *h);
+
+/**
+ * Write all metrics in the Prometheus text format.
+ */
+void metrics_write(FILE *out);
+
+/**
+ * Serve GET /metrics on a local TCP port from the event loop. The
+ * requests are answered synchronously; the response is only a few
+ * kilobytes.
+ * @param loop  the event loop
+ * @param port  TCP port on the loopback interface
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int metrics_http_init(struct evloop *loop, int port);
+
+/**
+ * Stop serving and close the listening socket.
+ */
+void metrics_http_close();
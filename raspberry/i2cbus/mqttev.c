@@ -0,0 +1,105 @@
+/**
+ * @file mqttev.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Drive a mosquitto client from the epoll event loop
+ */
+
+#include "mqttev.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/epoll.h>
+
+// minimal time between two reconnect attempts
+#define MQTT_RECONNECT_MS 5000
+
+static void mqtt_on_io(struct evloop_handler *h, uint32_t events) {
+  struct mqtt_watch *w = h->ctx;
+  int ret = MOSQ_ERR_SUCCESS;
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    ret = mosquitto_loop_read(w->mosq, 1);
+  if ((ret == MOSQ_ERR_SUCCESS) && (events & EPOLLOUT))
+    ret = mosquitto_loop_write(w->mosq, 1);
+
+  if (ret != MOSQ_ERR_SUCCESS)
+    syslog(LOG_WARNING, "MQTT connection error: %s", mosquitto_strerror(ret));
+
+  mqtt_watch_update(w);
+}
+
+static void mqtt_on_misc(struct evloop_handler *h, uint32_t events) {
+  struct mqtt_watch *w = h->ctx;
+  evloop_timer_ack(h);
+
+  const int ret = mosquitto_loop_misc(w->mosq);
+  // drop a socket closed on a keepalive timeout before the reconnect
+  // gets the same fd number
+  mqtt_watch_update(w);
+
+  if ((ret == MOSQ_ERR_NO_CONN) || (mosquitto_socket(w->mosq) < 0)) {
+    // if failed, try to reconnect
+    const long long now = monotonic_millis();
+    if (now - w->last_reconnect >= MQTT_RECONNECT_MS) {
+      w->last_reconnect = now;
+      if (mosquitto_reconnect(w->mosq) == MOSQ_ERR_SUCCESS)
+        syslog(LOG_INFO, "MQTT connection re-established.");
+    }
+  }
+
+  mqtt_watch_update(w);
+}
+
+int mqtt_watch_init(struct mqtt_watch *w, struct evloop *loop,
+                    struct mosquitto *mosq) {
+  w->loop = loop;
+  w->mosq = mosq;
+  w->last_reconnect = monotonic_millis();
+
+  w->io.fd = -1;
+  w->io.cb = mqtt_on_io;
+  w->io.ctx = w;
+
+  w->misc.cb = mqtt_on_misc;
+  w->misc.ctx = w;
+  if (evloop_timer_init(&w->misc) ||
+      evloop_timer_set(&w->misc, 1000, 1000) ||
+      evloop_add(loop, &w->misc, EPOLLIN))
+    return -1;
+
+  mqtt_watch_update(w);
+  return 0;
+}
+
+void mqtt_watch_update(struct mqtt_watch *w) {
+  const int fd = mosquitto_socket(w->mosq);
+  const uint32_t events = EPOLLIN | (mosquitto_want_write(w->mosq) ? EPOLLOUT : 0);
+
+  if (fd != w->io.fd) {
+    // the old socket may already be closed, which removes it anyway
+    if (w->io.fd >= 0)
+      evloop_del(w->loop, &w->io);
+
+    w->io.fd = fd;
+    if ((fd >= 0) && evloop_add(w->loop, &w->io, events))
+      syslog(LOG_ERR, "Cannot watch the MQTT socket: %s", strerror(errno));
+  } else if ((fd >= 0) && evloop_mod(w->loop, &w->io, events)) {
+    // a closed socket has left the epoll set, even if its fd is back
+    if ((errno != ENOENT) || evloop_add(w->loop, &w->io, events))
+      syslog(LOG_ERR, "Cannot watch the MQTT socket: %s", strerror(errno));
+  }
+}
+
+void mqtt_watch_close(struct mqtt_watch *w) {
+  if (w->io.fd >= 0)
+    evloop_del(w->loop, &w->io);
+  w->io.fd = -1;
+
+  evloop_del(w->loop, &w->misc);
+  close(w->misc.fd);
+  w->misc.fd = -1;
+}
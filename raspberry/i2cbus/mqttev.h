@@ -0,0 +1,43 @@
+/**
+ * @file mqttev.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Drive a mosquitto client from the epoll event loop
+ *
+ * Instead of the blocking mosquitto_loop, the client socket is watched
+ * by the event loop and read or written as soon as it is ready. A one
+ * second timer does the keep-alive handling and reconnects if the
+ * broker has gone away.
+ */
+
+#pragma once
+
+#include <mosquitto.h>
+
+#include "evloop.h"
+
+struct mqtt_watch {
+  struct evloop *loop;
+  struct mosquitto *mosq;
+  struct evloop_handler io;     // client socket
+  struct evloop_handler misc;   // keep-alive and reconnect timer
+  long long last_reconnect;     // monotonic time of the last try
+};
+
+/**
+ * Register a mosquitto client with the event loop.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int mqtt_watch_init(struct mqtt_watch *w, struct evloop *loop,
+                    struct mosquitto *mosq);
+
+/**
+ * Update the watched socket and events, e.g. after a publish to wait
+ * until the socket is writable.
+ */
+void mqtt_watch_update(struct mqtt_watch *w);
+
+/**
+ * Unregister the client.
+ */
+void mqtt_watch_close(struct mqtt_watch *w);
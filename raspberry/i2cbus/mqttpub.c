@@ -0,0 +1,328 @@
+/**
+ * @file mqttpub.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief MQTT publisher thread fed by a lock-free queue
+ */
+
+#include "mqttpub.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <signal.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Publish a message, replayed ones with their original time first.
+ * @param mid  set to the message id of the message
+ * @return the mosquitto error code
+ */
+static int mqtt_pub_publish(struct mqtt_pub *pub, const struct mqtt_msg *msg,
+                            int replay, int *mid) {
+  if (replay) {
+    char topic[MQTT_PUB_TOPIC_MAX + sizeof(MQTT_PUB_TIME_TOPIC)];
+    char stamp[32];
+    const time_t t = msg->time_ms / 1000;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    const size_t len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(stamp+len, sizeof(stamp)-len, ".%03dZ", (int)(msg->time_ms % 1000));
+    snprintf(topic, sizeof(topic), "%s%s", msg->topic, MQTT_PUB_TIME_TOPIC);
+
+    const int ret = mosquitto_publish(pub->mosq, NULL, topic,
+                                      strlen(stamp), stamp,
+                                      msg->qos, msg->retain);
+    if (ret != MOSQ_ERR_SUCCESS)
+      return ret;
+  }
+
+  const int ret = mosquitto_publish(pub->mosq, mid, msg->topic,
+                                    strlen(msg->payload), msg->payload,
+                                    msg->qos, msg->retain);
+  if (ret != MOSQ_ERR_SUCCESS)
+    syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)",
+                    msg->payload,
+                    ret,
+                    mosquitto_strerror(ret));
+  else
+    syslog(LOG_INFO, "MQTT message \"%s\" %s with id %d.",
+                     msg->payload, replay ? "replayed" : "sent", *mid);
+
+  return ret;
+}
+
+/**
+ * Publish the oldest spooled message, unless one is still in flight.
+ * It is removed from the spool when the broker has acknowledged it.
+ */
+static void mqtt_pub_replay(struct mqtt_pub *pub) {
+  if ((pub->spool.fd < 0) || !pub->connected || pub->replay_mid)
+    return;
+
+  const struct mqtt_msg *msg = diskq_peek(&pub->spool);
+  if (!msg)
+    return;
+
+  int mid;
+  if (mqtt_pub_publish(pub, msg, 1, &mid) == MOSQ_ERR_SUCCESS)
+    pub->replay_mid = mid;
+}
+
+/**
+ * Append a message to the spool.
+ */
+static void mqtt_pub_store(struct mqtt_pub *pub, const struct mqtt_msg *msg) {
+  if (diskq_push(&pub->spool, msg))
+    syslog(LOG_WARNING, "MQTT spool full, oldest message dropped.");
+  else
+    syslog(LOG_INFO, "MQTT message \"%s\" spooled (%u waiting).",
+                     msg->payload, diskq_length(&pub->spool));
+}
+
+/**
+ * Publish everything that is queued. While the broker is unreachable or
+ * older messages are still spooled, new ones go to the spool as well to
+ * keep the order.
+ */
+static void mqtt_pub_drain(struct mqtt_pub *pub) {
+  struct mqtt_msg msg;
+
+  while (!spscq_pop(&pub->queue, &msg)) {
+    const int spool = (pub->spool.fd >= 0);
+
+    if (spool && (!pub->connected || diskq_length(&pub->spool))) {
+      mqtt_pub_store(pub, &msg);
+      continue;
+    }
+
+    int mid;
+    const int ret = mqtt_pub_publish(pub, &msg, 0, &mid);
+    if (ret == MOSQ_ERR_SUCCESS) {
+      // the oldest entry is given up if too many are in flight
+      pub->inflight[pub->inflight_next].mid = mid;
+      pub->inflight[pub->inflight_next].queued_usec = msg.queued_usec;
+      pub->inflight_next = (pub->inflight_next + 1) % MQTT_PUB_INFLIGHT;
+    } else if (spool && (ret == MOSQ_ERR_NO_CONN || ret == MOSQ_ERR_CONN_LOST))
+      mqtt_pub_store(pub, &msg);
+  }
+
+  mqtt_pub_replay(pub);
+}
+
+static void mqtt_pub_on_connect(struct mosquitto *mosq, void *obj, int rc) {
+  struct mqtt_pub *pub = obj;
+
+  if (rc)
+    return;
+
+  pub->connected = 1;
+  // a replay in flight on the old connection is sent again
+  pub->replay_mid = 0;
+  mqtt_pub_replay(pub);
+}
+
+static void mqtt_pub_on_disconnect(struct mosquitto *mosq, void *obj, int rc) {
+  struct mqtt_pub *pub = obj;
+
+  pub->connected = 0;
+  pub->replay_mid = 0;
+}
+
+static void mqtt_pub_on_publish(struct mosquitto *mosq, void *obj, int mid) {
+  struct mqtt_pub *pub = obj;
+
+  int i;
+  for (i = 0; i < MQTT_PUB_INFLIGHT; i++)
+    if (pub->inflight[i].mid == mid) {
+      metrics_observe(&pub->latency,
+                      monotonic_micros() - pub->inflight[i].queued_usec);
+      pub->inflight[i].mid = 0;
+      return;
+    }
+
+  if (!pub->replay_mid || (mid != pub->replay_mid))
+    return;
+
+  diskq_pop(&pub->spool);
+  pub->replay_mid = 0;
+  mqtt_pub_replay(pub);
+}
+
+static void mqtt_pub_on_wake(struct evloop_handler *h, uint32_t events) {
+  struct mqtt_pub *pub = h->ctx;
+  uint64_t val;
+
+  // reset the eventfd counter before draining, so no push is missed
+  if (read(h->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+    syslog(LOG_WARNING, "Error %d on reading the publisher wake-up.", errno);
+
+  mqtt_pub_drain(pub);
+
+  if (atomic_load(&pub->stop))
+    pub->loop.run = 0;
+
+  // the publishes may have to wait for the socket
+  mqtt_watch_update(&pub->watch);
+}
+
+static void *mqtt_pub_thread(void *arg) {
+  struct mqtt_pub *pub = arg;
+
+  const int ret = mosquitto_connect(pub->mosq, pub->host, pub->port, 30);
+  if (ret == MOSQ_ERR_SUCCESS)
+    syslog(LOG_INFO, "MQTT connection to %s established.", pub->host);
+  else
+    syslog(LOG_WARNING, "MQTT connection to %s failed: %s",
+                        pub->host, mosquitto_strerror(ret));
+  // the watch reconnects if the connection failed
+
+  if (mqtt_watch_init(&pub->watch, &pub->loop, pub->mosq))
+    syslog(LOG_ERR, "Error %d on watching the MQTT connection.", errno);
+
+  // messages may have been queued while connecting
+  mqtt_pub_drain(pub);
+  mqtt_watch_update(&pub->watch);
+
+  if (evloop_run(&pub->loop))
+    syslog(LOG_ERR, "Error %d in the MQTT publisher loop.", errno);
+
+  // give the last messages a chance to leave the socket
+  mosquitto_loop(pub->mosq, 100, 1);
+
+  mqtt_watch_close(&pub->watch);
+  mosquitto_disconnect(pub->mosq);
+  if (pub->spool.fd >= 0)
+    diskq_close(&pub->spool);
+
+  return NULL;
+}
+
+int mqtt_pub_start(struct mqtt_pub *pub, const char *id,
+                   const char *host, int port, const char *spool) {
+  pub->host = host;
+  pub->port = port;
+  pub->connected = 0;
+  pub->replay_mid = 0;
+  memset(pub->inflight, 0, sizeof(pub->inflight));
+  pub->inflight_next = 0;
+  memset(&pub->latency, 0, sizeof(pub->latency));
+  atomic_init(&pub->dropped, 0);
+  atomic_init(&pub->stop, 0);
+  spscq_init(&pub->queue, pub->slots, sizeof(struct mqtt_msg), MQTT_PUB_QUEUE);
+
+  metrics_histogram("mqtt_publish_duration_seconds",
+                    "Time from queueing an MQTT message to its acknowledgement.",
+                    NULL, &pub->latency);
+  metrics_counter_atomic("mqtt_dropped_total",
+                         "MQTT messages dropped because the queue was full.",
+                         NULL, &pub->dropped);
+
+  pub->mosq = mosquitto_new(id, true, pub);
+  if (!pub->mosq)
+    return -1;
+  mosquitto_connect_callback_set(pub->mosq, mqtt_pub_on_connect);
+  mosquitto_disconnect_callback_set(pub->mosq, mqtt_pub_on_disconnect);
+  mosquitto_publish_callback_set(pub->mosq, mqtt_pub_on_publish);
+
+  pub->spool.fd = -1;
+  if (spool) {
+    if (diskq_open(&pub->spool, spool,
+                   sizeof(struct mqtt_msg), MQTT_PUB_SPOOL))
+      syslog(LOG_WARNING, "Error %d on opening the MQTT spool %s.",
+                          errno, spool);
+    else if (diskq_length(&pub->spool))
+      syslog(LOG_INFO, "%u MQTT messages waiting in the spool.",
+                       diskq_length(&pub->spool));
+  }
+
+  pub->loop.epfd = -1;
+  pub->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pub->wake.cb = mqtt_pub_on_wake;
+  pub->wake.ctx = pub;
+  if ((pub->wake.fd < 0) ||
+      evloop_init(&pub->loop) ||
+      evloop_add(&pub->loop, &pub->wake, EPOLLIN))
+    goto fail;
+
+  // signals are handled by the main thread only
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  const int err = pthread_create(&pub->thread, NULL, mqtt_pub_thread, pub);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    errno = err;
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  if (pub->spool.fd >= 0)
+    diskq_close(&pub->spool);
+  if (pub->wake.fd >= 0)
+    close(pub->wake.fd);
+  evloop_close(&pub->loop);
+  mosquitto_destroy(pub->mosq);
+  pub->mosq = NULL;
+  return -1;
+}
+
+/**
+ * Wake the publisher thread.
+ */
+static void mqtt_pub_signal(struct mqtt_pub *pub) {
+  const uint64_t one = 1;
+  // the counter cannot overflow in practice; a failed write is harmless
+  // as long as one wake-up is pending
+  if (write(pub->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    syslog(LOG_WARNING, "Error %d on waking the MQTT publisher.", errno);
+}
+
+int mqtt_pub_send(struct mqtt_pub *pub, const char *topic,
+                  const char *payload, int qos, bool retain) {
+  struct mqtt_msg msg;
+  struct timespec ts;
+
+  // keep the time of the event for a delayed delivery
+  clock_gettime(CLOCK_REALTIME, &ts);
+  msg.time_ms = ts.tv_sec*1000LL + ts.tv_nsec/1000000L;
+  msg.queued_usec = monotonic_micros();
+  strncpy(msg.topic, topic, MQTT_PUB_TOPIC_MAX-1);
+  msg.topic[MQTT_PUB_TOPIC_MAX-1] = 0;
+  strncpy(msg.payload, payload, MQTT_PUB_PAYLOAD_MAX-1);
+  msg.payload[MQTT_PUB_PAYLOAD_MAX-1] = 0;
+  msg.qos = qos;
+  msg.retain = retain;
+
+  if (spscq_push(&pub->queue, &msg)) {
+    const unsigned long dropped = atomic_fetch_add(&pub->dropped, 1) + 1;
+    syslog(LOG_WARNING, "MQTT queue full, message \"%s\" dropped (%lu total).",
+                        msg.payload, dropped);
+    return -1;
+  }
+
+  mqtt_pub_signal(pub);
+  return 0;
+}
+
+void mqtt_pub_stop(struct mqtt_pub *pub) {
+  if (!pub->mosq)
+    return;
+
+  atomic_store(&pub->stop, 1);
+  mqtt_pub_signal(pub);
+  pthread_join(pub->thread, NULL);
+
+  close(pub->wake.fd);
+  evloop_close(&pub->loop);
+  mosquitto_destroy(pub->mosq);
+  pub->mosq = NULL;
+}
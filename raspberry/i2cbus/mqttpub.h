@@ -0,0 +1,113 @@
+/**
+ * @file mqttpub.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief MQTT publisher thread fed by a lock-free queue
+ *
+ * The device loop must not wait for the broker. Messages are pushed
+ * into a single-producer/single-consumer queue and published by a
+ * separate thread, which owns the mosquitto handle and does all
+ * connection handling including reconnects. Pushing never blocks; if
+ * the queue is full the message is dropped and counted.
+ *
+ * While the broker is unreachable, the publisher thread stores the
+ * messages in a spool file (see diskq.h). When the connection is back,
+ * they are replayed in order, one at a time, and removed only after the
+ * broker has acknowledged them. A replayed message is preceded by its
+ * original time (ISO 8601, UTC) on the sub-topic MQTT_PUB_TIME_TOPIC.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <mosquitto.h>
+
+#include "spscq.h"
+#include "diskq.h"
+#include "evloop.h"
+#include "mqttev.h"
+#include "metrics.h"
+
+#define MQTT_PUB_TOPIC_MAX    64
+#define MQTT_PUB_PAYLOAD_MAX  32
+// must be a power of two
+#define MQTT_PUB_QUEUE        64
+// number of messages kept in the spool file
+#define MQTT_PUB_SPOOL        1024
+// live messages tracked for the publish latency
+#define MQTT_PUB_INFLIGHT     16
+// sub-topic for the original time of replayed messages
+#define MQTT_PUB_TIME_TOPIC   "/Time"
+
+/**
+ * A queued message.
+ */
+struct mqtt_msg {
+  int64_t time_ms;              // wall clock time of the event
+  int64_t queued_usec;          // monotonic time of the push
+  char topic[MQTT_PUB_TOPIC_MAX];
+  char payload[MQTT_PUB_PAYLOAD_MAX];
+  int qos;
+  bool retain;
+};
+
+struct mqtt_pub {
+  const char *host;
+  int port;
+  struct mosquitto *mosq;
+
+  struct spscq queue;
+  struct mqtt_msg slots[MQTT_PUB_QUEUE];
+  atomic_ulong dropped;         // messages lost to a full queue
+  atomic_int stop;
+
+  // publisher thread
+  pthread_t thread;
+  struct evloop loop;
+  struct evloop_handler wake;   // eventfd, signalled on push and stop
+  struct mqtt_watch watch;
+  int connected;
+  struct diskq spool;           // fd is -1 if there is no spool
+  int replay_mid;               // message id of the replay in flight, or 0
+
+  // publish latency from the push to the acknowledgement of the broker
+  struct {
+    int mid;
+    int64_t queued_usec;
+  } inflight[MQTT_PUB_INFLIGHT];
+  int inflight_next;
+  struct metrics_histogram latency;
+};
+
+/**
+ * Create the mosquitto client and start the publisher thread, which
+ * connects to the broker. The calling thread's signals are blocked in
+ * the publisher thread. The publish latency and the dropped messages are
+ * registered as metrics.
+ * @param pub    the publisher
+ * @param id     the MQTT client id
+ * @param host   broker host name, must stay valid
+ * @param port   broker port
+ * @param spool  spool file for undelivered messages, or NULL; if the
+ *               file cannot be opened, messages are kept in memory only
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int mqtt_pub_start(struct mqtt_pub *pub, const char *id,
+                   const char *host, int port, const char *spool);
+
+/**
+ * Queue a message for publishing. Producer side, never blocks.
+ * Topic and payload are truncated to the record size.
+ * @return 0 on success, -1 if the queue is full
+ */
+int mqtt_pub_send(struct mqtt_pub *pub, const char *topic,
+                  const char *payload, int qos, bool retain);
+
+/**
+ * Publish or spool the remaining messages, disconnect and join the
+ * publisher thread.
+ */
+void mqtt_pub_stop(struct mqtt_pub *pub);
@@ -0,0 +1,62 @@
+/**
+ * @file rtmode.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Real-time scheduling for the thread that serves the hardware
+ */
+
+#define _GNU_SOURCE
+
+#include "rtmode.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/**
+ * Touch the stack below the caller, so the pages are mapped and, after
+ * mlockall, stay mapped.
+ */
+static void __attribute__((noinline)) rt_prefault_stack() {
+  volatile unsigned char stack[RT_STACK_PREFAULT];
+  size_t i;
+
+  for (i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+int rt_enter(const struct rt_config *cfg) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE))
+    return -1;
+
+  // keep freed memory in the locked heap instead of returning it
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  rt_prefault_stack();
+
+  int err;
+  if (cfg->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cfg->cpu, &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+      errno = err;
+      return -1;
+    }
+  }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = cfg->priority;
+  if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
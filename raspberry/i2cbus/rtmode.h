@@ -0,0 +1,36 @@
+/**
+ * @file rtmode.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Real-time scheduling for the thread that serves the hardware
+ *
+ * On a loaded Pi, a daemon that reacts to the I³C INT line may be
+ * scheduled late. In real-time mode the calling thread gets a SCHED_FIFO
+ * priority and optionally a CPU of its own, and all memory of the
+ * process is locked, so neither the scheduler nor a page fault delays
+ * the wake-up.
+ *
+ * Threads inherit the scheduling of their creator, so rt_enter is
+ * called after the helper threads (log flusher, MQTT publisher) have
+ * been started; they keep the normal scheduling.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// stack size that is touched in advance, so it is never faulted in later
+#define RT_STACK_PREFAULT (256*1024)
+
+struct rt_config {
+  int priority;                 // SCHED_FIFO priority, 1..99
+  int cpu;                      // CPU to pin the thread to, -1 for any
+};
+
+/**
+ * Lock all memory of the process, pre-fault the stack of the calling
+ * thread, pin it to the configured CPU and switch it to SCHED_FIFO.
+ * Stops at the first step that fails, e.g. without CAP_SYS_NICE.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int rt_enter(const struct rt_config *cfg);
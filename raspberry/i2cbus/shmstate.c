@@ -0,0 +1,173 @@
+/**
+ * @file shmstate.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Live device state in shared memory for local readers
+ */
+
+#include "shmstate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// reader retries before it gives up on a busy writer
+#define SHMSTATE_READ_TRIES 100
+
+void shmstate_clear(struct shmstate_values *v) {
+  // all fields are signed, so all bytes 0xff make them -1
+  memset(v, 0xff, sizeof(*v));
+}
+
+static int64_t shmstate_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+int shmstate_create(struct shmstate *s, const char *path) {
+  s->hdr = NULL;
+
+  // a new file, so readers of the old one see its pid go away
+  unlink(path);
+  const int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, sizeof(struct shmstate_header))) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  void *map = mmap(NULL, sizeof(struct shmstate_header),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  const int err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = err;
+    return -1;
+  }
+
+  struct shmstate_header *hdr = map;
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->version = SHMSTATE_VERSION;
+  hdr->size = sizeof(hdr->snap);
+  hdr->pid = getpid();
+  shmstate_clear(&hdr->snap.values);
+  // readers check the magic last
+  atomic_thread_fence(memory_order_release);
+  hdr->magic = SHMSTATE_MAGIC;
+
+  s->hdr = hdr;
+  return 0;
+}
+
+void shmstate_publish(struct shmstate *s, const struct shmstate_values *v) {
+  struct shmstate_header *hdr = s->hdr;
+  if (!hdr)
+    return;
+
+  const int64_t now = shmstate_now();
+  const int changed = memcmp(&hdr->snap.values, v, sizeof(*v));
+
+  const unsigned seq = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+  atomic_store_explicit(&hdr->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  hdr->snap.updated_usec = now;
+  hdr->snap.updates++;
+  if (changed) {
+    hdr->snap.changed_usec = now;
+    hdr->snap.changes++;
+    hdr->snap.values = *v;
+  }
+
+  atomic_store_explicit(&hdr->seq, seq + 2, memory_order_release);
+}
+
+int shmstate_open(struct shmstate *s, const char *path) {
+  s->hdr = NULL;
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(struct shmstate_header))) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *map = mmap(NULL, sizeof(struct shmstate_header), PROT_READ,
+                   MAP_SHARED, fd, 0);
+  const int err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = err;
+    return -1;
+  }
+
+  struct shmstate_header *hdr = map;
+  if ((hdr->magic != SHMSTATE_MAGIC) || (hdr->version != SHMSTATE_VERSION) ||
+      (hdr->size != sizeof(hdr->snap))) {
+    munmap(map, sizeof(struct shmstate_header));
+    errno = EINVAL;
+    return -1;
+  }
+  atomic_thread_fence(memory_order_acquire);
+
+  s->hdr = hdr;
+  return 0;
+}
+
+int shmstate_read(const struct shmstate *s, struct shmstate_snapshot *out) {
+  struct shmstate_header *hdr = s->hdr;
+  int i;
+
+  for (i = 0; i < SHMSTATE_READ_TRIES; i++) {
+    const unsigned s1 = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+    if (s1 & 1) {
+      sched_yield();
+      continue;
+    }
+
+    memcpy(out, &hdr->snap, sizeof(*out));
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&hdr->seq, memory_order_relaxed) == s1)
+      return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+int shmstate_alive(const struct shmstate *s) {
+  const pid_t pid = s->hdr->pid;
+
+  // EPERM means it exists, but belongs to someone else
+  return (pid > 0) && (!kill(pid, 0) || (errno == EPERM));
+}
+
+void shmstate_close(struct shmstate *s) {
+  if (!s->hdr)
+    return;
+
+  // only the writer's pid matches
+  if (s->hdr->pid == getpid())
+    s->hdr->pid = 0;
+
+  munmap(s->hdr, sizeof(struct shmstate_header));
+  s->hdr = NULL;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file shmstate.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Live device state in shared memory for local readers
+ *
+ * Each daemon publishes the state it has polled anyway into a small
+ * file on tmpfs, e.g. /dev/shm/doorstate.state. Local scripts read the
+ * door status from there instead of sending their own I2C commands,
+ * so they neither fork i2cctl nor compete with the daemons for the
+ * bus.
+ *
+ * The daemon is the only writer. The snapshot is protected by a
+ * sequence lock: the sequence number is odd while the writer updates
+ * the snapshot, and a reader retries if it has changed during the copy.
+ * Readers never block the writer.
+ *
+ * statedump prints a snapshot for shell scripts.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHMSTATE_MAGIC    0x54415453  // "STAT"
+#define SHMSTATE_VERSION  2
+
+// switches of all panels and shutters of all controllers, in the order
+// of the device table
+#define SHMSTATE_PANELS   4
+#define SHMSTATE_SWITCHES 16
+#define SHMSTATE_SHUTTERS 16
+
+// a value that the writing daemon does not know
+#define SHMSTATE_UNKNOWN  -1
+
+/**
+ * The published values. Each daemon fills the part of its devices; the
+ * rest stays SHMSTATE_UNKNOWN.
+ */
+struct shmstate_values {
+  int16_t door_status;          // raw status byte of the door controller
+  int8_t door_closed;           // decoded from door_status, 0 or 1
+  int8_t lock_open;
+  int8_t green_active;
+  int8_t red_active;
+  int8_t manual_mode[SHMSTATE_PANELS];      // 1 on, 2 off
+  int8_t switch_state[SHMSTATE_SWITCHES];   // 0 locked, 1 up, 2 down, 3 neutral
+  int8_t shutter_state[SHMSTATE_SHUTTERS];  // 0 off, 1 up, 2 down
+};
+
+/**
+ * A consistent copy of the state.
+ */
+struct shmstate_snapshot {
+  int64_t updated_usec;         // CLOCK_REALTIME of the last update
+  int64_t changed_usec;         // CLOCK_REALTIME of the last change
+  uint32_t updates;             // number of updates, i.e. polls
+  uint32_t changes;             // number of updates with changed values
+  struct shmstate_values values;
+};
+
+struct shmstate_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;                // size of the snapshot
+  int32_t pid;                  // the writer, 0 after it has exited
+  atomic_uint seq;              // odd while the snapshot is written
+  struct shmstate_snapshot snap;
+};
+
+struct shmstate {
+  struct shmstate_header *hdr;  // the mapping, NULL if not open
+};
+
+/**
+ * Set all values to SHMSTATE_UNKNOWN.
+ */
+void shmstate_clear(struct shmstate_values *v);
+
+/**
+ * Create the state file for writing. An existing file is replaced.
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int shmstate_create(struct shmstate *s, const char *path);
+
+/**
+ * Publish the values of a poll. The change time and counter are only
+ * updated if the values differ from the last ones. Does nothing if the
+ * state file is not open.
+ */
+void shmstate_publish(struct shmstate *s, const struct shmstate_values *v);
+
+/**
+ * Open a state file for reading.
+ * @return 0 on success, -1 on error (errno is set; EINVAL if the file
+ *         has a different layout)
+ */
+int shmstate_open(struct shmstate *s, const char *path);
+
+/**
+ * Copy a consistent snapshot.
+ * @return 0 on success, -1 if the writer was always busy (errno is
+ *         EAGAIN)
+ */
+int shmstate_read(const struct shmstate *s, struct shmstate_snapshot *out);
+
+/**
+ * @return non-zero if the writing daemon is still running
+ */
+int shmstate_alive(const struct shmstate *s);
+
+/**
+ * Unmap the state file. For the writer, the file is kept and marked as
+ * abandoned, so readers can tell the state is stale.
+ */
+void shmstate_close(struct shmstate *s);
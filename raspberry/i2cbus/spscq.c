@@ -0,0 +1,57 @@
+/**
+ * @file spscq.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Lock-free single-producer/single-consumer ring buffer
+ */
+
+#include "spscq.h"
+
+#include <string.h>
+
+int spscq_init(struct spscq *q, void *slots, size_t size, size_t count) {
+  if (!count || (count & (count-1)))
+    return -1;
+
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  q->slots = slots;
+  q->size = size;
+  q->mask = count-1;
+
+  return 0;
+}
+
+int spscq_push(struct spscq *q, const void *rec) {
+  const size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  const size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  // the indices run freely, so the difference is the fill level
+  if (head - tail > q->mask)
+    return -1;
+
+  memcpy(q->slots + (head & q->mask)*q->size, rec, q->size);
+  // publish the record only after it has been written
+  atomic_store_explicit(&q->head, head+1, memory_order_release);
+
+  return 0;
+}
+
+int spscq_pop(struct spscq *q, void *rec) {
+  const size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  const size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (head == tail)
+    return -1;
+
+  memcpy(rec, q->slots + (tail & q->mask)*q->size, q->size);
+  // hand the slot back only after it has been read
+  atomic_store_explicit(&q->tail, tail+1, memory_order_release);
+
+  return 0;
+}
+
+size_t spscq_length(struct spscq *q) {
+  return atomic_load_explicit(&q->head, memory_order_acquire) -
+         atomic_load_explicit(&q->tail, memory_order_acquire);
+}
@@ -0,0 +1,54 @@
+/**
+ * @file spscq.h
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Lock-free single-producer/single-consumer ring buffer
+ *
+ * The queue hands fixed-size records from exactly one producer thread
+ * to exactly one consumer thread without locks: the producer only
+ * writes the head index, the consumer only writes the tail index.
+ * Neither side ever blocks; a full queue is reported to the producer.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// keep head and tail on separate cache lines
+#define SPSCQ_CACHELINE 64
+
+struct spscq {
+  _Alignas(SPSCQ_CACHELINE) atomic_size_t head;   // next slot to write
+  _Alignas(SPSCQ_CACHELINE) atomic_size_t tail;   // next slot to read
+  _Alignas(SPSCQ_CACHELINE) unsigned char *slots;
+  size_t size;                  // size of a record in bytes
+  size_t mask;                  // number of slots - 1
+};
+
+/**
+ * Initialize a queue on caller-provided storage.
+ * @param q      the queue
+ * @param slots  storage for count records of size bytes
+ * @param size   size of a record in bytes
+ * @param count  number of slots, must be a power of two
+ * @return 0 on success, -1 if count is not a power of two
+ */
+int spscq_init(struct spscq *q, void *slots, size_t size, size_t count);
+
+/**
+ * Copy a record into the queue. Producer side only.
+ * @return 0 on success, -1 if the queue is full
+ */
+int spscq_push(struct spscq *q, const void *rec);
+
+/**
+ * Copy the oldest record out of the queue. Consumer side only.
+ * @return 0 on success, -1 if the queue is empty
+ */
+int spscq_pop(struct spscq *q, void *rec);
+
+/**
+ * @return the number of records currently queued (a snapshot)
+ */
+size_t spscq_length(struct spscq *q);
@@ -0,0 +1,104 @@
+/**
+ * @file i2cctl.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Command line client for the I2C bus daemon
+ *
+ * Replacement for "i2cget -y 1 ADDR CMD" in the shell scripts: sends
+ * the command byte and prints the reply bytes in the same format,
+ * without competing with the daemons for the bus. If i2cd does not
+ * answer, the adapter is used directly, so the door can still be opened
+ * from the shell when the daemon is down.
+ *
+ * Usage: i2cctl [-s socket | -b bus] [-p prio] ADDR CMD [LEN]
+ *
+ * bus is the adapter number N of /dev/i2c-N (default 1), also if i2cd
+ * serves several buses
+ *
+ * prio is the i2cd priority class: 0 poll (default), 1 user, 2 safety
+ */
+
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "../i2cbus/i2cbus.h"
+#include "../i2cbus/i2cproto.h"
+
+int main(int argc, char *argv[]) {
+  const char *path = I2CD_SOCKET;
+  char bus_path[64];
+  char dev_path[64];
+  int adapter = 1;
+  long prio = I2CD_PRIO_POLL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:b:p:")) != -1) {
+    switch (opt) {
+      case 's': path = optarg; break;
+      case 'b':
+        adapter = strtol(optarg, NULL, 0);
+        snprintf(bus_path, sizeof(bus_path), I2CD_SOCKET_BUS, adapter);
+        path = bus_path;
+        break;
+      case 'p': prio = strtol(optarg, NULL, 0); break;
+      default: argc = 0;
+    }
+  }
+
+  if ((argc - optind < 2) || (argc - optind > 3)) {
+    fprintf(stderr, "Usage: %s [-s socket | -b bus] [-p prio] ADDR CMD [LEN]\n",
+                    argv[0]);
+    return 2;
+  }
+
+  const long addr = strtol(argv[optind], NULL, 0);
+  const long cmd  = strtol(argv[optind+1], NULL, 0);
+  const long len  = (argc - optind > 2) ? strtol(argv[optind+2], NULL, 0) : 1;
+
+  if ((addr < 0x03) || (addr > 0x77) ||
+      (cmd < 0) || (cmd > 0xff) ||
+      (len < 1) || (len > I2CD_REPLY_MAX) ||
+      (prio < 0) || (prio >= I2CD_PRIO_LEVELS)) {
+    fprintf(stderr, "Error: argument out of range\n");
+    return 2;
+  }
+
+  struct I2C_bus bus;
+  if (I2C_bus_open(&bus, path)) {
+    fprintf(stderr, "Warning: could not connect to %s: %s\n",
+                    path, strerror(errno));
+
+    // fall back to the adapter, like the daemons without i2cd
+    snprintf(dev_path, sizeof(dev_path), "/dev/i2c-%d", adapter);
+    if (I2C_bus_open(&bus, dev_path)) {
+      fprintf(stderr, "Error: could not open %s: %s\n",
+                      dev_path, strerror(errno));
+      return 1;
+    }
+  }
+
+  struct I2C_device dev;
+  I2C_device_init(&dev, &bus, addr);
+  dev.prio = prio;
+
+  uint8_t reply[I2CD_REPLY_MAX];
+  const int ret = I2C_transfer(&dev, cmd, reply, len);
+  I2C_bus_close(&bus);
+
+  if (ret) {
+    fprintf(stderr, "Error: Read failed: %s\n", strerror(-ret));
+    return 1;
+  }
+
+  long i;
+  for (i = 0; i < len; i++)
+    printf(i ? " 0x%02x" : "0x%02x", reply[i]);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,891 @@
+/**
+ * @file i2cd.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief I2C bus daemon
+ *
+ * Owns the I2C adapters and serializes the transfers of all clients
+ * (shuttercontrol, doorstate, door-service and the shell scripts via
+ * i2cctl). Clients talk to the daemon over a Unix socket, see
+ * i2cproto.h for the protocol.
+ *
+ * Each adapter given with -b is served by its own worker thread with
+ * its own queues, so the transfers on one bus never wait for another
+ * bus. An adapter /dev/i2c-N gets the socket I2CD_SOCKET_BUS; the first
+ * one is also served at the socket given with -s. The main thread does
+ * all socket I/O and hands the requests to the workers through
+ * lock-free queues.
+ *
+ * Requests are queued per priority class. Between two transfers a
+ * worker collects all new requests and then executes the oldest one of
+ * the most urgent class. Send SIGUSR1 to log the queue metrics.
+ *
+ * With -t, all transfers of all clients are recorded to a trace file,
+ * which can be replayed by the daemons (see i2ctrace.h). Further buses
+ * are recorded to the same name with ".N" appended, N being the index
+ * of the -b option.
+ *
+ * When a transfer on /dev/i2c-1 fails, the worker checks whether a
+ * device holds the bus low and frees it, see i2crecover.h; -R turns
+ * this off. The clients only see a slower answer.
+ *
+ * With -c, the speed of the first bus is calibrated at start-up with
+ * the given status commands, e.g. -c 0x23:0x30 for each device, and
+ * lowered again if the error rate rises, see i2cspeed.h. The command
+ * byte is given as for i2cctl.
+ *
+ * The GPIO line can be requested by one process only, so the daemon
+ * owns the I³C INT line and relays its edges to the clients of
+ * I2CD_INT_SOCKET; -I leaves the line alone.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include <syslog.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../i2cbus/i2cbus.h"
+#include "../i2cbus/i2cproto.h"
+#include "../i2cbus/i2crecover.h"
+#include "../i2cbus/i2cspeed.h"
+#include "../i2cbus/i3cint.h"
+#include "../i2cbus/spscq.h"
+
+const char* I2C_BUS     = "/dev/i2c-1";
+const char* I2CD_PATH   = I2CD_SOCKET;
+
+const char* I3C_INT_CHIP = "/dev/gpiochip0";
+const int   I3C_INT_LINE = 17;  // BCM GPIO17, INT on the pi-hat
+
+#define MAX_CLIENTS 16
+#define MAX_BUSES   I2CD_BUSES_MAX
+#define MAX_PROBES  8
+
+static volatile sig_atomic_t run = 1;
+static volatile sig_atomic_t dump_metrics = 0;
+
+static void on_signal(int sig) {
+  if (sig == SIGUSR1)
+    dump_metrics = 1;
+  else
+    run = 0;
+}
+
+/**
+ * Get the microseconds from the monotonic clock.
+ */
+long long monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+///// Scheduler /////
+
+// every client may have a few requests in flight
+#define QUEUE_SIZE (4*MAX_CLIENTS)
+// records between the main thread and a worker, a power of two
+#define HANDOFF_SIZE (4*QUEUE_SIZE)
+
+/**
+  * A queued client request
+  */
+struct job {
+  int client;                   // client slot
+  unsigned int gen;             // generation of the client slot
+  struct i2cd_request req;
+  long long queued;             // time of arrival
+};
+
+/**
+  * An executed job, on its way back to the main thread
+  */
+struct done {
+  int client;
+  unsigned int gen;
+  struct i2cd_response res;
+};
+
+/**
+  * FIFO for one priority class, with metrics
+  */
+struct job_queue {
+  struct job jobs[QUEUE_SIZE];
+  unsigned int head;
+  unsigned int count;
+
+  unsigned int max_depth;       // highest number of waiting jobs
+  unsigned long served;         // number of executed jobs
+  unsigned long rejected;       // jobs rejected because the queue was full
+  long long total_wait;         // sum of the queueing times in usec
+  long long max_wait;           // longest queueing time in usec
+};
+
+/**
+  * An I2C adapter with its worker thread. The queues, the bus and the
+  * devices belong to the worker; the main thread only talks to it
+  * through the handoff queues.
+  */
+struct bus_worker {
+  const char *path;             // adapter device
+  int adapter;                  // N of /dev/i2c-N, -1 for other names
+  struct I2C_bus bus;
+  struct I2C_speed speed;
+  bool speed_control;           // the speed is supervised
+
+  // device records by address, initialized on first use
+  struct I2C_device devs[128];
+  bool devs_used[128];
+
+  struct job_queue queues[I2CD_PRIO_LEVELS];
+
+  struct spscq in;              // jobs from the main thread
+  struct job in_slots[HANDOFF_SIZE];
+  struct spscq out;             // responses to the main thread
+  struct done out_slots[HANDOFF_SIZE];
+
+  int wake;                     // eventfd, signaled by the main thread
+  atomic_uint resets;           // bus.resets for the main thread
+  atomic_int run;
+  atomic_int dump_metrics;
+  pthread_t thread;
+};
+
+struct bus_worker workers[MAX_BUSES];
+int nworkers = 0;
+
+// signaled by the workers when there are responses
+int done_fd = -1;
+
+// bumped when a client slot is released, so the jobs of a client that
+// has gone away are skipped
+atomic_uint client_gen[MAX_CLIENTS];
+
+/**
+  * Queue a request.
+  * @return 0 on success, -1 if the queue is full
+  */
+int job_queue(struct bus_worker *w, const struct job *job) {
+  struct job_queue *q = &w->queues[job->req.prio];
+
+  if (q->count == QUEUE_SIZE) {
+    q->rejected++;
+    return -1;
+  }
+
+  q->jobs[(q->head + q->count) % QUEUE_SIZE] = *job;
+
+  q->count++;
+  if (q->count > q->max_depth)
+    q->max_depth = q->count;
+
+  return 0;
+}
+
+/**
+  * Take the oldest job from the most urgent non-empty queue.
+  * @return 1 if there was a job, 0 if all queues are empty
+  */
+int job_next(struct bus_worker *w, struct job *job) {
+  int prio;
+  for (prio = I2CD_PRIO_LEVELS-1; prio >= 0; prio--) {
+    struct job_queue *q = &w->queues[prio];
+    if (!q->count)
+      continue;
+
+    *job = q->jobs[q->head];
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    q->count--;
+
+    const long long wait = monotonic_usec() - job->queued;
+    q->served++;
+    q->total_wait += wait;
+    if (wait > q->max_wait)
+      q->max_wait = wait;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+  * Log the queue metrics of a bus.
+  */
+void job_log_metrics(const struct bus_worker *w) {
+  static const char *names[I2CD_PRIO_LEVELS] = {"poll", "user", "safety"};
+
+  int prio;
+  for (prio = I2CD_PRIO_LEVELS-1; prio >= 0; prio--) {
+    const struct job_queue *q = &w->queues[prio];
+    syslog(LOG_INFO, "%s queue %s: depth %u, max depth %u, %lu served, "
+                     "%lu rejected, avg wait %lld us, max wait %lld us.",
+                     w->path, names[prio], q->count, q->max_depth,
+                     q->served, q->rejected,
+                     q->served ? q->total_wait / q->served : 0,
+                     q->max_wait);
+  }
+}
+
+struct I2C_device* I2C_get_device(struct bus_worker *w, const uint8_t addr) {
+  if (!w->devs_used[addr]) {
+    I2C_device_init(&w->devs[addr], &w->bus, addr);
+    w->devs_used[addr] = true;
+  }
+  return &w->devs[addr];
+}
+
+///// Bus workers /////
+
+/**
+  * Hand a response to the main thread. If the main thread lags behind,
+  * wait for it; the response must not get lost.
+  */
+void worker_respond(struct bus_worker *w, const struct done *d) {
+  const uint64_t one = 1;
+
+  while (spscq_push(&w->out, d)) {
+    write(done_fd, &one, sizeof(one));
+    sched_yield();
+  }
+  write(done_fd, &one, sizeof(one));
+}
+
+/**
+  * Check a transfer for errors that a slower bus might avoid: a timeout
+  * or a reply byte that does not match its inversion. A missing
+  * acknowledge does not count, an absent or wrong address would lower
+  * the speed for all devices.
+  */
+bool reply_failed(const struct i2cd_response *res) {
+  if (res->err)
+    return I2C_classify_errno(-res->err) == I2C_FAIL_TIMEOUT;
+
+  int i;
+  for (i = 0; i + 1 < res->len; i += 2)
+    if (res->reply[i+1] != (uint8_t)~res->reply[i])
+      return true;
+  return false;
+}
+
+/**
+  * Execute a job on the bus and send the response.
+  */
+void execute_job(struct bus_worker *w, const struct job *job) {
+  struct done d;
+  memset(&d, 0, sizeof(d));
+  d.client = job->client;
+  d.gen = job->gen;
+
+  struct I2C_device *dev = I2C_get_device(w, job->req.addr);
+  d.res.err = I2C_transfer(dev, job->req.send, d.res.reply, job->req.len);
+  // a bus held low fails all further transfers; free it and try again
+  if (d.res.err && (I2C_recover(&w->bus) > 0))
+    d.res.err = I2C_transfer(dev, job->req.send, d.res.reply, job->req.len);
+  d.res.len = job->req.len;
+  d.res.usec = dev->stats.last_usec;
+  d.res.resets = w->bus.resets;
+  atomic_store(&w->resets, w->bus.resets);
+
+  if (w->speed_control)
+    I2C_speed_observe(&w->speed, reply_failed(&d.res));
+
+  worker_respond(w, &d);
+}
+
+/**
+  * Move the jobs from the main thread into the priority queues.
+  */
+void worker_collect(struct bus_worker *w) {
+  struct job job;
+
+  while (!spscq_pop(&w->in, &job)) {
+    if (!job_queue(w, &job))
+      continue;
+
+    struct done d;
+    memset(&d, 0, sizeof(d));
+    d.client = job.client;
+    d.gen = job.gen;
+    d.res.err = -EBUSY;
+    d.res.resets = w->bus.resets;
+    worker_respond(w, &d);
+  }
+}
+
+void *worker_run(void *arg) {
+  struct bus_worker *w = arg;
+
+  while (atomic_load(&w->run)) {
+    if (atomic_exchange(&w->dump_metrics, 0)) {
+      job_log_metrics(w);
+      if (w->speed_control)
+        I2C_speed_stats_log(&w->speed, w->path);
+    }
+
+    worker_collect(w);
+
+    // one transfer at a time, then check for more urgent requests
+    struct job job;
+    if (job_next(w, &job)) {
+      // skip the jobs of clients that have gone away
+      if (job.gen == atomic_load(&client_gen[job.client]))
+        execute_job(w, &job);
+      continue;
+    }
+
+    // nothing to do, sleep until the main thread has new jobs
+    uint64_t n;
+    read(w->wake, &n, sizeof(n));
+  }
+
+  return NULL;
+}
+
+void worker_wake(struct bus_worker *w) {
+  const uint64_t one = 1;
+  write(w->wake, &one, sizeof(one));
+}
+
+/**
+  * Open an adapter and start its worker thread.
+  * @return 0 on success, -1 on error (errno is set)
+  */
+int worker_start(struct bus_worker *w, const char *path, const char *trace,
+                 const bool recover, const uint8_t (*probes)[2], int nprobes) {
+  memset(w, 0, sizeof(*w));
+  w->path = path;
+  if (sscanf(path, "/dev/i2c-%d", &w->adapter) != 1)
+    w->adapter = -1;
+
+  if (I2C_bus_open(&w->bus, path))
+    return -1;
+
+  if (trace) {
+    if (I2C_trace_start(&w->bus, trace))
+      syslog(LOG_WARNING, "Error %d on starting the I2C trace %s.", errno, trace);
+    else
+      syslog(LOG_INFO, "Recording all transfers on %s to %s.", path, trace);
+  }
+
+  // the pi-hat pins are only known for bus 1
+  if (recover && (w->adapter == 1)) {
+    if (I2C_recovery_init(&w->bus, &I2C_recovery_pihat))
+      syslog(LOG_WARNING, "Error %d on enabling the bus recovery on %s.",
+                          errno, path);
+    else
+      syslog(LOG_INFO, "Bus recovery enabled on %s.", path);
+  }
+
+  // calibrate the speed before any client uses the bus
+  if (nprobes && (w->adapter >= 0)) {
+    if (I2C_speed_open(&w->speed, w->adapter, &I2C_speed_default))
+      syslog(LOG_WARNING, "Error %d on enabling the speed control on %s.",
+                          errno, path);
+    else {
+      struct I2C_speed_probe p[MAX_PROBES];
+      int i;
+      for (i = 0; i < nprobes; i++) {
+        p[i].dev = I2C_get_device(w, probes[i][0]);
+        p[i].send = probes[i][1];
+      }
+      I2C_speed_calibrate(&w->speed, p, nprobes);
+      w->speed_control = true;
+    }
+  }
+
+  spscq_init(&w->in, w->in_slots, sizeof(struct job), HANDOFF_SIZE);
+  spscq_init(&w->out, w->out_slots, sizeof(struct done), HANDOFF_SIZE);
+  atomic_init(&w->run, 1);
+  atomic_init(&w->dump_metrics, 0);
+  atomic_init(&w->resets, 0);
+
+  w->wake = eventfd(0, EFD_CLOEXEC);
+  if (w->wake < 0) {
+    const int err = errno;
+    I2C_bus_close(&w->bus);
+    errno = err;
+    return -1;
+  }
+
+  // signals are handled by the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  const int err = pthread_create(&w->thread, NULL, worker_run, w);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err) {
+    close(w->wake);
+    I2C_bus_close(&w->bus);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+  * Stop the worker thread, log its statistics and close the adapter.
+  */
+void worker_stop(struct bus_worker *w) {
+  atomic_store(&w->run, 0);
+  worker_wake(w);
+  pthread_join(w->thread, NULL);
+  close(w->wake);
+
+  job_log_metrics(w);
+  int i;
+  for (i = 0; i < 128; i++)
+    if (w->devs_used[i])
+      I2C_stats_log(&w->devs[i], w->path);
+  I2C_recovery_stats_log(&w->bus);
+  if (w->speed_control) {
+    I2C_speed_stats_log(&w->speed, w->path);
+    I2C_speed_close(&w->speed);
+  }
+  I2C_bus_close(&w->bus);
+}
+
+///// Clients /////
+
+/**
+  * A connected client, bound to the bus of the socket it came from
+  */
+struct client {
+  int fd;                       // -1 if the slot is free
+  int bus;                      // index in workers
+  unsigned int gen;             // see client_gen
+} clients[MAX_CLIENTS];
+
+/**
+  * Create the listening socket. The socket gets the group of the
+  * I2C adapter, so that everybody allowed to use the bus may use
+  * the daemon.
+  *
+  * @return the socket, exits on error
+  */
+int listen_socket(const char *path, const char *adapter) {
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    syslog(LOG_EMERG, "Error %d on socket creation!", errno);
+    exit(-1);
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+      listen(fd, MAX_CLIENTS)) {
+    syslog(LOG_EMERG, "Error %d on binding %s!", errno, path);
+    exit(-1);
+  }
+
+  struct stat st;
+  if (!stat(adapter, &st) && chown(path, -1, st.st_gid))
+    syslog(LOG_WARNING, "Could not change the group of %s.", path);
+  chmod(path, 0660);
+
+  return fd;
+}
+
+/**
+  * Send a response to a client. A client that has gone away is
+  * detected by the next poll.
+  */
+void send_response(const int fd, const struct i2cd_response *res) {
+  send(fd, res, sizeof(*res), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+  * Receive all pending requests of a client and hand them to the
+  * worker of its bus.
+  *
+  * @return 0 if the client is still alive, -1 if it should be dropped
+  */
+int receive_requests(const int c) {
+  struct client *cl = &clients[c];
+  struct bus_worker *w = &workers[cl->bus];
+  int queued = 0;
+
+  for (;;) {
+    struct job job;
+    const ssize_t n = recv(cl->fd, &job.req, sizeof(job.req), MSG_DONTWAIT);
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      break;
+    if (n <= 0)
+      return -1;
+
+    struct i2cd_response res;
+    memset(&res, 0, sizeof(res));
+    res.resets = atomic_load(&w->resets);
+
+    job.client = c;
+    job.gen = cl->gen;
+    job.queued = monotonic_usec();
+
+    if ((n != sizeof(job.req)) || (job.req.addr > 0x7f) ||
+        (job.req.len > I2CD_REPLY_MAX) || (job.req.prio >= I2CD_PRIO_LEVELS)) {
+      res.err = -EINVAL;
+      send_response(cl->fd, &res);
+    } else if (spscq_push(&w->in, &job)) {
+      res.err = -EBUSY;
+      send_response(cl->fd, &res);
+    } else
+      queued = 1;
+  }
+
+  if (queued)
+    worker_wake(w);
+  return 0;
+}
+
+/**
+  * Send the responses of all workers to their clients.
+  */
+void deliver_responses() {
+  uint64_t n;
+  read(done_fd, &n, sizeof(n));
+
+  int i;
+  for (i = 0; i < nworkers; i++) {
+    struct done d;
+    while (!spscq_pop(&workers[i].out, &d)) {
+      const struct client *cl = &clients[d.client];
+      // the client may have gone away in the meantime
+      if ((cl->fd >= 0) && (cl->gen == d.gen))
+        send_response(cl->fd, &d.res);
+    }
+  }
+}
+
+/**
+  * Release a client slot; its pending jobs will be skipped.
+  */
+void drop_client(const int c) {
+  close(clients[c].fd);
+  clients[c].fd = -1;
+  atomic_fetch_add(&client_gen[c], 1);
+}
+
+/**
+  * Accept a new client on the socket of a bus.
+  */
+void accept_client(const int lfd, const int bus) {
+  const int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+  if (cfd < 0)
+    return;
+
+  int c;
+  for (c = 0; c < MAX_CLIENTS; c++)
+    if (clients[c].fd < 0)
+      break;
+
+  if (c == MAX_CLIENTS) {
+    syslog(LOG_WARNING, "Too many clients, rejecting connection.");
+    close(cfd);
+    return;
+  }
+
+  clients[c].fd = cfd;
+  clients[c].bus = bus;
+  clients[c].gen = atomic_load(&client_gen[c]);
+}
+
+///// I3C INT relay /////
+
+struct I3C_int I3C_irq;
+
+// clients of I2CD_INT_SOCKET, -1 if the slot is free
+int int_clients[MAX_CLIENTS];
+
+/**
+  * Send an INT event to all relay clients. A client that does not read
+  * loses the event; its safety polls cover that.
+  */
+void relay_int_event(const struct i2cd_int_event *ev) {
+  int i;
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (int_clients[i] >= 0)
+      send(int_clients[i], ev, sizeof(*ev), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+  * Relay the pending edges of the INT line.
+  */
+void relay_int() {
+  const int ret = I3C_int_ack(&I3C_irq);
+  if (ret < 0)
+    return;
+
+  struct i2cd_int_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.event_ns = ret ? I3C_irq.event_ns : 0;
+  ev.active = I3C_irq.active;
+  relay_int_event(&ev);
+}
+
+/**
+  * Accept a new client on the INT relay socket and tell it the current
+  * level of the line.
+  */
+void accept_int_client(const int lfd) {
+  const int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+  if (cfd < 0)
+    return;
+
+  int c;
+  for (c = 0; c < MAX_CLIENTS; c++)
+    if (int_clients[c] < 0)
+      break;
+
+  if (c == MAX_CLIENTS) {
+    syslog(LOG_WARNING, "Too many INT clients, rejecting connection.");
+    close(cfd);
+    return;
+  }
+
+  int_clients[c] = cfd;
+
+  struct i2cd_int_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.active = I3C_irq.active;
+  send(cfd, &ev, sizeof(ev), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+int main(int argc, char *argv[]) {
+  const char *buses[MAX_BUSES];
+  int nbuses = 0;
+  const char *trace = NULL;
+  bool recover = true;
+  bool int_relay = true;
+  uint8_t probes[MAX_PROBES][2];
+  int nprobes = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:s:t:RIc:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (nbuses < MAX_BUSES)
+          buses[nbuses++] = optarg;
+        break;
+      case 's': I2CD_PATH = optarg; break;
+      case 't': trace = optarg; break;
+      case 'R': recover = false; break;
+      case 'I': int_relay = false; break;
+      case 'c': {
+        unsigned int addr, cmd;
+        if ((nprobes < MAX_PROBES) &&
+            (sscanf(optarg, "%i:%i", &addr, &cmd) == 2) &&
+            (addr < 128) && (cmd < 256)) {
+          probes[nprobes][0] = addr;
+          probes[nprobes++][1] = cmd;
+        }
+        break;
+      }
+      default:
+        fprintf(stderr, "Usage: %s [-b i2c-device]... [-s socket] [-t trace] [-R] [-I]\n"
+                        "       [-c addr:cmd]...\n",
+                        argv[0]);
+        return -1;
+    }
+  }
+  if (!nbuses)
+    buses[nbuses++] = I2C_BUS;
+
+  // initialize the system logging
+  openlog("i2cd", LOG_CONS | LOG_PID, LOG_USER);
+  syslog(LOG_INFO, "Starting I2C bus daemon on %d buses.", nbuses);
+
+  done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (done_fd < 0) {
+    syslog(LOG_EMERG, "Error %d on eventfd creation!", errno);
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+    int_clients[i] = -1;
+    atomic_init(&client_gen[i], 0);
+  }
+
+  // listening sockets, with the bus they serve
+  struct pollfd lfds[2*MAX_BUSES];
+  int lbus[2*MAX_BUSES];
+  char lpaths[2*MAX_BUSES][sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int nlisten = 0;
+
+  for (i = 0; i < nbuses; i++) {
+    char tpath[256];
+    if (trace && i)
+      snprintf(tpath, sizeof(tpath), "%s.%d", trace, i);
+
+    if (worker_start(&workers[i], buses[i], (trace && i) ? tpath : trace,
+                     recover, probes, i ? 0 : nprobes)) {
+      syslog(LOG_EMERG, "Error %d on I2C initialization of %s!", errno, buses[i]);
+      return -1;
+    }
+    nworkers++;
+
+    // the first bus keeps the common socket
+    if (!i) {
+      strncpy(lpaths[nlisten], I2CD_PATH, sizeof(lpaths[0]) - 1);
+      lpaths[nlisten][sizeof(lpaths[0]) - 1] = 0;
+      lbus[nlisten++] = i;
+    }
+    if (workers[i].adapter >= 0) {
+      snprintf(lpaths[nlisten], sizeof(lpaths[0]), I2CD_SOCKET_BUS,
+               workers[i].adapter);
+      lbus[nlisten++] = i;
+    }
+    syslog(LOG_INFO, "Serving %s.", buses[i]);
+  }
+
+  for (i = 0; i < nlisten; i++) {
+    lfds[i].fd = listen_socket(lpaths[i], workers[lbus[i]].path);
+    lfds[i].events = POLLIN;
+  }
+
+  // the clients fall back to polling without the relay
+  I3C_irq.fd = -1;
+  int int_lfd = -1;
+  if (int_relay) {
+    if (I3C_int_open(&I3C_irq, I3C_INT_CHIP, I3C_INT_LINE))
+      syslog(LOG_WARNING, "Error %d on I3C INT request, not relaying INT.",
+                          errno);
+    else
+      int_lfd = listen_socket(I2CD_INT_SOCKET, workers[0].path);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  while (run) {
+    if (dump_metrics) {
+      dump_metrics = 0;
+      for (i = 0; i < nworkers; i++) {
+        atomic_store(&workers[i].dump_metrics, 1);
+        worker_wake(&workers[i]);
+      }
+    }
+
+    // slot 0 are the responses, then the listening sockets and the
+    // clients, then the INT line, its relay socket and its clients
+    struct pollfd fds[1 + 2*MAX_BUSES + MAX_CLIENTS + 2 + MAX_CLIENTS];
+    int owner[1 + 2*MAX_BUSES + MAX_CLIENTS + 2 + MAX_CLIENTS];
+    int nfds = 0;
+
+    fds[nfds].fd = done_fd;
+    fds[nfds++].events = POLLIN;
+    for (i = 0; i < nlisten; i++)
+      fds[nfds++] = lfds[i];
+    for (i = 0; i < MAX_CLIENTS; i++)
+      if (clients[i].fd >= 0) {
+        owner[nfds] = i;
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds++].events = POLLIN;
+      }
+
+    // a negative fd is ignored by poll
+    const int nbus = nfds;
+    fds[nfds].fd = I3C_irq.fd;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = int_lfd;
+    fds[nfds++].events = POLLIN;
+    for (i = 0; i < MAX_CLIENTS; i++)
+      if (int_clients[i] >= 0) {
+        owner[nfds] = i;
+        fds[nfds].fd = int_clients[i];
+        fds[nfds++].events = POLLIN;
+      }
+
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "Error %d on poll.", errno);
+      break;
+    }
+
+    if (fds[0].revents & POLLIN)
+      deliver_responses();
+
+    // relay the INT edges to the clients
+    if (fds[nbus].revents & POLLIN)
+      relay_int();
+
+    // collect the requests of all clients
+    for (i = 1 + nlisten; i < nbus; i++)
+      if (fds[i].revents &&
+          (!(fds[i].revents & POLLIN) || receive_requests(owner[i])))
+        drop_client(owner[i]);
+
+    // accept new clients
+    for (i = 0; i < nlisten; i++)
+      if (fds[1 + i].revents & POLLIN)
+        accept_client(lfds[i].fd, lbus[i]);
+
+    // the INT clients never send, so any event is a hang-up
+    for (i = nbus + 2; i < nfds; i++)
+      if (fds[i].revents) {
+        close(int_clients[owner[i]]);
+        int_clients[owner[i]] = -1;
+      }
+    if (fds[nbus + 1].revents & POLLIN)
+      accept_int_client(int_lfd);
+  }
+
+  // clean-up
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd >= 0)
+      drop_client(i);
+  for (i = 0; i < nlisten; i++) {
+    close(lfds[i].fd);
+    unlink(lpaths[i]);
+  }
+
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (int_clients[i] >= 0)
+      close(int_clients[i]);
+  if (int_lfd >= 0) {
+    close(int_lfd);
+    unlink(I2CD_INT_SOCKET);
+  }
+  I3C_int_close(&I3C_irq);
+
+  for (i = 0; i < nworkers; i++)
+    worker_stop(&workers[i]);
+  close(done_fd);
+
+  syslog(LOG_INFO, "I2C bus daemon finished.");
+  closelog();
+
+  return 0;
+}
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -5,132 +7,374 @@
 #include <string.h>
 
 #include <time.h>
+#include <signal.h>
 #include <syslog.h>
 
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <sys/epoll.h>
+
+#include "../i2cbus/i2cbus.h"
+#include "../i2cbus/i2cproto.h"
+#include "../i2cbus/i2crecover.h"
+#include "../i2cbus/i3cint.h"
+#include "../i2cbus/evloop.h"
+#include "../i2cbus/mqttpub.h"
+#include "../i2cbus/blog.h"
+#include "../i2cbus/metrics.h"
+#include "../i2cbus/shmstate.h"
 
 #include <mosquitto.h>
 
+// the devices of the built-in table, see device_table_default
 #define I2C_ADDR_CONTROLLER 0x21
 #define I2C_ADDR_MANUAL     0x22
 
 const char* MQTT_HOST   = "platon";
 const int   MQTT_PORT   = 1883;
 const char* MQTT_TOPIC  = "Netz39/Things/Shuttercontrol/Button/Events";
+// undelivered messages are kept here during broker outages
+const char* MQTT_SPOOL  = "/var/spool/shuttercontrol.mqtt";
 
 #define MQTT_MSG_MAXLEN           16
 const char* MQTT_MSG_BTNPRESS   = "button pressed";
 const char* MQTT_MSG_NONE       = "none";
 
 /**
- * Get the milliseconds since epoch.
+ * Get the milliseconds on the monotonic clock, which is not affected
+ * by NTP or manual changes of the wall clock.
  */
 long current_millis() {
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-  
-  return tv.tv_sec*1000L + tv.tv_usec/1000L;
+  return (long)monotonic_millis();
 }
 
+///// Logging /////
+
+// binary log ring on tmpfs, see blog.h and blogdump
+const char* LOG_RING    = "/dev/shm/shuttercontrol.blog";
+
+///// Live state /////
+
+// the polled state for local readers, see shmstate.h and statedump
+const char* STATE_FILE  = "/dev/shm/shuttercontrol.state";
+
+struct shmstate state;
+struct shmstate_values state_values;
+
+///// Device table /////
+
+// the devices on the bus, see shuttercontrol.conf; changed with -f
+const char* DEVICE_TABLE = "/etc/shuttercontrol.conf";
+
+#define MAX_CONTROLLERS     4
+#define MAX_PANELS          4
+// shutters per controller and switches per panel, fixed by the firmware
+#define CONTROLLER_SHUTTERS 4
+#define PANEL_SWITCHES      4
+
+_Static_assert(MAX_CONTROLLERS*CONTROLLER_SHUTTERS <= SHMSTATE_SHUTTERS,
+               "the live state cannot hold all shutters");
+_Static_assert(MAX_PANELS*PANEL_SWITCHES <= SHMSTATE_SWITCHES,
+               "the live state cannot hold all switches");
+_Static_assert(MAX_PANELS <= SHMSTATE_PANELS,
+               "the live state cannot hold all panels");
+
+#define NO_CONTROLLER -1
+
+/**
+  * A shutter control unit.
+  */
+struct controller_t {
+  struct I2C_device dev;
+};
+
+/**
+  * The shutter moved by a switch of a manual control unit.
+  */
+struct switch_map_t {
+  int controller;   // index in the controller table or NO_CONTROLLER
+  char shutter;     // shutter on the controller, 1..CONTROLLER_SHUTTERS
+};
+
+/**
+  * A manual control unit with the state of its switches.
+  */
+struct panel_t {
+  struct I2C_device dev;
+  struct switch_map_t map[PANEL_SWITCHES];
+  char manual;                          // the known manual mode
+  char switch_state[PANEL_SWITCHES];
+  long switch_lastchange[PANEL_SWITCHES];
+  int events;                           // has the switch event FIFO:
+                                        // 1 yes, 0 no, -1 unknown
+  char event_synced;                    // event_seq is valid
+  uint8_t event_seq;                    // sequence number of the last event
+  char event_ack;                       // event_seq not acknowledged yet
+  int event_fails;                      // failed FIFO reads in a row
+};
+
+///// Metrics /////
+
+// Prometheus endpoint on the loopback interface
+const int METRICS_PORT  = 9721;
+
+unsigned long polls_int   = 0;  // polls after an I3C interrupt
+unsigned long polls_timer = 0;  // polls by the timer
+struct metrics_histogram poll_lateness;  // timer wake-up after its deadline
+long long poll_deadline = 0;    // monotonic usec the poll timer is due
+unsigned long switch_events = 0;        // switch events read from the panels
+unsigned long switch_events_missed = 0; // lost, by sequence number gaps
+
 ///// I2C stuff /////
 
+// adapter number N of /dev/i2c-N, changed with -b
+int I2C_ADAPTER = 1;
+
+// the socket of i2cd for the adapter, or the adapter itself
+char I2C_SOCKET[64];
+char I2C_BUS[64];
+
+// environment variables to record all transfers to a trace file, or to
+// replay one instead of using the bus (see i2ctrace.h)
+#define I2C_ENV_TRACE        "I2C_TRACE"
+#define I2C_ENV_REPLAY       "I2C_REPLAY"
+#define I2C_ENV_REPLAY_SPEED "I2C_REPLAY_SPEED"
+
+struct I2C_bus I2C_bus;
+
+/**
+  * This record contains the I2C devices we use in this program
+  */
+struct I2C_devices {
+  struct controller_t controller[MAX_CONTROLLERS];
+  int controllers;
+  struct panel_t panel[MAX_PANELS];
+  int panels;
+} I2C_dev;
+
 /**
-  * This record contains the I2C file descriptors we use in this program
+  * The built-in table: one controller and one manual control unit,
+  * switch n moves shutter n.
   */
-struct I2C_descriptors {
-  int controller;
-  int manual;
-} I2C_fd;
+void device_table_default() {
+  int i;
+
+  I2C_dev.controllers = 1;
+  I2C_dev.controller[0].dev.addr = I2C_ADDR_CONTROLLER;
 
-#define I2C_FD_CONTROLLER (I2C_fd.controller)
-#define I2C_FD_MANUAL     (I2C_fd.manual)
+  I2C_dev.panels = 1;
+  I2C_dev.panel[0].dev.addr = I2C_ADDR_MANUAL;
+  for (i = 0; i < PANEL_SWITCHES; i++) {
+    I2C_dev.panel[0].map[i].controller = 0;
+    I2C_dev.panel[0].map[i].shutter = i+1;
+  }
+}
 
 /**
-  * Initialize an I2C channel to the specified address. Exits with an error
-  * message if the initialization fails,
-  *
-  * @param addr The target address.
-  * @return File Descriptor for the I2C channel
+  * Find a controller in the table.
+  * @return the index or NO_CONTROLLER
   */
-int I2C_setup_fd(const int addr) {
-  const int fd = wiringPiI2CSetup(addr);
-  if (!fd) {
-    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
+int find_controller(const long addr) {
+  int i;
+  for (i = 0; i < I2C_dev.controllers; i++)
+    if (I2C_dev.controller[i].dev.addr == addr)
+      return i;
+  return NO_CONTROLLER;
+}
+
+/**
+  * Parse the address field of a table line.
+  * @return the address or -1 if it is not a valid 7 bit address
+  */
+long parse_address(const char *s) {
+  char *end;
+  const long addr = s ? strtol(s, &end, 0) : -1;
+
+  return (s && !*end && (addr >= 0x03) && (addr <= 0x77)) ? addr : -1;
+}
+
+/**
+  * Parse a switch mapping: "<controller address>:<shutter>", or "-" for
+  * a switch without a shutter.
+  * @return 0 on success, -1 on error
+  */
+int parse_switch_map(const char *s, struct switch_map_t *map) {
+  map->controller = NO_CONTROLLER;
+  map->shutter = 0;
+  if (!strcmp(s, "-"))
+    return 0;
+
+  char *end;
+  const long addr = strtol(s, &end, 0);
+  if (*end != ':')
+    return -1;
+  const long shutter = strtol(end+1, &end, 0);
+  if (*end || (shutter < 1) || (shutter > CONTROLLER_SHUTTERS))
+    return -1;
+
+  map->controller = find_controller(addr);
+  map->shutter = shutter;
+  return (map->controller == NO_CONTROLLER) ? -1 : 0;
+}
+
+/**
+  * Load the device table. Each line is one of
+  *   controller <address>
+  *   panel <address> <switch 1> ... <switch 4>
+  * with switch mappings as in parse_switch_map. Controllers must be
+  * listed before the panels that use them; missing switches are
+  * unassigned. Empty lines and lines starting with # are ignored.
+  * @return 0 on success, -1 if the file cannot be read (errno is set),
+  *         or the number of the first invalid line
+  */
+int device_table_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  I2C_dev.controllers = 0;
+  I2C_dev.panels = 0;
+
+  char line[256];
+  int n = 0;
+  int err = 0;
+  while (!err && fgets(line, sizeof(line), f)) {
+    n++;
+    char *save;
+    const char *kind = strtok_r(line, " \t\r\n", &save);
+    if (!kind || (kind[0] == '#'))
+      continue;
+
+    const long addr = parse_address(strtok_r(NULL, " \t\r\n", &save));
+    if (addr < 0)
+      err = n;
+    else if (!strcmp(kind, "controller") &&
+             (I2C_dev.controllers < MAX_CONTROLLERS) &&
+             (find_controller(addr) == NO_CONTROLLER))
+      I2C_dev.controller[I2C_dev.controllers++].dev.addr = addr;
+    else if (!strcmp(kind, "panel") && (I2C_dev.panels < MAX_PANELS)) {
+      struct panel_t *p = &I2C_dev.panel[I2C_dev.panels++];
+      p->dev.addr = addr;
+
+      int i;
+      for (i = 0; i < PANEL_SWITCHES; i++) {
+        const char *map = strtok_r(NULL, " \t\r\n", &save);
+        if (parse_switch_map(map ? map : "-", &p->map[i]))
+          err = n;
+      }
+    } else
+      err = n;
+  }
+
+  fclose(f);
+  return err;
+}
+
+/**
+  * Load the device table, or use the built-in one if there is no table
+  * file, and initialize all devices. Exits with an error message if
+  * the table is invalid.
+  */
+void devices_init() {
+  const int ret = device_table_load(DEVICE_TABLE);
+  if (ret > 0) {
+    syslog(LOG_EMERG, "Invalid device table %s, line %d!", DEVICE_TABLE, ret);
     exit(-1);
   }
-  return fd;
+  if (ret < 0) {
+    syslog(LOG_NOTICE, "No device table at %s (error %d), using the defaults.",
+                       DEVICE_TABLE, errno);
+    device_table_default();
+  }
+
+  int i;
+  for (i = 0; i < I2C_dev.controllers; i++) {
+    struct controller_t *c = &I2C_dev.controller[i];
+    I2C_device_init(&c->dev, &I2C_bus, c->dev.addr);
+    // the shutter controllers only get user-triggered commands
+    c->dev.prio = I2CD_PRIO_USER;
+  }
+  for (i = 0; i < I2C_dev.panels; i++) {
+    struct panel_t *p = &I2C_dev.panel[i];
+    I2C_device_init(&p->dev, &I2C_bus, p->dev.addr);
+    p->events = -1;
+    p->event_synced = 0;
+    p->event_ack = 0;
+    p->event_fails = 0;
+  }
+
+  syslog(LOG_INFO, "Using %d shutter controllers and %d manual control units.",
+                   I2C_dev.controllers, I2C_dev.panels);
 }
 
 /**
-  * Initialize all I2C channels and store the file descriptors.
+  * Connect to the I2C bus daemon, or open the I2C bus if the daemon is
+  * not running, and initialize all devices. Exits with an error
+  * message if the initialization fails.
   */
 void I2C_init(void) {
-  I2C_fd.controller = I2C_setup_fd(I2C_ADDR_CONTROLLER);
-  I2C_fd.manual     = I2C_setup_fd(I2C_ADDR_MANUAL);
-}
+  snprintf(I2C_SOCKET, sizeof(I2C_SOCKET), I2CD_SOCKET_BUS, I2C_ADAPTER);
+  snprintf(I2C_BUS, sizeof(I2C_BUS), "/dev/i2c-%d", I2C_ADAPTER);
 
-#define I2C_ERR_INVALIDARGUMENT -2
+  // answer the transfers from a recorded trace, for offline tests
+  const char *replay = getenv(I2C_ENV_REPLAY);
+  const char *speed = getenv(I2C_ENV_REPLAY_SPEED);
 
-  union I2C_result {
-    unsigned char c[2];
-    unsigned short r;
-  };
+  if (replay) {
+    if (I2C_replay_open(&I2C_bus, replay, speed ? atof(speed) : 1.0)) {
+      syslog(LOG_EMERG, "Error %d on opening the I2C trace %s!", errno, replay);
+      exit(-1);
+    }
+    syslog(LOG_INFO, "Replaying the I2C trace %s.", replay);
+  } else if (!I2C_bus_open(&I2C_bus, I2C_SOCKET))
+    syslog(LOG_INFO, "Using the I2C bus daemon at %s.", I2C_SOCKET);
+  else if (I2C_bus_open(&I2C_bus, I2C_BUS)) {
+    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
+    exit(-1);
+  } else if ((I2C_ADAPTER == 1) &&
+             I2C_recovery_init(&I2C_bus, &I2C_recovery_pihat))
+    // without i2cd, this daemon frees a stuck bus itself
+    syslog(LOG_WARNING, "Error %d on enabling the bus recovery.", errno);
 
+  const char *trace = getenv(I2C_ENV_TRACE);
+  if (trace && I2C_trace_start(&I2C_bus, trace))
+    syslog(LOG_WARNING, "Error %d on starting the I2C trace %s.", errno, trace);
 
-int I2C_command(const int fd, const char command, const char data) {
-  // check parameter range
-  if ((command < 0) || (command > 0x07))
-    return I2C_ERR_INVALIDARGUMENT;
-  if ((data < 0) || (data > 0x0f))
-    return I2C_ERR_INVALIDARGUMENT;
-  
-  // TODO check fd
-  
-    
-  // build the I2C data byte
-  // arguments have been checked, 
-  // this cannot be negative or more than 8 bits
-  unsigned char send = (command << 4) + data; 
-  
-  // calculate the parity
-  char v = send;
-  char c;
-  for (c = 0; v; c++) 
-    v &= v-1;
-  c &= 1;
-
-  // set parity bit  
-  send += (c << 7);
-  
-  union I2C_result result;
-  result.r = 0;
-
-  // maximal number of tries
-  int hops=20;
-
-  // try for hops times until the result is not zero
-  while (!result.c[0] && --hops) {
-    // send command
-    result.r = wiringPiI2CReadReg16(fd, send);
-
-    // check for transmission errors: 2nd byte is inverted 1st byte
-    const unsigned char c = ~result.c[0];
-    if (result.c[1] != c) 
-      // if no match, reset the result
-      result.r = 0;
-  }
-  
-  if (!hops)
-    syslog(LOG_DEBUG, "Giving up transmission!\n");
-  
-  return result.c[0];
+  devices_init();
 }
 
+/*
+ * Shadow slots for the idempotent settings, see I2C_command_shadow.
+ * The controllers use one slot per shutter (index-1).
+ */
+#define SHADOW_MANUAL_LED   0
+#define SHADOW_MANUAL_MODE  1
+
 ///// I3C stuff /////
 
-void I3C_reset_manual() {
-  I2C_command(I2C_FD_MANUAL, 0x4, 0x0);
+const char* I3C_INT_CHIP = "/dev/gpiochip0";
+const int   I3C_INT_LINE = 17;  // BCM GPIO17, INT on the pi-hat
+
+// poll interval without a working INT line
+#define POLL_FALLBACK_MS  1000
+// safety poll interval, in case an INT event has been missed
+#define POLL_SAFETY_MS    5000
+// poll interval while the shared INT line is held low by another device
+#define POLL_INT_BUSY_MS   200
+
+struct I3C_int I3C_irq;
+
+/**
+  * Get the I3C INT edges: from i2cd, which owns the line, or from the
+  * line itself without the daemon.
+  * @return 0 on success, -1 on error (errno is set)
+  */
+int I3C_init(void) {
+  if (I2C_bus.sock)
+    return I3C_int_connect(&I3C_irq, I2CD_INT_SOCKET);
+  return I3C_int_open(&I3C_irq, I3C_INT_CHIP, I3C_INT_LINE);
+}
+
+void I3C_reset_manual(struct panel_t *p) {
+  I2C_command(&p->dev, 0x4, 0x0);
 }
 
 ///// Manual Controll unit /////
@@ -149,13 +393,13 @@ void I3C_reset_manual() {
   *	Switch state according to SWITCH_XXX, SWITCH_ERR if an error
   *	occurred.
   */
-char read_switch_state(const char idx) {
+char read_switch_state(struct panel_t *p, const char idx) {
   // check parameter range
-  if ((idx < 1) || (idx > 4))
+  if ((idx < 1) || (idx > PANEL_SWITCHES))
     return SWITCH_ERR_OUTOFBOUNDS;
 
   // send the command    
-  const char state = I2C_command(I2C_FD_MANUAL, 0x3, idx);
+  const char state = I2C_command(&p->dev, 0x3, idx);
   
   // return result
   return state;  
@@ -165,8 +409,8 @@ char read_switch_state(const char idx) {
   * Beep in the provided pattern.
   * @param The beep pattern. Only the last 4 Bits are evaluated!
   */
-void beep(const char pattern) {
-  I2C_command(I2C_FD_MANUAL, 0x1, pattern&0xf);
+void beep(struct panel_t *p, const char pattern) {
+  I2C_command(&p->dev, 0x1, pattern&0xf);
 }
 
 #define LED_PATTERN_OFF  0x00
@@ -178,19 +422,188 @@ void beep(const char pattern) {
   * Set manual mode LED to the specified blink pattern.
   * @param pattern The blink pattern; one of LED_PATTERN_XXX.
   */
-void set_manual_mode_led(const char pattern) {
-  I2C_command(I2C_FD_MANUAL, 0x2, pattern);
+void set_manual_mode_led(struct panel_t *p, const char pattern) {
+  I2C_command_shadow(&p->dev, SHADOW_MANUAL_LED, 0x2, pattern);
 }
 
-char get_manual_mode() {
-  return I2C_command(I2C_FD_MANUAL, 0x5, 0);
+char get_manual_mode(struct panel_t *p) {
+  return I2C_command(&p->dev, 0x5, 0);
 }
 
 #define MANUAL_MODE_ON  1
 #define MANUAL_MODE_OFF 2
 
-void set_manual_mode(const char mode) {
-  I2C_command(I2C_FD_MANUAL, 0x5, mode);
+void set_manual_mode(struct panel_t *p, const char mode) {
+  I2C_command_shadow(&p->dev, SHADOW_MANUAL_MODE, 0x5, mode);
+}
+
+/**
+  * Status of the manual control unit, as read with one transaction.
+  */
+struct manual_status_t {
+  uint8_t switch_array;   // Switch Array Status
+  uint8_t block_switch;   // Block Switch Status
+  uint8_t output_status;  // Output Status Byte
+};
+
+#define MANUAL_STATUS_ACK_I3C 0x1
+
+/**
+  * Read the complete status of the manual control unit.
+  * @param st Status record to fill.
+  * @param flags MANUAL_STATUS_ACK_I3C to reset the I3C interrupt.
+  * @return 0 if everything is okay, otherwise SWITCH_ERR
+  */
+char read_manual_status(struct panel_t *p, struct manual_status_t *st,
+                        const char flags) {
+  uint8_t result[4];
+
+  if (I2C_command_block(&p->dev, 0x6, flags, result, 4))
+    return SWITCH_ERR;
+
+  st->switch_array  = result[1];
+  st->block_switch  = result[2];
+  st->output_status = result[3];
+
+  return 0;
+}
+
+/**
+  * Resync the shadowed settings of the manual control unit with a
+  * status record: settings the device does not report as expected have
+  * been changed by a reset or by another client.
+  */
+void sync_manual_shadow(struct panel_t *p, const struct manual_status_t *st,
+                        const char manual_changed) {
+  char cmd, data;
+
+  // block switch LED pattern, bits 0 and 1 of the OSB
+  if (I2C_shadow_get(&p->dev, SHADOW_MANUAL_LED, &cmd, &data) &&
+      (data != (st->output_status & 0x03)))
+    I2C_shadow_invalidate(&p->dev, SHADOW_MANUAL_LED);
+
+  // the manual mode key toggles the mode on the device
+  if (manual_changed)
+    I2C_shadow_invalidate(&p->dev, SHADOW_MANUAL_MODE);
+}
+
+/**
+  * Get the manual mode from a status record.
+  * @return MANUAL_MODE_ON or MANUAL_MODE_OFF
+  */
+char decode_manual_mode(const struct manual_status_t *st) {
+  return (st->block_switch & 0x01) ? MANUAL_MODE_ON : MANUAL_MODE_OFF;
+}
+
+/**
+  * Get the state of the specified switch from a Switch Array Status.
+  * @return
+  *	Switch state according to SWITCH_XXX, SWITCH_ERR_OUTOFBOUNDS if
+  *	the index is invalid.
+  */
+char decode_switch_array(const uint8_t switch_array, const char idx) {
+  // switch array bit masks for up and down, see the firmware
+  static const uint8_t up[4]   = {0x10, 0x20, 0x40, 0x01};
+  static const uint8_t down[4] = {0x08, 0x04, 0x02, 0x80};
+
+  // check parameter range
+  if ((idx < 1) || (idx > PANEL_SWITCHES))
+    return SWITCH_ERR_OUTOFBOUNDS;
+
+  if (switch_array & up[idx-1])
+    return SWITCH_UP;
+  if (switch_array & down[idx-1])
+    return SWITCH_DOWN;
+  return SWITCH_NEUTRAL;
+}
+
+/**
+  * Get the state of the specified switch from a status record.
+  * @return
+  *	Switch state according to SWITCH_XXX, SWITCH_ERR_OUTOFBOUNDS if
+  *	the index is invalid.
+  */
+char decode_switch_state(const struct manual_status_t *st, const char idx) {
+  return decode_switch_array(st->switch_array, idx);
+}
+
+#define MANUAL_EVENTS_LEN  15
+#define MANUAL_EVENTS_MAX  3
+#define MANUAL_EVENT_FIFO  8
+// data of the events command: acknowledge the events up to the one whose
+// sequence number ends with these bits
+#define MANUAL_EVENTS_ACK      0x8
+#define MANUAL_EVENTS_ACK_SEQ  0x6
+// the status is used instead after this many failed FIFO reads in a row
+#define MANUAL_EVENT_FAILS_MAX 3
+// firmware tick of the event time stamps
+#define MANUAL_TICK_USEC   1024
+
+/**
+  * A change of the switch array, from the event FIFO of the manual
+  * control unit.
+  */
+struct switch_event_t {
+  uint8_t switch_array;   // Switch Array Status after the change
+  long millis;            // time of the change, see current_millis
+};
+
+/**
+  * Tell if the manual control unit has the switch event FIFO. A firmware
+  * without it answers the unknown command with 0 and its inversion. The
+  * probe does not acknowledge any event.
+  * @return 1 yes, 0 no, -1 if the reply is not conclusive
+  */
+int probe_switch_events(struct panel_t *p) {
+  const int send = I2C_build_command(0x7, 0);
+  uint8_t r[2];
+
+  if (I2C_transfer(&p->dev, send, r, 2) || (r[1] != (uint8_t)~r[0]))
+    return -1;
+
+  if (r[0] == 0)
+    return 0;
+  return (r[0] == 1) ? 1 : -1;
+}
+
+/**
+  * Get up to MANUAL_EVENTS_MAX events from the switch event FIFO of the
+  * manual control unit. The event times are converted to our clock.
+  * @param ev      Receives the events, oldest first.
+  * @param n       Receives the number of events.
+  * @param seq     Receives the sequence number of the first event, or of
+  *                the next one if there is none.
+  * @param queued  Receives the number of events in the FIFO, including
+  *                the received ones.
+  * @param flags   MANUAL_STATUS_ACK_I3C to reset the switch interrupt
+  *                when the FIFO is empty, MANUAL_EVENTS_ACK and the
+  *                sequence number bits to remove the handled events.
+  * @return 0 if everything is okay, otherwise SWITCH_ERR
+  */
+char read_switch_events(struct panel_t *p, struct switch_event_t *ev, int *n,
+                        uint8_t *seq, int *queued, const char flags) {
+  uint8_t r[MANUAL_EVENTS_LEN];
+
+  if (I2C_command_block(&p->dev, 0x7, flags, r, MANUAL_EVENTS_LEN) ||
+      (r[2] > MANUAL_EVENTS_MAX))
+    return SWITCH_ERR;
+
+  const long now = current_millis();
+  const uint16_t tick_now = r[4] | (r[5] << 8);
+
+  *seq = r[1];
+  *n = r[2];
+  *queued = r[3];
+
+  int i;
+  for (i = 0; i < *n; i++) {
+    const uint8_t *e = &r[6 + 3*i];
+    const uint16_t age = tick_now - (e[1] | (e[2] << 8));
+    ev[i].switch_array = e[0];
+    ev[i].millis = now - (long)age * MANUAL_TICK_USEC / 1000;
+  }
+
+  return 0;
 }
 
 ///// Shutter Control unit /////
@@ -204,13 +617,15 @@ void set_manual_mode(const char mode) {
 
 /**
   * Set the shutter control state.
+  * @param c The shutter control unit
   * @param idx Number of the shutter, between 1 and 4
   * @param state One of SHUTTER_XXX.
   * @return 0 if everything is okay, otherwise one of SHUTTER_ERR_XXX
   */
-char set_shutter_state(const char idx, const char state) {
+char set_shutter_state(struct controller_t *c, const char idx,
+                       const char state) {
   // check parameter range
-  if ((idx < 1) || (idx > 4))
+  if ((idx < 1) || (idx > CONTROLLER_SHUTTERS))
     return SHUTTER_ERR_OUTOFBOUNDS;
   if ((state < 0) || (state > 2))
     return SHUTTER_ERR_OUTOFBOUNDS;  
@@ -228,62 +643,104 @@ char set_shutter_state(const char idx, const char state) {
     }
   }
 
-  // send the command    
-  I2C_command(I2C_FD_CONTROLLER, command, idx-1);
+  // send the command, unless the shutter is already in this state
+  I2C_command_shadow(&c->dev, idx-1, command, idx-1);
+  state_values.shutter_state[(c - I2C_dev.controller)*CONTROLLER_SHUTTERS
+                             + idx-1] = state;
 
   // return OK
   return 0;
 }
 
 /**
-  * Stop all the shutters!
+  * Stop all the shutters on all controllers!
   */
 void stop_all_shutters() {
-  I2C_command(I2C_FD_CONTROLLER, 0x0, 0x0);
+  int i;
+  for (i = 0; i < I2C_dev.controllers; i++) {
+    struct controller_t *c = &I2C_dev.controller[i];
+    const int ret = I2C_command_prio(&c->dev, I2CD_PRIO_SAFETY, 0x0, 0x0);
+
+    // all shutters are off now
+    int idx;
+    for (idx=1; idx<=CONTROLLER_SHUTTERS; idx++) {
+      if (ret > 0)
+        I2C_shadow_store(&c->dev, idx-1, 0x1, idx-1, ret);
+      else
+        I2C_shadow_invalidate(&c->dev, idx-1);
+      state_values.shutter_state[i*CONTROLLER_SHUTTERS + idx-1] =
+        (ret > 0) ? SHUTTER_OFF : SHMSTATE_UNKNOWN;
+    }
+  }
 }
 
+/**
+  * Set the state of the shutter a switch is mapped to, if any.
+  */
+void set_switch_shutter(struct panel_t *p, const char idx, const char state) {
+  const struct switch_map_t *map = &p->map[idx-1];
+
+  if (map->controller != NO_CONTROLLER)
+    set_shutter_state(&I2C_dev.controller[map->controller], map->shutter,
+                      state);
+}
 
-char switch_state[4];
-long switch_lastchange[4];
 
 /**
-  * Set stored switch states to NEUTRAL.
+  * Set stored switch states of all panels to NEUTRAL.
   */
 void clear_stored_switch_state() {
   const long t = current_millis();
-  int i;
-  for (i=0; i < 4; i++) {
-    switch_state[i] = SWITCH_NEUTRAL;
-    switch_lastchange[i] = t;
-  }
+  int i, p;
+  for (p=0; p < I2C_dev.panels; p++)
+    for (i=0; i < PANEL_SWITCHES; i++) {
+      I2C_dev.panel[p].switch_state[i] = SWITCH_NEUTRAL;
+      I2C_dev.panel[p].switch_lastchange[i] = t;
+    }
+}
+
+/**
+  * Tell if all stored switch states of all panels are NEUTRAL.
+  */
+char switches_neutral() {
+  int i, p;
+  for (p=0; p < I2C_dev.panels; p++)
+    for (i=0; i < PANEL_SWITCHES; i++)
+      if (I2C_dev.panel[p].switch_state[i] != SWITCH_NEUTRAL)
+        return 0;
+  return 1;
 }
 
 /**
   * Store a new switch state.
   * Return old state if there was a change.
+  * @param now  time of the change, see current_millis
   * @return the old state or 0 if there was no change
   */
-char store_switch_state(const char idx, const char state) {
-  const char old_state = switch_state[idx-1];
+char store_switch_state(struct panel_t *p, const char idx, const char state,
+                        const long now) {
+  const char old_state = p->switch_state[idx-1];
   
   if (old_state == state)
     return 0;
 
-  switch_lastchange[idx-1] = current_millis();  
+  p->switch_lastchange[idx-1] = now;  
     
-  switch_state[idx-1] = state;
+  p->switch_state[idx-1] = state;
   return old_state;
 }
 
 /**
   * Adjust the switch state in state storage and controller,
   * but only if there was a change.
+  * @param now  time of the switch state, see current_millis
   */
-void adjust_switch_state(const char idx, const char state) {
+void adjust_switch_state(struct panel_t *p, const char idx, const char state,
+                         const long now) {
   // time since last change
   const long delay = 2*1000;
   const long rundelay = 60*1000;
-  const long lastchange = current_millis() - switch_lastchange[idx-1];
+  const long lastchange = now - p->switch_lastchange[idx-1];
 
   // only if rundelay not exceeded; 
   // after a while the shutter will be unlocked no matter what
@@ -296,166 +753,488 @@ void adjust_switch_state(const char idx, const char state) {
 
     // lock switch if it is hold for longer than 2 secs
     if ((state != SWITCH_NEUTRAL) &&
-        (switch_state[idx-1] == state) &&
+        (p->switch_state[idx-1] == state) &&
         (lastchange > delay)) {
-        syslog(LOG_NOTICE, "Locking %d.\n", idx);
-        beep(0x1);
+        BLOG(LOG_NOTICE, BLOG_SWITCH_LOCK, p->dev.addr, idx);
+        beep(p, 0x1);
         return;
     }
 
   }
             
   // store new state and check if a change occured
-  const char st = store_switch_state(idx, state);
+  const char st = store_switch_state(p, idx, state, now);
 
   if (st) {
     // if locked, just turn off
     if (lastchange > delay) {
-      syslog(LOG_NOTICE, "Shutting %d off.\n", idx);
-      set_shutter_state(idx, SHUTTER_OFF);
-      store_switch_state(idx, SWITCH_NEUTRAL);
+      BLOG(LOG_NOTICE, BLOG_SWITCH_OFF, p->dev.addr, idx);
+      set_switch_shutter(p, idx, SHUTTER_OFF);
+      store_switch_state(p, idx, SWITCH_NEUTRAL, now);
     } else {
-      syslog(LOG_NOTICE, "Changing switch state for %d to %d.\n", idx, state);
+      BLOG(LOG_NOTICE, BLOG_SWITCH_CHANGE, p->dev.addr, idx, state);
     
       // commit the action only if the state has changed.
       switch (state) {
-        case SWITCH_NEUTRAL: set_shutter_state(idx, SHUTTER_OFF); break;
-        case SWITCH_UP: set_shutter_state(idx, SHUTTER_UP); break;
-        case SWITCH_DOWN: set_shutter_state(idx, SHUTTER_DOWN); break;
+        case SWITCH_NEUTRAL: set_switch_shutter(p, idx, SHUTTER_OFF); break;
+        case SWITCH_UP: set_switch_shutter(p, idx, SHUTTER_UP); break;
+        case SWITCH_DOWN: set_switch_shutter(p, idx, SHUTTER_DOWN); break;
       }
     } // if-else  
   }
 }
 
 
-int main(int argc, char *argv[]) {
-  // initialize the system logging
-  openlog("shuttercontrol", LOG_CONS | LOG_PID, LOG_USER);
-  syslog(LOG_INFO, "Starting shuttercontrol.");
+///// Event handling /////
 
-  I2C_init();
-  stop_all_shutters();
-  clear_stored_switch_state();
-  beep(0x05);
-  set_manual_mode_led(LED_PATTERN_FAST);
-  sleep(1);
-  set_manual_mode_led(LED_PATTERN_OFF);
+// publisher thread, which owns the mosquitto client
+struct mqtt_pub mqtt;
+int mqtt_running = 0;
+
+struct evloop loop;
+
+struct evloop_handler ev_int;       // I3C INT line
+struct evloop_handler ev_poll;      // poll timer for switch locks and safety
+struct evloop_handler ev_signal;    // SIGINT, SIGTERM
+
+/**
+  * Handle the status of a manual control unit: emit MQTT messages and
+  * adjust the shutters according to the switches.
+  * @param p   the panel
+  * @param ms  its status of this poll
+  * @param i   number of the poll
+  */
+void panel_update(struct panel_t *p, const struct manual_status_t *ms,
+                  const int i) {
+  char mqtt_payload[MQTT_MSG_MAXLEN];
+
+  const char manual = decode_manual_mode(ms);
+  BLOG(LOG_DEBUG, BLOG_MANUAL_MODE, i, p->dev.addr, manual);
+
+  sync_manual_shadow(p, ms, manual != p->manual);
+  
+/*
+  if (manual == MANUAL_MODE_ON)
+    set_manual_mode_led(p, LED_PATTERN_ON);
+  else
+    set_manual_mode_led(p, LED_PATTERN_OFF);
+*/
  
-  // initialize MQTT   
-  mosquitto_lib_init();
+  // reset MQTT payload
+  mqtt_payload[0] = 0;
+
+  // if manual mode changed, send MQTT event
+  if (manual != p->manual) {
+    // prepare MQTT payload
+    strcpy(mqtt_payload, MQTT_MSG_BTNPRESS);
   
-  void *mqtt_obj;
-  struct mosquitto *mosq;
-  mosq = mosquitto_new("shuttercontrol", true, mqtt_obj);
-  if ((int)mosq == ENOMEM) {
-    syslog(LOG_ERR, "Not enough memory to create a new mosquitto session.");
-    mosq = NULL;
+    // store
+    p->manual = manual;
   }
-  if ((int)mosq == EINVAL) {
-    syslog(LOG_ERR, "Invalid values for creating mosquitto session.");
-    return -1;
+ 
+  // queue MQTT message if there is payload; the publisher thread sends it
+  if (mqtt_payload[0] && mqtt_running)
+    mqtt_pub_send(&mqtt, MQTT_TOPIC, mqtt_payload,
+                  2, /* qos */
+                  false /* do not retain the event */);
+
+  const int panel = p - I2C_dev.panel;
+  int idx;
+  for (idx=1; idx<=PANEL_SWITCHES; idx++) {
+    const char sw = decode_switch_state(ms, idx);
+    BLOG(LOG_DEBUG, BLOG_SWITCH_STATUS, p->dev.addr, idx, sw);
+    state_values.switch_state[panel*PANEL_SWITCHES + idx-1] = sw;
+
+    adjust_switch_state(p, idx, sw, current_millis());
   }
 
-  if (mosq) {
-    int ret; 
-    
-    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 30);
-    if (ret == MOSQ_ERR_SUCCESS)
-      syslog(LOG_INFO, "MQTT connection to %s established.", MQTT_HOST);
-      
-    // TODO error handling
+  state_values.manual_mode[panel] = manual;
+}
+
+/**
+  * Read all queued switch events of a manual control unit and handle
+  * each change at the time it happened, so a switch flicked between two
+  * polls is seen and the hold time of a switch is exact.
+  *
+  * Each read acknowledges the events handled before, so events are only
+  * removed from the FIFO after they have been handled; a failed read is
+  * simply repeated. Events dropped by a full FIFO are counted from the
+  * gaps in the sequence numbers.
+  * @param p     the panel
+  * @param last  receives the Switch Array Status of the last event
+  * @return the number of events, or -1 on an error
+  */
+int panel_drain_events(struct panel_t *p, uint8_t *last) {
+  int total = 0;
+
+  // the full FIFO and the empty reply, plus events arriving meanwhile
+  int round;
+  for (round = 0; round <= MANUAL_EVENT_FIFO / MANUAL_EVENTS_MAX + 1; round++) {
+    struct switch_event_t ev[MANUAL_EVENTS_MAX];
+    int n, queued;
+    uint8_t seq;
+
+    char flags = MANUAL_STATUS_ACK_I3C;
+    if (p->event_ack)
+      flags |= MANUAL_EVENTS_ACK |
+               ((p->event_seq << 1) & MANUAL_EVENTS_ACK_SEQ);
+
+    if (read_switch_events(p, ev, &n, &seq, &queued, flags))
+      return total ? total : -1;
+
+    // a valid reply means that the acknowledgement has been processed
+    p->event_ack = 0;
+
+    // events that have been handled before the last read failed
+    int skip = 0;
+    if (p->event_synced) {
+      const uint8_t handled = p->event_seq - seq;
+      if (handled < n)
+        skip = handled + 1;
+      else {
+        const uint8_t missed = seq - (uint8_t)(p->event_seq + 1);
+        if (missed) {
+          switch_events_missed += missed;
+          BLOG(LOG_WARNING, BLOG_SWITCH_EVENTS_MISSED, missed, p->dev.addr);
+        }
+      }
+    }
+    p->event_synced = 1;
+    p->event_seq = seq + n - 1;
+    p->event_ack = (n > 0);
+
+    int i;
+    for (i = skip; i < n; i++) {
+      BLOG(LOG_DEBUG, BLOG_SWITCH_EVENT, p->dev.addr, (uint8_t)(seq + i),
+           ev[i].switch_array);
+
+      int idx;
+      for (idx=1; idx<=PANEL_SWITCHES; idx++) {
+        const char sw = decode_switch_array(ev[i].switch_array, idx);
+        adjust_switch_state(p, idx, sw, ev[i].millis);
+      }
+      *last = ev[i].switch_array;
+    }
+    switch_events += n - skip;
+    total += n - skip;
+
+    // the empty reply also resets the switch interrupt
+    if (!n)
+      break;
   }
-   
-  char mqtt_payload[MQTT_MSG_MAXLEN];
 
+  return total;
+}
 
-  // Store manual mode; start with read-out
-  char old_manual = get_manual_mode();
-  
-  char run=1;
-  int i=0;
-  while(run) {
-    printf("****** %u\n", i++);
+/**
+  * Read the status of all manual control units in one pass, then handle
+  * them one by one.
+  * @return 0 on success, -1 if a status could not be read
+  */
+int manual_poll() {
+  static int i=0;
+
+  struct manual_status_t ms[MAX_PANELS];
+  char failed[MAX_PANELS];
+  int ret = 0;
+  int p;
+
+  // read the complete status and reset the I3C interrupt in one go
+  for (p = 0; p < I2C_dev.panels; p++) {
+    failed[p] = read_manual_status(&I2C_dev.panel[p], &ms[p],
+                                   MANUAL_STATUS_ACK_I3C);
+    if (failed[p]) {
+      BLOG(LOG_WARNING, BLOG_MANUAL_READ_FAILED, I2C_dev.panel[p].dev.addr);
+      ret = -1;
+    }
+  }
 
-    const char manual = get_manual_mode();
-    printf("Manual mode: %s\n", (manual==MANUAL_MODE_ON)?"on":"off");
-    
-/*
-    if (manual == MANUAL_MODE_ON)
-      set_manual_mode_led(LED_PATTERN_ON);
-    else
-      set_manual_mode_led(LED_PATTERN_OFF);
-*/
-    set_manual_mode_led(LED_PATTERN_OFF);
-   
-    // reset MQTT payload
-    mqtt_payload[0] = 0;
-
-    // if manual mode changed, send MQTT event
-    if (manual != old_manual) {
-      // prepare MQTT payload
-      strcpy(mqtt_payload, MQTT_MSG_BTNPRESS);
-    
-      // store
-      old_manual = manual;
+  // the switch changes since the last poll, in order; the status read
+  // above may already be older than the last event
+  for (p = 0; p < I2C_dev.panels; p++) {
+    struct panel_t *pl = &I2C_dev.panel[p];
+    if (failed[p] || !pl->events)
+      continue;
+
+    // find out once if the firmware has the event FIFO
+    if (pl->events < 0) {
+      pl->events = probe_switch_events(pl);
+      if (!pl->events)
+        syslog(LOG_INFO, "Manual control 0x%02x has no switch event FIFO.",
+                         pl->dev.addr);
+      if (pl->events <= 0)
+        continue;
     }
- 
-    // send MQTT message if there is payload
-    if (mqtt_payload[0] && mosq) {
-      int ret;
-      int mid;
-      ret = mosquitto_publish(
-                        mosq, 
-                        &mid, 
-                        MQTT_TOPIC,
-                        strlen(mqtt_payload), mqtt_payload,
-                        2, /* qos */
-                        false /* do not retain the event */
-                       );
-      if (ret != MOSQ_ERR_SUCCESS)
-        syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)",
-                        mqtt_payload, 
-                        ret,
-                        mosquitto_strerror(ret));
-      else
-        syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.",
-                         mqtt_payload, mid);
+
+    uint8_t last;
+    const int n = panel_drain_events(pl, &last);
+    if (n > 0)
+      ms[p].switch_array = last;
+    if (n >= 0) {
+      pl->event_fails = 0;
+      continue;
     }
 
-    
-    int idx;
-    for (idx=1; idx<5; idx++) {
-      const char sw = read_switch_state(idx);
-      printf("Switch %d status: %d\n", idx, sw);
+    /*
+     * The events stay queued and are read on the next poll, which comes
+     * soon after a failure. The status is only used if the FIFO keeps
+     * failing, as the queued events are older than the status.
+     */
+    ret = -1;
+    if (++pl->event_fails < MANUAL_EVENT_FAILS_MAX)
+      failed[p] = 1;
+    else if (pl->event_fails == MANUAL_EVENT_FAILS_MAX)
+      syslog(LOG_WARNING, "Reading the switch events of manual control 0x%02x "
+                          "failed %d times, using the status.",
+                          pl->dev.addr, pl->event_fails);
+  }
 
-      adjust_switch_state(idx, sw);      
-    }
+  for (p = 0; p < I2C_dev.panels; p++)
+    if (!failed[p])
+      panel_update(&I2C_dev.panel[p], &ms[p], i);
+  i++;
+
+  shmstate_publish(&state, &state_values);
+
+  return ret;
+}
+
+/**
+  * Arm the poll timer. The switch lock timing needs regular polls while
+  * a switch is engaged; otherwise we wait for the manual control unit to
+  * signal a change and only poll as a safety net.
+  * @param failed  non-zero if the last poll failed
+  */
+void arm_poll_timer(const int failed) {
+  long timeout = POLL_SAFETY_MS;
+  if (failed || (I3C_irq.fd < 0) || !switches_neutral())
+    timeout = POLL_FALLBACK_MS;
+  else if (I3C_int_active(&I3C_irq))
+    timeout = POLL_INT_BUSY_MS;
+
+  // on replay, the trace paces the polls; stop at its end
+  if (I2C_bus.replay) {
+    if (I2C_replay_finished(&I2C_bus))
+      loop.run = 0;
+    timeout = 1;
+  }
+
+  poll_deadline = monotonic_micros() + timeout*1000LL;
+  evloop_timer_set(&ev_poll, timeout, 0);
+}
+
+/**
+  * Drop the INT relay of an i2cd that has gone away. We poll until it
+  * is back, see int_reconnect.
+  */
+void int_drop() {
+  syslog(LOG_WARNING, "Lost the I3C INT relay, falling back to polling.");
+  evloop_del(&loop, &ev_int);
+  I3C_int_close(&I3C_irq);
+}
+
+/**
+  * Connect to the INT relay again after i2cd has been restarted.
+  */
+void int_reconnect() {
+  if ((I3C_irq.fd >= 0) || !I2C_bus.sock || I3C_init())
+    return;
+
+  ev_int.fd = I3C_irq.fd;
+  if (evloop_add(&loop, &ev_int, EPOLLIN)) {
+    syslog(LOG_WARNING, "Error %d on watching the I3C INT line.", errno);
+    I3C_int_close(&I3C_irq);
+  } else
+    syslog(LOG_INFO, "I3C INT relay re-established.");
+}
 
-    I3C_reset_manual();
+static void on_int(struct evloop_handler *h, uint32_t events) {
+  const int ret = I3C_int_ack(&I3C_irq);
+  if ((ret < 0) && I3C_irq.sock) {
+    int_drop();
+    arm_poll_timer(0);
+  }
+  // a release of the line only changes the poll interval, which the
+  // next poll takes care of
+  if (ret <= 0)
+    return;
+
+  polls_int++;
+  arm_poll_timer(manual_poll());
+}
+
+static void on_poll_timer(struct evloop_handler *h, uint32_t events) {
+  evloop_timer_ack(h);
+  polls_timer++;
+  if (poll_deadline)
+    metrics_observe(&poll_lateness, monotonic_micros() - poll_deadline);
+  int_reconnect();
+  arm_poll_timer(manual_poll());
+}
+
+static void on_signal(struct evloop_handler *h, uint32_t events) {
+  const int sig = evloop_signal_read(h);
+  syslog(LOG_INFO, "Signal %d received.", sig);
+  loop.run = 0;
+}
+
+/**
+  * Register the INT line, the poll timer and the signals with the event
+  * loop. Exits with an error message on failure.
+  */
+void events_init() {
+  if (evloop_init(&loop)) {
+    syslog(LOG_EMERG, "Error %d on event loop initialization!", errno);
+    exit(-1);
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  ev_signal.cb = on_signal;
+  ev_poll.cb = on_poll_timer;
+  if (evloop_signal_init(&ev_signal, &mask) ||
+      evloop_add(&loop, &ev_signal, EPOLLIN) ||
+      evloop_timer_init(&ev_poll) ||
+      evloop_add(&loop, &ev_poll, EPOLLIN)) {
+    syslog(LOG_EMERG, "Error %d on event loop initialization!", errno);
+    exit(-1);
+  }
+
+  ev_int.cb = on_int;
+  if (I3C_irq.fd >= 0) {
+    ev_int.fd = I3C_irq.fd;
+    if (evloop_add(&loop, &ev_int, EPOLLIN))
+      syslog(LOG_WARNING, "Error %d on watching the I3C INT line.", errno);
+  }
+}
 
-    // call the mosquitto loop to process messages
-    if (mosq) {
-      int ret; 
-      ret = mosquitto_loop(mosq, 100, 1);
-      // if failed, try to reconnect
-      if (ret)
-        mosquitto_reconnect(mosq);
+
+/**
+  * Register the metrics and serve them on METRICS_PORT.
+  */
+void metrics_init() {
+  int i;
+  for (i = 0; i < I2C_dev.controllers; i++)
+    I2C_metrics_register(&I2C_dev.controller[i].dev);
+  for (i = 0; i < I2C_dev.panels; i++)
+    I2C_metrics_register(&I2C_dev.panel[i].dev);
+  I2C_recovery_metrics_register(&I2C_bus);
+  metrics_counter("polls_total", "Device polls by trigger.",
+                  "trigger=\"int\"", &polls_int);
+  metrics_counter("polls_total", "Device polls by trigger.",
+                  "trigger=\"timer\"", &polls_timer);
+  metrics_counter("switch_events_total",
+                  "Switch events read from the manual control units.",
+                  NULL, &switch_events);
+  metrics_counter("switch_events_missed_total",
+                  "Switch events lost before they were read.",
+                  NULL, &switch_events_missed);
+  metrics_histogram("poll_timer_lateness_seconds",
+                    "Delay of the poll timer wake-up after its deadline.",
+                    NULL, &poll_lateness);
+
+  if (metrics_http_init(&loop, METRICS_PORT))
+    syslog(LOG_WARNING, "Error %d on serving metrics on port %d.",
+                        errno, METRICS_PORT);
+}
+
+/**
+  * Log the I2C statistics of all devices.
+  */
+void devices_stats_log() {
+  char name[32];
+  int i;
+
+  for (i = 0; i < I2C_dev.controllers; i++) {
+    snprintf(name, sizeof(name), "controller 0x%02x",
+             I2C_dev.controller[i].dev.addr);
+    I2C_stats_log(&I2C_dev.controller[i].dev, name);
+  }
+  for (i = 0; i < I2C_dev.panels; i++) {
+    snprintf(name, sizeof(name), "manual 0x%02x", I2C_dev.panel[i].dev.addr);
+    I2C_stats_log(&I2C_dev.panel[i].dev, name);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "f:b:")) != -1) {
+    switch (opt) {
+      case 'b': I2C_ADAPTER = atoi(optarg); break;
+      case 'f': DEVICE_TABLE = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-b bus] [-f device-table]\n", argv[0]);
+        return -1;
     }
+  }
 
-    if (sleep(1)) 
-      break;
+  // initialize the system logging
+  openlog("shuttercontrol", LOG_CONS | LOG_PID, LOG_USER);
+  syslog(LOG_INFO, "Starting shuttercontrol.");
+  if (blog_start(LOG_RING, "shuttercontrol", LOG_DEBUG, LOG_INFO))
+    syslog(LOG_WARNING, "Error %d on starting the log ring, logging to syslog.",
+                        errno);
+
+  shmstate_clear(&state_values);
+  if (shmstate_create(&state, STATE_FILE))
+    syslog(LOG_WARNING, "Error %d on creating the state file %s.",
+                        errno, STATE_FILE);
+
+  I2C_init();
+  if (I3C_init())
+    syslog(LOG_WARNING, "Error %d on I3C INT request, falling back to polling.",
+                        errno);
+  stop_all_shutters();
+  clear_stored_switch_state();
+
+  int p;
+  for (p = 0; p < I2C_dev.panels; p++) {
+    beep(&I2C_dev.panel[p], 0x05);
+    set_manual_mode_led(&I2C_dev.panel[p], LED_PATTERN_FAST);
   }
+  sleep(1);
+  for (p = 0; p < I2C_dev.panels; p++)
+    set_manual_mode_led(&I2C_dev.panel[p], LED_PATTERN_OFF);
+ 
+  // initialize MQTT   
+  mosquitto_lib_init();
+  
+  if (mqtt_pub_start(&mqtt, "shuttercontrol", MQTT_HOST, MQTT_PORT, MQTT_SPOOL))
+    syslog(LOG_ERR, "Error %d on starting the MQTT publisher.", errno);
+  else
+    mqtt_running = 1;
+
+  events_init();
+  metrics_init();
+
+  // Store manual mode; start with read-out
+  for (p = 0; p < I2C_dev.panels; p++)
+    I2C_dev.panel[p].manual = get_manual_mode(&I2C_dev.panel[p]);
+
+  // first poll right away, then wait for events
+  evloop_timer_set(&ev_poll, 1, 0);
+  if (evloop_run(&loop))
+    syslog(LOG_ERR, "Error %d in the event loop.", errno);
 
   stop_all_shutters();
 
   // clean-up MQTT
-  if (mosq) {
-    mosquitto_disconnect(mosq);
-    mosquitto_destroy(mosq);   
-  }
+  if (mqtt_running)
+    mqtt_pub_stop(&mqtt);
   mosquitto_lib_cleanup();
+  metrics_http_close();
+  evloop_close(&loop);
 
+  // clean-up I2C
+  devices_stats_log();
+  I2C_recovery_stats_log(&I2C_bus);
+  I2C_bus_close(&I2C_bus);
+  I3C_int_close(&I3C_irq);
+  shmstate_close(&state);
 
+  blog_stop();
   syslog(LOG_INFO, "Shuttercontrol finished.");
   closelog();
     
@@ -0,0 +1,151 @@
+/**
+ * @file statedump.c
+ * @author Stefan Haun (tux@netz39.de)
+ *
+ * @brief Print the live state published by a daemon
+ *
+ * Reads the shared memory state file of doorstate or shuttercontrol
+ * without any I2C traffic. By default, all known values are printed as
+ * name=value lines, which a shell script can eval.
+ *
+ * With -d, only the door status byte is printed in the format of
+ * i2cctl, so it replaces "i2cctl 0x23 0x30" in the door scripts.
+ *
+ * With -w, statedump waits until the values change before printing, so
+ * a script does not have to poll.
+ *
+ * With -m, the state must not be older than the given number of
+ * seconds, and the daemon must still be running; otherwise the exit
+ * code is 3, so a script can fall back to i2cctl.
+ *
+ * Usage: statedump [-d] [-w] [-m max-age] FILE
+ */
+
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "../i2cbus/shmstate.h"
+
+// interval for checking the state while waiting for a change
+#define WAIT_INTERVAL_MS 20
+
+static int64_t now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec*1000000LL + ts.tv_nsec/1000L;
+}
+
+/**
+ * Print a value as name=value, unless it is unknown.
+ */
+static void print_value(const char *name, int idx, int value) {
+  if (value == SHMSTATE_UNKNOWN)
+    return;
+
+  if (idx)
+    printf("%s%d=%d\n", name, idx, value);
+  else
+    printf("%s=%d\n", name, value);
+}
+
+static void print_snapshot(const struct shmstate *s,
+                           const struct shmstate_snapshot *snap) {
+  const struct shmstate_values *v = &snap->values;
+  int i;
+
+  printf("pid=%d\n", s->hdr->pid);
+  printf("alive=%d\n", shmstate_alive(s) ? 1 : 0);
+  printf("updated=%lld.%06lld\n", (long long)snap->updated_usec / 1000000LL,
+                                  (long long)snap->updated_usec % 1000000LL);
+  printf("changed=%lld.%06lld\n", (long long)snap->changed_usec / 1000000LL,
+                                  (long long)snap->changed_usec % 1000000LL);
+  printf("updates=%u\n", snap->updates);
+  printf("changes=%u\n", snap->changes);
+
+  if (v->door_status != SHMSTATE_UNKNOWN)
+    printf("door_status=0x%02x\n", v->door_status);
+  print_value("door_closed", 0, v->door_closed);
+  print_value("lock_open", 0, v->lock_open);
+  print_value("green_active", 0, v->green_active);
+  print_value("red_active", 0, v->red_active);
+  for (i = 0; i < SHMSTATE_PANELS; i++)
+    print_value("manual_mode", i+1, v->manual_mode[i]);
+  for (i = 0; i < SHMSTATE_SWITCHES; i++)
+    print_value("switch", i+1, v->switch_state[i]);
+  for (i = 0; i < SHMSTATE_SHUTTERS; i++)
+    print_value("shutter", i+1, v->shutter_state[i]);
+}
+
+int main(int argc, char *argv[]) {
+  int door = 0;
+  int wait = 0;
+  long max_age = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "dwm:")) != -1) {
+    switch (opt) {
+      case 'd': door = 1; break;
+      case 'w': wait = 1; break;
+      case 'm': max_age = strtol(optarg, NULL, 0); break;
+      default: argc = 0;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, "Usage: %s [-d] [-w] [-m max-age] FILE\n", argv[0]);
+    return 2;
+  }
+
+  const char *path = argv[optind];
+  struct shmstate s;
+  if (shmstate_open(&s, path)) {
+    fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  struct shmstate_snapshot snap;
+  if (shmstate_read(&s, &snap)) {
+    fprintf(stderr, "Error: could not read %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if (wait) {
+    const uint32_t changes = snap.changes;
+    const struct timespec ts = { 0, WAIT_INTERVAL_MS * 1000000L };
+
+    // a daemon that has gone away will not change anything
+    while ((snap.changes == changes) && shmstate_alive(&s)) {
+      nanosleep(&ts, NULL);
+      if (shmstate_read(&s, &snap)) {
+        fprintf(stderr, "Error: could not read %s: %s\n", path, strerror(errno));
+        return 1;
+      }
+    }
+  }
+
+  if ((max_age >= 0) &&
+      (!shmstate_alive(&s) ||
+       (now_usec() - snap.updated_usec > max_age * 1000000LL))) {
+    fprintf(stderr, "Error: the state in %s is stale\n", path);
+    return 3;
+  }
+
+  if (door) {
+    if (snap.values.door_status == SHMSTATE_UNKNOWN) {
+      fprintf(stderr, "Error: %s has no door status\n", path);
+      return 1;
+    }
+    printf("0x%02x\n", snap.values.door_status);
+  } else
+    print_snapshot(&s, &snap);
+
+  shmstate_close(&s);
+  return 0;
+}
@@ -40,11 +40,26 @@
   SREG = _sreg;
 
 
-/// Define the debounce histories
-static uint8_t dbh_btnRed;
-static uint8_t dbh_btnGreen;
-static uint8_t dbh_sigDoor;
-static uint8_t dbh_sigLock;
+/// Define the debounce states of the buttons, all inputs of a port at once
+static struct debounce_port dbp_portA;
+static struct debounce_port dbp_portB;
+
+// the buttons on the ports
+#define IN_BTN_RED    (1 << PA7)
+#define IN_BTN_GREEN  (1 << PB0)
+
+/*
+ * The door and lock contacts rattle with the door, they are debounced
+ * slower than the buttons: the integrator needs this many samples
+ * (4.096ms each) for a change.
+ */
+#ifndef DEBOUNCE_DOOR_SAMPLES
+#define DEBOUNCE_DOOR_SAMPLES 24
+#endif
+static const struct debounce_config dbc_signal =
+  DEBOUNCE_INTEGRATOR(DEBOUNCE_DOOR_SAMPLES);
+static struct debounce_input dbi_sigDoor;
+static struct debounce_input dbi_sigLock;
 
 
 /// State Handling Infrastructure
@@ -63,7 +78,11 @@ static uint8_t dbh_sigLock;
  * FC Force Close
  * FO Force Open
  */
-static uint8_t inputStatusByte = 0;
+/*
+ * The ISB is changed by the I2C commands in the USI interrupt, too, so
+ * the main loop must change it with interrupts disabled.
+ */
+static volatile uint8_t inputStatusByte = 0;
 
 // ISB masks for setISB and clearISB
 #define ISB_GB (1 << 5)
@@ -92,29 +111,114 @@ inline uint8_t getInputStatusByte() {
   return inputStatusByte;
 }
 
-void updateInputState(uint8_t *history, const uint8_t mask) {
-  if (debounce_is_button_pressed(history)
-      || debounce_is_button_down(history)) {
+void updateInputState(struct debounce_port *port, const uint8_t in,
+                      const uint8_t mask) {
+  // the debounced state is a single byte, no need to block the ISR
+  if (debounce_port_down(port, in))
     setISB(mask);
-  }
-  if (debounce_is_button_released(history)
-      || debounce_is_button_up(history)) {
+  else
     clearISB(mask);
-  }
 }
 
-void waitForClearState(uint8_t *history, const uint8_t mask) {
-  bool stateOk = false;
-  while (!stateOk) {
-    if (debounce_is_button_down(history)) {
-      setISB(mask);
-      stateOk = true;
-    }
-    if (debounce_is_button_up(history)) {
-      clearISB(mask);
-      stateOk = true;
-    }
+void updateSignalState(const struct debounce_input *input, const uint8_t mask) {
+  if (debounce_input_down(input))
+    setISB(mask);
+  else
+    clearISB(mask);
+}
+
+
+/// Event FIFO
+/*
+ * Every ISB change seen in twi_idle_callback is queued with a sequence
+ * number and the tick counter, so the master gets all transitions in
+ * order, also a button press that is over before it polls. When the
+ * FIFO is full, the oldest event is dropped; the master sees the gap in
+ * the sequence numbers.
+ *
+ * CMD_EVENT only returns the oldest event. The master acknowledges it
+ * with the next CMD_EVENT, so an event is not lost if the reply is
+ * garbled and the command is repeated: data bit 3 set and bits 2-0 the
+ * low bits of the sequence number remove the oldest event if it has
+ * this number.
+ *
+ * The FIFO is filled in the main loop and drained in the USI interrupt.
+ */
+// must be a power of two
+#define EVENT_FIFO_SIZE 8
+
+struct isb_event {
+  uint8_t seq;
+  uint8_t isb;
+  uint8_t prev;
+  uint16_t tick;
+};
+
+static struct isb_event eventFifo[EVENT_FIFO_SIZE];
+static uint8_t eventHead = 0;
+static uint8_t eventCount = 0;
+// sequence number of the last queued event
+static uint8_t eventSeq = 0;
+
+/*
+ * Timer ticks from the TMR0 ISR, one per 128 timer counts with prescaler
+ * 256, i.e. 4.096ms at 8 MHz.
+ */
+static volatile uint16_t tickCounter = 0;
+
+void pushEvent(const uint8_t prev, const uint8_t isb) {
+  store_SREG();
+
+  if (eventCount == EVENT_FIFO_SIZE) {
+    // drop the oldest event
+    eventHead = (eventHead + 1) & (EVENT_FIFO_SIZE - 1);
+    eventCount--;
   }
+
+  struct isb_event *ev =
+    &eventFifo[(eventHead + eventCount) & (EVENT_FIFO_SIZE - 1)];
+  ev->seq = ++eventSeq;
+  ev->isb = isb;
+  ev->prev = prev;
+  ev->tick = tickCounter;
+  eventCount++;
+
+  restore_SREG();
+}
+
+// data of CMD_EVENT
+#define EVENT_ACK      0x08
+#define EVENT_ACK_SEQ  0x07
+
+/**
+ * Remove the oldest event if the master has acknowledged it; only called
+ * from the USI interrupt.
+ * \param data the data of CMD_EVENT
+ */
+void ackEvent(const uint8_t data) {
+  if (!(data & EVENT_ACK) || !eventCount)
+    return;
+
+  // a repeated acknowledgement does not match the next event
+  if ((eventFifo[eventHead].seq & EVENT_ACK_SEQ) != (data & EVENT_ACK_SEQ))
+    return;
+
+  eventHead = (eventHead + 1) & (EVENT_FIFO_SIZE - 1);
+  eventCount--;
+}
+
+/**
+ * Get the oldest event without removing it; only called from the USI
+ * interrupt.
+ * \return false iif the FIFO is empty
+ */
+bool peekEvent(struct isb_event *ev) {
+  if (!eventCount)
+    return false;
+
+  *ev = eventFifo[eventHead];
+
+  return true;
 }
 
 
@@ -188,11 +292,29 @@ inline uint8_t i3c_state() {
  * CMD_OPEN        (I²C 90)
  * CMD_CLOSE       (I²C A0)
  * CMD_STATE       (I²C 30)
+ * CMD_EVENT       (I²C C0)
+ *
+ * CMD_EVENT removes the acknowledged event (data 1SSS, see ackEvent)
+ * from the event FIFO and replies with the oldest remaining ISB change
+ * in 7 bytes, each followed by its inversion:
+ *
+ *   status (1 event, 2 FIFO empty), sequence number, ISB after the
+ *   change, ISB before the change, tick counter low and high byte,
+ *   number of queued events including this one
+ *
+ * If the FIFO is empty, the reply carries the sequence number of the
+ * last event and the current ISB. The I³C interrupt is reset when the
+ * FIFO has been drained.
  */
 #define CMD_RESET       0x00
 #define CMD_OPEN        0x01
 #define CMD_CLOSE       0x02
 #define CMD_STATE       0x03
+#define CMD_EVENT       0x04
+
+#define EVENT_LENGTH    7
+#define EVENT_STATUS_EVENT 1
+#define EVENT_STATUS_EMPTY 2
 
 static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t input_buffer_length, 
@@ -203,7 +325,7 @@ static void twi_callback(uint8_t buffer_size,
   if (input_buffer_length) {
     const char parity = (input_buffer[0] & 0x80) >> 7;
     const char cmd  = (input_buffer[0] & 0x70) >> 4;
-    //const char data = input_buffer[0] & 0x0F;
+    const char data = input_buffer[0] & 0x0F;
     
     // check parity
     char v = input_buffer[0] & 0x7F;
@@ -247,6 +369,40 @@ static void twi_callback(uint8_t buffer_size,
 	// reset I³C interrupt
 	i3c_tristate();
       }; break;
+      case CMD_EVENT: {
+	struct isb_event ev;
+	uint8_t status = EVENT_STATUS_EVENT;
+
+	ackEvent(data);
+	if (!peekEvent(&ev)) {
+	  status = EVENT_STATUS_EMPTY;
+	  ev.seq = eventSeq;
+	  ev.isb = getInputStatusByte();
+	  ev.prev = ev.isb;
+	  ev.tick = tickCounter;
+	}
+
+	const uint8_t reply[EVENT_LENGTH] = {
+	  status,
+	  ev.seq,
+	  ev.isb,
+	  ev.prev,
+	  ev.tick & 0xff,
+	  ev.tick >> 8,
+	  eventCount
+	};
+
+	uint8_t i;
+	for (i = 0; i < EVENT_LENGTH; i++) {
+	  output_buffer[2*i]   = reply[i];
+	  output_buffer[2*i+1] = ~(reply[i]);
+	}
+	*output_buffer_length = 2*EVENT_LENGTH;
+
+	// reset I³C interrupt when everything has been read
+	if (!eventCount)
+	  i3c_tristate();
+      }; return;
     }
 
     *output_buffer_length = 2;
@@ -283,11 +439,11 @@ void updatePorts() {
 }
 
 /*
- * Button update counter from the TMR0 ISR
+ * Debounce update counter from the TMR0 ISR
  *
- * This counter enumerates the round-robin passes in the ISR.
+ * This counter enumerates the input updates in the ISR.
  */
-static uint8_t rrUpdateCounter = 0;
+static uint8_t inputUpdateCounter = 0;
 
 static void twi_idle_callback(void) {
   // decide if the idle call should be executed
@@ -296,11 +452,10 @@ static void twi_idle_callback(void) {
   {
     store_SREG();
 
-    // evaluate the states only if there are at least two passes in the
-    // debounce round-robin
-    if (rrUpdateCounter >= 2) {
+    // evaluate the states only after the inputs have been updated
+    if (inputUpdateCounter) {
       exec = true;
-      rrUpdateCounter = 0;
+      inputUpdateCounter = 0;
     }
 
     restore_SREG();
@@ -309,20 +464,22 @@ static void twi_idle_callback(void) {
   if (!exec)
     return;
 
+  // do not let an I2C command in between, it would be overwritten
+  store_SREG();
 
   // store the old input state
   const uint8_t oldISB = getInputStatusByte();
 
-  // set the ISB according to the debounce histories
+  // set the ISB according to the debounced inputs
 
   // Green Button state
-  updateInputState(&dbh_btnGreen, ISB_GB);
+  updateInputState(&dbp_portB, IN_BTN_GREEN, ISB_GB);
   // Red Button state
-  updateInputState(&dbh_btnRed, ISB_RB);
+  updateInputState(&dbp_portA, IN_BTN_RED, ISB_RB);
   // Door-closed state
-  updateInputState(&dbh_sigDoor, ISB_DO);
+  updateSignalState(&dbi_sigDoor, ISB_DO);
   // Lock-open state
-  updateInputState(&dbh_sigLock, ISB_LC);
+  updateSignalState(&dbi_sigLock, ISB_LC);
 
   /* With the following structure the buttons override subsequent
     * commands that might be issued by the I2C master while the button
@@ -353,19 +510,17 @@ static void twi_idle_callback(void) {
   // Set outputs according to ISB
   updatePorts();
 
-  // trigger a state change if the ISB has changed
-  if (getInputStatusByte() != oldISB)
+  // queue and trigger a state change if the ISB has changed
+  if (getInputStatusByte() != oldISB) {
+    pushEvent(oldISB, getInputStatusByte());
     i3c_stateChange();
+  }
+
+  restore_SREG();
 }
 
 /// Initialization
 void init(void) {
-  // Init debounce histories
-  debounce_init_button(&dbh_btnRed);
-  debounce_init_button(&dbh_btnGreen);
-  debounce_init_button(&dbh_sigDoor);
-  debounce_init_button(&dbh_sigLock);
-
   /*
    * Pin-Config PortA:
    *   PA0: IN  Door State (0 == Closed)
@@ -398,6 +553,12 @@ void init(void) {
   /*  disable interrupts  */
   cli();
 
+  // Init debounce states with the current inputs
+  debounce_init_port(&dbp_portA, PINA);
+  debounce_init_port(&dbp_portB, PINB);
+  debounce_init_input(&dbi_sigDoor, &dbc_signal, PINA, PA1);
+  debounce_init_input(&dbi_sigLock, &dbc_signal, PINA, PA0);
+
   // Do not connect the timer overflow with the I/O port
   TCCR0A = 0;
   // Set prescaler and start the timer
@@ -430,7 +591,7 @@ int main(void)
 
   /*
    * Note: The above sequence generates a 2000ms pause, which should
-   *       allow the dechatter-histories to settle.
+   *       allow the debounced inputs to settle.
    *
    *       If the blinking should be removed, replace by an appropriate
    *       sleep command!
@@ -440,8 +601,8 @@ int main(void)
    * Cold start: we need to find out the door and lock state, as
    * they may have been set without us seeing the events.
    */
-  waitForClearState(&dbh_sigDoor, ISB_DO);
-  waitForClearState(&dbh_sigLock, ISB_LC);
+  updateSignalState(&dbi_sigDoor, ISB_DO);
+  updateSignalState(&dbi_sigLock, ISB_LC);
 
   // set force state according to lock state
   if (getMaskedISB(ISB_LC))
@@ -461,39 +622,22 @@ int main(void)
 
 
 /// Interrupt handling
-// Round-Robin selector
-static uint8_t rrSelect = 0;
 ISR (TIM0_OVF_vect)
 {
   store_SREG();
   
-  /* update the debounce histories */
-  // round-robin the updates, that is still fast enough
-  // and otherwise the ISR gets clogged
-  ++rrSelect;
-  switch (rrSelect) {
-    case 1: {
-      // Green, door-open button
-      debounce_update_button(&dbh_btnGreen, PINB, PB0);
-    }; break;
-    case 2: {
-      // Red, door-close button
-      debounce_update_button(&dbh_btnRed, PINA, PA7);
-    }; break;
-    case 3: {
-      // door-is-closed signal
-      debounce_update_button(&dbh_sigDoor, PINA, PA1);
-    }; break;
-    case 4: {
-      // lock-is-open signal
-      debounce_update_button(&dbh_sigLock, PINA, PA0);
-    }; break;
-    default: {
-      rrSelect = 0;
-      // update the round-robin counter
-      ++rrUpdateCounter;
-    }
-  } // switch
+  /* update the debounced inputs */
+  // buttons, all pins of a port at once: red on port A, green on port B
+  debounce_update_port(&dbp_portA, PINA);
+  debounce_update_port(&dbp_portB, PINB);
+  // door-is-closed and lock-is-open signals
+  const uint8_t pina = PINA;
+  debounce_update_input(&dbi_sigDoor, &dbc_signal, pina, PA1);
+  debounce_update_input(&dbi_sigLock, &dbc_signal, pina, PA0);
+  ++inputUpdateCounter;
+
+  // time base for the event FIFO
+  ++tickCounter;
 
   // Shorten the timer interrupt period
   TCNT0 = 0x80;
@@ -132,6 +132,16 @@ static always_inline void twi_reset(void)
 	twi_reset_state();
 }
 
+static always_inline void process_input(void)
+{
+	output_buffer_length	= 0;
+	output_buffer_current	= 0;
+
+	data_callback(buffer_size, input_buffer_length, input_buffer, &output_buffer_length, output_buffer);
+
+	input_buffer_length		= 0;
+}
+
 static always_inline void twi_init(void)
 {
 #if defined(USIPP)
@@ -227,7 +237,21 @@ again:
 				ss_state = ss_state_address_selected;
 
 				if(direction)					// read request from master
+				{
 					of_state = of_state_send_data;
+
+					// repeated start after a write phase: answer the command
+					// right now (scl is held low meanwhile), so the master
+					// reads the reply within the same transaction instead
+					// of the reply to the previous command
+					if(input_buffer_length)
+					{
+						if(stats_enabled)
+							local_frames_count++;
+
+						process_input();
+					}
+				}
 				else							// write request from master
 					of_state = of_state_receive_data;
 
@@ -381,15 +405,16 @@ void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
 
 				case(ss_state_data_processed):
 				{
-					if(stats_enabled)
-						local_frames_count++;
-
-					output_buffer_length	= 0;
-					output_buffer_current	= 0;
-
-					data_callback(buffer_size, input_buffer_length, input_buffer, &output_buffer_length, output_buffer);
-
-					input_buffer_length		= 0;
+					// write-only transaction, the reply is read by the next one;
+					// combined write/read transactions have already been
+					// answered in the overflow interrupt
+					if(input_buffer_length)
+					{
+						if(stats_enabled)
+							local_frames_count++;
+
+						process_input();
+					}
 
 					break;
 				}